@@ -0,0 +1,88 @@
+/*
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ *
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+/*
+ * Cost of the log calls the scheduler makes for every task: the ones of
+ * allocate, taskEpilogue and updateDependencies, with the levels and
+ * messages they use. Prints the microseconds per task.
+ *
+ * Usage: log-calls logfile label loglevel
+ *
+ * LOG_MACROS uses the LOG_RECORD and LOG_RECORDF call sites, and
+ * LOG_WRITER starts the background writer. Without them, it measures the
+ * log as it was before those existed.
+ */
+
+#include "greasylog.h"
+#include "greasytimer.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+static string host = "s02r2b47-ib0.bsc";
+
+int main(int argc, char** argv) {
+
+  GreasyLog* log = GreasyLog::getInstance();
+  int tasks = 200000, worker = 3;
+
+  if (argc != 4) {
+    fprintf(stderr, "Usage: log-calls logfile label loglevel\n");
+    return 1;
+  }
+
+  log->logToFile(argv[1]);
+  log->setLogLevel((GreasyLog::LogLevels) atoi(argv[3]));
+#ifdef LOG_WRITER
+  log->startWriter(4096);
+#endif
+
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (int i = 0; i < tasks; i++) {
+#ifdef LOG_MACROS
+    LOG_RECORD(log, GreasyLog::devel, "BasicEngine::allocate", "Entering...");
+    LOG_RECORDF(log, GreasyLog::info, "", "Allocating task %d", i);
+    LOG_RECORD(log, GreasyLog::debug, "BasicEngine::allocate", "Task " + toString(i) + " to worker " + toString(worker) + " on node " + host);
+    LOG_RECORD(log, GreasyLog::devel, "BasicEngine::allocate", "Exiting...");
+    LOG_RECORD(log, GreasyLog::devel, "AbstractSchedulerEngine::taskEpilogue", "Entering...");
+    LOG_RECORDF(log, GreasyLog::info, "", "Task %d located in line %d completed successfully on node %s. Elapsed: %s",
+                i, i, host.c_str(), GreasyTimer::secsToTime(3).c_str());
+    LOG_RECORD(log, GreasyLog::devel, "AbstractSchedulerEngine::updateDependencies", "Entering...");
+    LOG_RECORD(log, GreasyLog::devel, "AbstractSchedulerEngine::updateDependencies", "Exiting...");
+    LOG_RECORD(log, GreasyLog::devel, "AbstractSchedulerEngine::taskEpilogue", "Exiting...");
+#else
+    log->record(GreasyLog::devel, "BasicEngine::allocate", "Entering...");
+    log->record(GreasyLog::info, "Allocating task " + toString(i));
+    log->record(GreasyLog::debug, "BasicEngine::allocate", "Task " + toString(i) + " to worker " + toString(worker) + " on node " + host);
+    log->record(GreasyLog::devel, "BasicEngine::allocate", "Exiting...");
+    log->record(GreasyLog::devel, "AbstractSchedulerEngine::taskEpilogue", "Entering...");
+    log->record(GreasyLog::info, "Task " + toString(i) + " located in line " + toString(i) + " completed successfully on node "
+                + host + ". Elapsed: " + GreasyTimer::secsToTime(3));
+    log->record(GreasyLog::devel, "AbstractSchedulerEngine::updateDependencies", "Entering...");
+    log->record(GreasyLog::devel, "AbstractSchedulerEngine::updateDependencies", "Exiting...");
+    log->record(GreasyLog::devel, "AbstractSchedulerEngine::taskEpilogue", "Exiting...");
+#endif
+  }
+  chrono::steady_clock::time_point end = chrono::steady_clock::now();
+  log->logClose();
+
+  printf("%s: %.3f us/task\n", argv[2], chrono::duration<double, micro>(end - start).count()/tasks);
+  return 0;
+
+}
@@ -0,0 +1,35 @@
+#!/bin/bash
+#
+# Cost of the log calls made for every task, with log-calls.cpp built
+# against the sources of a Greasy tree. The build tree is the one where
+# configure was run, which has config.h. Prints the microseconds per task
+# at log levels 1, 3 and 5, three runs each.
+#
+# Usage: log-calls.sh sourcetree buildtree
+#
+
+SRC=$1/src
+BUILD=$2
+BENCHDIR=$(cd "$(dirname "$0")" && pwd)
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+
+if [ ! -f "$SRC/greasylog.h" ] || [ ! -f "$BUILD/config.h" ]; then
+  echo "Usage: log-calls.sh sourcetree buildtree"
+  exit 1
+fi
+
+# Older trees have neither the macros nor the writer thread
+FLAGS=""
+grep -q "define LOG_RECORD" "$SRC/greasylog.h" && FLAGS="$FLAGS -DLOG_MACROS"
+grep -q "startWriter" "$SRC/greasylog.h" && FLAGS="$FLAGS -DLOG_WRITER"
+
+# Older sources also miss an include of ctime
+g++ -O2 -std=c++11 -pthread -include ctime $FLAGS -I"$SRC" -I"$BUILD" "$BENCHDIR/log-calls.cpp" \
+  "$SRC/greasylog.cpp" "$SRC/greasytimer.cpp" -o "$WORKDIR/log-calls" || exit 1
+
+for level in 1 3 5; do
+  for run in 1 2 3; do
+    "$WORKDIR/log-calls" "$WORKDIR/log" "LogLevel $level" $level
+  done
+done
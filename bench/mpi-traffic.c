@@ -0,0 +1,79 @@
+/*
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ *
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+/*
+ * PMPI interposer that counts the point to point messages and bytes of
+ * rank 0, the master of the mpi engine, and prints them at MPI_Finalize.
+ * Collectives, such as the startup gather and the broadcast of the task
+ * table, are not counted. Load it with LD_PRELOAD.
+ */
+
+#include <mpi.h>
+#include <stdio.h>
+
+static long sentMessages = 0, sentBytes = 0, recvMessages = 0, recvBytes = 0;
+
+static int typeSize(MPI_Datatype type) {
+
+  int size;
+  PMPI_Type_size(type, &size);
+  return size;
+
+}
+
+int MPI_Send(const void* buf, int count, MPI_Datatype type, int dest, int tag, MPI_Comm comm) {
+
+  sentMessages++;
+  sentBytes += (long) count*typeSize(type);
+  return PMPI_Send(buf, count, type, dest, tag, comm);
+
+}
+
+int MPI_Isend(const void* buf, int count, MPI_Datatype type, int dest, int tag, MPI_Comm comm, MPI_Request* request) {
+
+  sentMessages++;
+  sentBytes += (long) count*typeSize(type);
+  return PMPI_Isend(buf, count, type, dest, tag, comm, request);
+
+}
+
+int MPI_Recv(void* buf, int count, MPI_Datatype type, int source, int tag, MPI_Comm comm, MPI_Status* status) {
+
+  MPI_Status local;
+  int err, size;
+
+  if (status == MPI_STATUS_IGNORE) status = &local;
+  err = PMPI_Recv(buf, count, type, source, tag, comm, status);
+  PMPI_Get_count(status, MPI_BYTE, &size);
+  recvMessages++;
+  recvBytes += size;
+  return err;
+
+}
+
+int MPI_Finalize(void) {
+
+  int rank;
+
+  PMPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  if (rank == 0) fprintf(stderr, "mpi-traffic: rank 0 sent %ld messages (%ld bytes) and received %ld messages (%ld bytes)\n",
+                         sentMessages, sentBytes, recvMessages, recvBytes);
+  return PMPI_Finalize();
+
+}
@@ -0,0 +1,33 @@
+#!/bin/bash
+#
+# Messages and bytes the master of the mpi engine exchanges per task.
+# Runs TASKS "/bin/true" tasks on NP ranks with the interposer of
+# mpi-traffic.c, and prints the counts of rank 0 divided by the tasks.
+# Extra arguments are passed to mpirun, for example "-x GREASY_MPIPREFETCHDEPTH=4".
+#
+# Usage: mpi-traffic.sh greasybin [mpirun arguments]
+#
+
+GREASYBIN=$1
+shift
+TASKS=${TASKS:-2000}
+NP=${NP:-4}
+BENCHDIR=$(cd "$(dirname "$0")" && pwd)
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+
+if [ ! -x "$GREASYBIN" ]; then
+  echo "Usage: mpi-traffic.sh greasybin [mpirun arguments]"
+  exit 1
+fi
+
+mpicc -O2 -shared -fPIC "$BENCHDIR/mpi-traffic.c" -o "$WORKDIR/libmpitraffic.so" || exit 1
+
+cd "$WORKDIR"
+echo "Engine=mpi" > greasy.conf
+for i in $(seq 0 $((TASKS-1))); do echo "/bin/true task-$i-with-some-args"; done > tasks.txt
+
+GREASY_LOGFILE=$WORKDIR/greasy.log GREASY_LOGLEVEL=2 \
+  mpirun -np $NP -x LD_PRELOAD=$WORKDIR/libmpitraffic.so -x GREASY_LOGFILE -x GREASY_LOGLEVEL "$@" \
+  "$GREASYBIN" tasks.txt 2>&1 | grep "^mpi-traffic:" | \
+  tr -d '()' | awk -v n=$TASKS '{ printf "%.2f msgs/task, %.1f + %.1f bytes/task (sent + received)\n", ($5+$11)/n, $7/n, $13/n }'
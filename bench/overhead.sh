@@ -0,0 +1,28 @@
+#!/bin/bash
+#
+# Scheduler overhead of a run of short tasks, as reported in the summary:
+# TASKS "/bin/true" tasks on NWORKERS workers of the basic engine. Prints
+# the overhead, turnaround and idle lines of the summary.
+#
+# Usage: overhead.sh greasybin
+#
+
+GREASYBIN=$1
+TASKS=${TASKS:-2000}
+NWORKERS=${NWORKERS:-8}
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+
+if [ ! -x "$GREASYBIN" ]; then
+  echo "Usage: overhead.sh greasybin"
+  exit 1
+fi
+
+cd "$WORKDIR"
+echo "Engine=basic" > greasy.conf
+for i in $(seq 1 $TASKS); do echo "/bin/true"; done > tasks.txt
+
+GREASY_LOGFILE=$WORKDIR/greasy.log GREASY_NWORKERS=$NWORKERS GREASY_BASICREMOTEMETHOD=ssh \
+  "$GREASYBIN" tasks.txt > /dev/null 2>&1
+
+grep -h -E "Summary|Scheduler overhead|Turnaround overhead|Worker idle|Master cpu per dispatch" greasy.log | cut -d' ' -f3-
@@ -0,0 +1,71 @@
+/*
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ *
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+/*
+ * Cost of feeding the scheduler overhead histograms: the queued,
+ * dispatched, started and finished events of 200k synthetic tasks, first
+ * alone and then with the master cpu read around every dispatch. Prints
+ * the microseconds per task of each.
+ */
+
+#include "greasystats.h"
+#include "greasytimer.h"
+#include <cstdio>
+
+int main() {
+
+  GreasyStats* stats = GreasyStats::getInstance();
+  int tasks = 200000;
+  long long start, events, dispatches;
+  vector<GreasyTask*> taskList;
+
+  for (int i = 0; i < 2*tasks; i++) {
+    taskList.push_back(new GreasyTask(i+1, "/bin/true"));
+    taskList[i]->setWorker(1 + i%8);
+  }
+
+  stats->start();
+
+  start = GreasyTimer::usecsNow();
+  for (int i = 0; i < tasks; i++) {
+    stats->record(GreasyEvents::queued, taskList[i]);
+    stats->record(GreasyEvents::dispatched, taskList[i]);
+    stats->record(GreasyEvents::started, taskList[i]);
+    taskList[i]->setElapsedTime(5);
+    stats->record(GreasyEvents::finished, taskList[i]);
+  }
+  events = GreasyTimer::usecsNow() - start;
+
+  start = GreasyTimer::usecsNow();
+  for (int i = tasks; i < 2*tasks; i++) {
+    stats->record(GreasyEvents::queued, taskList[i]);
+    stats->beginDispatch();
+    stats->record(GreasyEvents::dispatched, taskList[i]);
+    stats->endDispatch();
+    stats->record(GreasyEvents::started, taskList[i]);
+    taskList[i]->setElapsedTime(5);
+    stats->record(GreasyEvents::finished, taskList[i]);
+  }
+  dispatches = GreasyTimer::usecsNow() - start;
+
+  printf("%.3f us per task for the four events, %.3f us more per dispatch for the cpu reads\n",
+         (double) events/tasks, (double) (dispatches - events)/tasks);
+  return 0;
+
+}
@@ -0,0 +1,25 @@
+#!/bin/bash
+#
+# Cost of feeding the scheduler overhead histograms, with stats-record.cpp
+# built against the sources of a Greasy tree. The build tree is the one
+# where configure was run, which has config.h. Three runs.
+#
+# Usage: stats-record.sh sourcetree buildtree
+#
+
+SRC=$1/src
+BUILD=$2
+BENCHDIR=$(cd "$(dirname "$0")" && pwd)
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+
+if [ ! -f "$SRC/greasystats.h" ] || [ ! -f "$BUILD/config.h" ]; then
+  echo "Usage: stats-record.sh sourcetree buildtree"
+  exit 1
+fi
+
+g++ -O2 -std=c++11 -pthread -I"$SRC" -I"$BUILD" "$BENCHDIR/stats-record.cpp" "$SRC/greasystats.cpp" \
+  "$SRC/greasyhistogram.cpp" "$SRC/greasytask.cpp" "$SRC/greasyregex.cpp" "$SRC/greasytimer.cpp" \
+  "$SRC/greasylog.cpp" -o "$WORKDIR/stats-record" || exit 1
+
+for run in 1 2 3; do "$WORKDIR/stats-record"; done
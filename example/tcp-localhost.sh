@@ -0,0 +1,65 @@
+#!/bin/bash
+#
+# Check of the tcp engine on a single machine: a master and two greasy-worker
+# agents on 127.0.0.1 run a small task file, while a connection that never
+# says hello and one that announces too many slots are turned away.
+#
+# Usage: tcp-localhost.sh [directory with greasybin and greasy-worker]
+#
+
+BINDIR=${1:-$(cd "$(dirname "$0")/../bin" && pwd)}
+WORKDIR=$(mktemp -d)
+trap 'kill $(jobs -p) 2>/dev/null; rm -rf "$WORKDIR"' EXIT
+
+for exe in greasybin greasy-worker; do
+  if [ ! -x "$BINDIR/$exe" ]; then
+    echo "$exe not found in $BINDIR"
+    exit 1
+  fi
+done
+
+cd "$WORKDIR"
+echo "Engine=tcp" > greasy.conf
+for i in $(seq 1 8); do echo "sleep 0.$i"; done > tasks.txt
+echo "/bin/false" >> tasks.txt
+
+export GREASY_TCPADDRESSFILE=$WORKDIR/master.addr
+export GREASY_TCPMINWORKERS=2
+export GREASY_TCPHELLOTIMEOUT=2
+export GREASY_LOGFILE=$WORKDIR/greasy.log
+"$BINDIR/greasybin" tasks.txt &
+MASTER=$!
+
+for i in $(seq 1 50); do
+  [ -s master.addr ] && break
+  sleep 0.1
+done
+read HOST PORT TOKEN < master.addr
+
+# A connection that never says hello, and one that asks for too many slots
+exec 3<>/dev/tcp/127.0.0.1/$PORT
+exec 4<>/dev/tcp/127.0.0.1/$PORT
+echo "HELLO 4 100000 $TOKEN intruder" >&4
+sleep 3
+
+"$BINDIR/greasy-worker" -s 2 -t "$TOKEN" 127.0.0.1:$PORT &
+"$BINDIR/greasy-worker" -s 2 -t "$TOKEN" 127.0.0.1:$PORT &
+wait $MASTER
+exec 3>&- 4>&-
+
+FAILED=0
+check() {
+  if grep -q "$1" greasy.log; then
+    echo "OK: $2"
+  else
+    echo "FAILED: $2"
+    FAILED=1
+  fi
+}
+check "no hello after" "silent connection closed"
+check "wrong version, token or slots" "too many slots rejected"
+check "Starting with 2 agents and 4 slots" "two agents joined"
+check "Summary of 9 tasks: 8 OK, 1 FAILED" "all tasks run"
+
+[ $FAILED -eq 0 ] || cat greasy.log
+exit $FAILED
@@ -23,6 +23,7 @@
 #include "abstractengine.h"
 #include "greasyregex.h"
 #include "basicengine.h"
+#include "tcpengine.h"
 
 
 #ifdef SLURM_ENGINE
@@ -35,39 +36,46 @@
 
 #include <fstream>
 #include <cstdlib>
+#include <cstring>
+#include <unistd.h>
 #include <time.h>
 
 AbstractEngine* AbstractEngineFactory::getAbstractEngineInstance(const string& filename, const string& type ) {
 
- GreasyLog::getInstance()->record(GreasyLog::devel, "AbstractEngineInstance::getAbstractEngineInstance", "Entering with type: '" + type+"'");
+ LOG_RECORD(GreasyLog::getInstance(), GreasyLog::devel, "AbstractEngineInstance::getAbstractEngineInstance", "Entering with type: '" + type+"'");
 
   if (type == "basic" || type.empty() ){
- 	GreasyLog::getInstance()->record(GreasyLog::devel, "AbstractEngineInstance::getAbstractEngineInstance", "Creating engine type: 'basic'");
+ 	LOG_RECORD(GreasyLog::getInstance(), GreasyLog::devel, "AbstractEngineInstance::getAbstractEngineInstance", "Creating engine type: 'basic'");
 	return new BasicEngine(filename);
   }
 
+  if (type == "tcp"){
+ 	LOG_RECORD(GreasyLog::getInstance(), GreasyLog::devel, "AbstractEngineInstance::getAbstractEngineInstance", "Creating engine type: 'tcp'");
+	return new TcpEngine(filename);
+  }
+
   #ifdef MPI_ENGINE
   if (type == "mpi"){
- 	GreasyLog::getInstance()->record(GreasyLog::devel, "AbstractEngineInstance::getAbstractEngineInstance", "Creating engine type: 'mpi'");
+ 	LOG_RECORD(GreasyLog::getInstance(), GreasyLog::devel, "AbstractEngineInstance::getAbstractEngineInstance", "Creating engine type: 'mpi'");
         return new MPIEngine(filename);
 	}
   #endif
 
   #ifdef SLURM_ENGINE
   if (type == "slurm"){
- 	GreasyLog::getInstance()->record(GreasyLog::devel, "AbstractEngineInstance::getAbstractEngineInstance", "Creating engine type: 'slurm'");
+ 	LOG_RECORD(GreasyLog::getInstance(), GreasyLog::devel, "AbstractEngineInstance::getAbstractEngineInstance", "Creating engine type: 'slurm'");
         return new SlurmEngine(filename);
 	}
   #endif
 
   #ifdef THREAD_ENGINE
   if (type == "thread"){
- 	GreasyLog::getInstance()->record(GreasyLog::devel, "AbstractEngineInstance::getAbstractEngineInstance", "Creating engine type: 'thread'");
+ 	LOG_RECORD(GreasyLog::getInstance(), GreasyLog::devel, "AbstractEngineInstance::getAbstractEngineInstance", "Creating engine type: 'thread'");
         return new ThreadEngine(filename);
 	}
   #endif
 
-  GreasyLog::getInstance()->record(GreasyLog::error, "Wrong engine type requested!!! This version does not supports '" + type + "' scheduler");
+  LOG_RECORD(GreasyLog::getInstance(), GreasyLog::error, "Wrong engine type requested!!! This version does not supports '" + type + "' scheduler");
 
   return NULL;
 }
@@ -89,6 +97,10 @@ AbstractEngine::AbstractEngine ( string filename ) {
 
   vector<string>path = split(filename,'/');
   restartFile = getWorkingDir() + path.back() + jobid + ".rst";
+  // The journal and the checkpoint belong to the task file, whichever the job
+  journalFile = taskFile + ".jrn";
+  checkpointFile = taskFile + ".ckpt";
+  taskFileHash = 0;
 
   log = GreasyLog::getInstance();
   config = GreasyConfig::getInstance();
@@ -96,6 +108,15 @@ AbstractEngine::AbstractEngine ( string filename ) {
   nworkers = 0;
   fileErrors= false;
   ready = false;
+  finished = false;
+  journalSync = 1000;
+
+  // Interruptions must not wait forever for threads that keep taking the state
+  pthread_rwlockattr_t attributes;
+  pthread_rwlockattr_init(&attributes);
+  pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&stateLock, &attributes);
+  pthread_rwlockattr_destroy(&attributes);
   if (config->keyExists("strictCheck")&&(config->getValue("strictCheck")=="yes")) {
    strictChecking = true;
   } else {
@@ -110,70 +131,146 @@ bool AbstractEngine::isReady() {
 
 }
 
+void AbstractEngine::lockState() {
+
+  pthread_rwlock_rdlock(&stateLock);
+
+}
+
+void AbstractEngine::unlockState() {
+
+  pthread_rwlock_unlock(&stateLock);
+
+}
+
+void AbstractEngine::interrupt(bool wait) {
+
+  // The state is never given back, as the process is about to end
+  if (wait) {
+    pthread_rwlock_wrlock(&stateLock);
+  } else if (pthread_rwlock_trywrlock(&stateLock) != 0) {
+    LOG_RECORD(log, GreasyLog::error, "The engine was busy, so the restart file could not be written");
+    return;
+  }
+
+  // Once finalized, the restart is already written and the tasks are gone
+  if (!finished) writeRestartFile();
+
+}
+
 void AbstractEngine::init() {
 
-  log->record(GreasyLog::devel, "AbstractEngine::init", "Entering...");
+  LOG_RECORD(log, GreasyLog::devel, "AbstractEngine::init", "Entering...");
 
-  log->record(GreasyLog::silent,"Start greasing " + taskFile);
+  lockState();
+  LOG_RECORD(log, GreasyLog::silent,"Start greasing " + taskFile);
   parseTaskFile();
   checkDependencies();
- 	log->record(GreasyLog::info, "File with " + toString(validTasks.size()) + " correct Tasks");
+ 	LOG_RECORD(log, GreasyLog::info, "File with " + toString(validTasks.size()) + " correct Tasks");
   if ((validTasks.size() != taskMap.size())&&(!strictChecking)) {
-    log->record(GreasyLog::warning,  "Invalid tasks found. Greasy will ignore them");
+    LOG_RECORD(log, GreasyLog::warning,  "Invalid tasks found. Greasy will ignore them");
+  }
+  if (!fileErrors) openJournal();
+
+  // Structured stream of the task events, for analysis
+  if (!fileErrors && !config->getValue("EventFile").empty()) {
+    if (GreasyEvents::getInstance()->open(config->getValue("EventFile")))
+      LOG_RECORD(log, GreasyLog::debug, "Recording task events in " + config->getValue("EventFile"));
+    else
+      LOG_RECORD(log, GreasyLog::warning, "Could not open event file " + config->getValue("EventFile"));
+  }
+
+  // Timeline of the run, written when it ends
+  if (!fileErrors && !config->getValue("TraceFile").empty()) {
+    if (GreasyTrace::getInstance()->open(config->getValue("TraceFile")))
+      LOG_RECORD(log, GreasyLog::debug, "Tracing the run to " + config->getValue("TraceFile"));
+    else
+      LOG_RECORD(log, GreasyLog::warning, "Could not open trace file " + config->getValue("TraceFile"));
+  }
+
+  // Overhead of the scheduler, for the summary
+  if (!fileErrors) GreasyStats::getInstance()->start();
+
+  // Live metrics of the run, for greasy-stat and the monitoring systems
+  if (!fileErrors && ((config->getValue("Metrics") != "no") || !config->getValue("MetricsFile").empty())) {
+    int completed = 0;
+    int interval = 15;
+    for (set<int>::iterator it = validTasks.begin(); it != validTasks.end(); it++) {
+      if (taskMap[*it]->getTaskState() == GreasyTask::completed) completed++;
+    }
+    if (GreasyMetrics::getInstance()->open(taskFile, engineType, validTasks.size(), completed, config->getValue("Metrics") != "no")) {
+      LOG_RECORD(log, GreasyLog::debug, "Keeping live metrics for greasy-stat " + toString(getpid()));
+    } else {
+      LOG_RECORD(log, GreasyLog::warning, "Could not create the segment of the live metrics");
+    }
+    if (!config->getValue("MetricsFile").empty()) {
+      if (config->keyExists("MetricsInterval")) fromString(interval, config->getValue("MetricsInterval"));
+      GreasyMetrics::getInstance()->startExports(config->getValue("MetricsFile"), interval);
+    }
   }
 
   // Only set the number of workers if any subclass has not changed the value before.
   if (nworkers == 0){
     // Set the number of workers
     if (config->keyExists("NWorkers")) {
-      log->record(GreasyLog::devel, "Using defined NWorkers: " + toString(nworkers));
+      LOG_RECORD(log, GreasyLog::devel, "Using defined NWorkers: " + toString(nworkers));
       nworkers = fromString(nworkers, config->getValue("NWorkers"));
     } else {
       getDefaultNWorkers();
-      log->record(GreasyLog::warning, "Falling back to the default number of workers " + toString(nworkers));
-      log->record(GreasyLog::warning, "Consider setting environment variable GREASY_NWORKERS to the desired cpus to use");
+      LOG_RECORD(log, GreasyLog::warning, "Falling back to the default number of workers " + toString(nworkers));
+      LOG_RECORD(log, GreasyLog::warning, "Consider setting environment variable GREASY_NWORKERS to the desired cpus to use");
     }
   }
 
   if (!fileErrors) {
     if(nworkers>0) {
       ready = true;
-      log->record(GreasyLog::info,  toUpper(engineType) + " engine is ready to run with "
+      LOG_RECORD(log, GreasyLog::info,  toUpper(engineType) + " engine is ready to run with "
 				  + toString(nworkers) + " workers");
     } else {
-      log->record(GreasyLog::error,  toUpper(engineType) + " engine has no workers. Please check your greasy setup");
+      LOG_RECORD(log, GreasyLog::error,  toUpper(engineType) + " engine has no workers. Please check your greasy setup");
     }
   }
-  log->record(GreasyLog::devel,  "Configuration contents:\n\n" + config->printContents());
-  log->record(GreasyLog::devel,  "End of configuration contents");
+  unlockState();
+  LOG_RECORD(log, GreasyLog::devel,  "Configuration contents:\n\n" + config->printContents());
+  LOG_RECORD(log, GreasyLog::devel,  "End of configuration contents");
 
-  log->record(GreasyLog::devel, "AbstractEngine::init", "Exiting...");
+  LOG_RECORD(log, GreasyLog::devel, "AbstractEngine::init", "Exiting...");
 
 }
 
 void AbstractEngine::finalize() {
 
-  log->record(GreasyLog::devel, "AbstractEngine::finalize", "Entering...");
+  LOG_RECORD(log, GreasyLog::devel, "AbstractEngine::finalize", "Entering...");
 
-  log->record(GreasyLog::info, toUpper(engineType) + " engine finished");
+  LOG_RECORD(log, GreasyLog::info, toUpper(engineType) + " engine finished");
 
   globalTimer.stop();
 
+  lockState();
   buildFinalSummary();
 
+  GreasyJournal::getInstance()->close();
+  GreasyEvents::getInstance()->close();
+  if (!GreasyTrace::getInstance()->close() && !config->getValue("TraceFile").empty())
+    LOG_RECORD(log, GreasyLog::warning, "Could not write trace file " + config->getValue("TraceFile"));
+  GreasyMetrics::getInstance()->close();
+
   map<int,GreasyTask*>::iterator it;
   for (it=taskMap.begin();it!=taskMap.end(); it++) {
     if (it->second) delete(it->second);
   }
+  finished = true;
+  unlockState();
 
-  log->record(GreasyLog::silent,"Finished greasing " + taskFile);
+  LOG_RECORD(log, GreasyLog::silent,"Finished greasing " + taskFile);
 
-  log->record(GreasyLog::devel, "AbstractEngine::finalize", "Exiting...");
+  LOG_RECORD(log, GreasyLog::devel, "AbstractEngine::finalize", "Exiting...");
 }
 
 void AbstractEngine::parseTaskFile() {
 
-  log->record(GreasyLog::devel, "AbstractEngine::parseTaskFile", "Entering...");
+  LOG_RECORD(log, GreasyLog::devel, "AbstractEngine::parseTaskFile", "Entering...");
   ifstream myfile(taskFile.c_str());
 
   string blankLineP= "^([[:blank:]]*)$";
@@ -194,11 +291,16 @@ void AbstractEngine::parseTaskFile() {
   string workDir = "";
 
   if (myfile.is_open()) {
-    log->record(GreasyLog::debug, "Reading tasks");
-    // Read the task file
+    LOG_RECORD(log, GreasyLog::debug, "Reading tasks");
+    // Read the task file, hashing it with FNV-1a to recognize its checkpoint
+    taskFileHash = 14695981039346656037ULL;
     while (!myfile.eof()){
       taskId++;
       getline (myfile,line);
+      for (string::size_type i = 0; i <= line.size(); i++) {
+        taskFileHash ^= (i < line.size()) ? (unsigned char)line[i] : '\n';
+        taskFileHash *= 1099511628211ULL;
+      }
 
       // Skip blank lines and comments
       if(line=="") continue;
@@ -210,7 +312,7 @@ void AbstractEngine::parseTaskFile() {
 			taskMap[taskId]->setTaskNum(taskNum);
 
       if (GreasyRegex::match(line, directoryP) != "") {
-        log->record(GreasyLog::devel, "line " + toString(taskId),
+        LOG_RECORD(log, GreasyLog::devel, "line " + toString(taskId),
             "Contains directory instruction.");
 
         workDir = GreasyRegex::match(line, directoryP);
@@ -223,12 +325,12 @@ void AbstractEngine::parseTaskFile() {
 
       // Check line syntax
       if(GreasyRegex::match(line,TaskLineWithDepsP)!="") {
-	log->record(GreasyLog::devel, "line "+toString(taskId), "Working as line with deps");
+	LOG_RECORD(log, GreasyLog::devel, "line "+toString(taskId), "Working as line with deps");
 	//line should have deps
 	GreasyRegex entryReg = GreasyRegex(depTaskLineP);
 	if(entryReg.multipleMatch(line,matches) == 3) {
 	  // Remove leading and trailing brakets from string #x# -> x
-	  log->record(GreasyLog::devel, "line "+toString(taskId), "Correct closing of dep brackets");
+	  LOG_RECORD(log, GreasyLog::devel, "line "+toString(taskId), "Correct closing of dep brackets");
 	  dependencies = matches[1].substr(1,matches[1].size()-2);
 	  command = matches[2];
 	  if (command=="") {
@@ -236,13 +338,13 @@ void AbstractEngine::parseTaskFile() {
 	  } else {
 	    //Let's see if syntax is correct inside dependency brackets
 	    if (dependencies == "" || GreasyRegex::match(dependencies,depP)!="") {
-	      log->record(GreasyLog::devel, "line "+toString(taskId), "Correct character content inside dep brackets");
+	      LOG_RECORD(log, GreasyLog::devel, "line "+toString(taskId), "Correct character content inside dep brackets");
 	      taskMap[taskId]->setCommand(command);
 	      if (taskMap[taskId]->addDependencies(dependencies)) {
 		validTasks.insert(taskId);
 	      }
 	    } else {
-	      log->record(GreasyLog::devel, "line "+toString(taskId), "deps: "+dependencies);
+	      LOG_RECORD(log, GreasyLog::devel, "line "+toString(taskId), "deps: "+dependencies);
 	      recordInvalidTask(taskId);
 	    }
 	  }
@@ -251,7 +353,7 @@ void AbstractEngine::parseTaskFile() {
 	}
       } else {
 	//line has no deps
-	log->record(GreasyLog::devel, "line "+toString(taskId), "Working as line with no deps");
+	LOG_RECORD(log, GreasyLog::devel, "line "+toString(taskId), "Working as line with no deps");
 	command = GreasyRegex::match(line,basicTaskLineP);
 	if (command!="") {
 	  taskMap[taskId]->setCommand(command);
@@ -266,13 +368,13 @@ void AbstractEngine::parseTaskFile() {
       command.clear();
     }
     myfile.close();
-    log->record(GreasyLog::debug, "Tasks loaded");
+    LOG_RECORD(log, GreasyLog::debug, "Tasks loaded");
   } else {
-    log->record(GreasyLog::error,  "Could not read task file " + taskFile);
+    LOG_RECORD(log, GreasyLog::error,  "Could not read task file " + taskFile);
     fileErrors=true;
   }
 
-  log->record(GreasyLog::devel, "AbstractEngine::parseTaskFile", "Exiting...");
+  LOG_RECORD(log, GreasyLog::devel, "AbstractEngine::parseTaskFile", "Exiting...");
 
 }
 
@@ -280,7 +382,7 @@ void AbstractEngine::checkDependencies() {
 
   map<int,GreasyTask*>::iterator it;
 
-  log->record(GreasyLog::devel, "AbstractEngine::checkDependencies", "Entering...");
+  LOG_RECORD(log, GreasyLog::devel, "AbstractEngine::checkDependencies", "Entering...");
 
   // For each task, check if its dependencies are valid and fill the reverse
   // dependency map.
@@ -305,11 +407,11 @@ void AbstractEngine::checkDependencies() {
 
 	if (strictChecking) {
 	  fileErrors = true;
-	  log->record(GreasyLog::error, "Dependency " + toString(*dep) + " of task " +
+	  LOG_RECORD(log, GreasyLog::error, "Dependency " + toString(*dep) + " of task " +
 		toString(it->first) + " is not valid");
 	} else {
 	  // don't remove dependency from task but keep going
-	  log->record(GreasyLog::warning, "Dependency " + toString(*dep) + " of task " +
+	  LOG_RECORD(log, GreasyLog::warning, "Dependency " + toString(*dep) + " of task " +
 		  toString(it->first) + " is not valid.");
 	}
 
@@ -317,18 +419,151 @@ void AbstractEngine::checkDependencies() {
     }
   }
 
-  log->record(GreasyLog::devel, "AbstractEngine::checkDependencies", "Exiting...");
+  LOG_RECORD(log, GreasyLog::devel, "AbstractEngine::checkDependencies", "Exiting...");
+
+}
+
+void AbstractEngine::openJournal() {
+
+  GreasyJournal* journal = GreasyJournal::getInstance();
+  GreasyCheckpoint state;
+  journalHeader found;
+  vector<journalRecord> records;
+  vector<journalRecord>::iterator rec;
+  map<int,checkpointEntry>::const_iterator entry;
+  set<int>::iterator it;
+  string journals[2] = { journalFile, journalFile + ".new" };
+  int status;
+  int interval = 0;
+  int failed = 0;
+  int resumed = 0;
+  bool resume = (config->getValue("Resume") == "yes");
+  bool fresh = (config->getValue("Fresh") == "yes");
+  bool foundAny = false;
+
+  LOG_RECORD(log, GreasyLog::devel, "AbstractEngine::openJournal", "Entering...");
+
+  if (config->getValue("Journal") != "yes") {
+    if (resume) LOG_RECORD(log, GreasyLog::warning, "Nothing to resume from without Journal=yes");
+    LOG_RECORD(log, GreasyLog::devel, "AbstractEngine::openJournal", "Exiting...");
+    return;
+  }
+
+  if (config->keyExists("JournalFile")) journalFile = config->getValue("JournalFile");
+  if (config->keyExists("CheckpointFile")) checkpointFile = config->getValue("CheckpointFile");
+  if (config->keyExists("JournalSync")) fromString(journalSync, config->getValue("JournalSync"));
+  if (config->keyExists("CheckpointInterval")) fromString(interval, config->getValue("CheckpointInterval"));
+  if (journalSync < 0) journalSync = 0;
+
+  // Two runs on the same task file would overwrite each other's journal
+  if (!journal->reserve(journalFile)) {
+    LOG_RECORD(log, GreasyLog::error, "Journal " + journalFile + " is in use by another run, or its lock file "
+                + journalFile + ".lock could not be created");
+    fileErrors = true;
+    LOG_RECORD(log, GreasyLog::devel, "AbstractEngine::openJournal", "Exiting...");
+    return;
+  }
+
+  state.reset(taskFileHash, taskMap.empty() ? 0 : taskMap.rbegin()->first, validTasks.size(), 0);
+
+  if (resume) {
+    // First the checkpoint, then the records journaled after it was written
+    status = state.read(checkpointFile, taskFileHash);
+    if (status < 0) {
+      LOG_RECORD(log, GreasyLog::error, "Checkpoint " + checkpointFile + " was not written for the current contents of "
+                  + taskFile + ". Not resuming");
+      fileErrors = true;
+      LOG_RECORD(log, GreasyLog::devel, "AbstractEngine::openJournal", "Exiting...");
+      return;
+    }
+    foundAny = (status > 0);
+
+    // A journal older than the checkpoint is already part of it. The new one
+    // is only left behind if the run stopped while writing a checkpoint.
+    for (int i = 0; i < 2; i++) {
+      records.clear();
+      status = journal->read(journals[i], found, records);
+      if ((status < 0) || ((status > 0) && (found.hash != taskFileHash))) {
+        LOG_RECORD(log, GreasyLog::error, "Journal " + journals[i] + " was not written for the current contents of "
+                    + taskFile + ". Not resuming");
+        fileErrors = true;
+        LOG_RECORD(log, GreasyLog::devel, "AbstractEngine::openJournal", "Exiting...");
+        return;
+      }
+      if ((status == 0) || (found.generation < state.getGeneration())) continue;
+      foundAny = true;
+      for (rec=records.begin(); rec!=records.end(); rec++) {
+        state.record(rec->taskId, rec->state, rec->retries);
+      }
+    }
+
+    for (it=validTasks.begin(); it!=validTasks.end(); it++) {
+      if (state.isCompleted(*it) && markCompleted(*it)) resumed++;
+    }
+    for (entry=state.getEntries().begin(); entry!=state.getEntries().end(); entry++) {
+      if (entry->second.failures > 0) failed++;
+    }
+
+    if (!foundAny)
+      LOG_RECORD(log, GreasyLog::warning, "No checkpoint nor journal found for " + taskFile + ". Running all the tasks");
+    else
+      LOG_RECORD(log, GreasyLog::info, "Resuming " + taskFile + ": " + toString(resumed) + " tasks were already completed");
+    if (failed > 0)
+      LOG_RECORD(log, GreasyLog::info, toString(failed) + " tasks failed in previous executions");
+  } else if (fresh) {
+    // Starting from scratch on request, so the old progress must not be resumed later
+    unlink(checkpointFile.c_str());
+    unlink(journals[0].c_str());
+    unlink(journals[1].c_str());
+  } else if ((access(checkpointFile.c_str(), F_OK) == 0) || (access(journals[0].c_str(), F_OK) == 0)
+             || (access(journals[1].c_str(), F_OK) == 0)) {
+    // The progress of a previous run is never thrown away unless asked to
+    LOG_RECORD(log, GreasyLog::error, "Found the checkpoint or the journal of a previous run of " + taskFile
+                + ". Use --resume to continue it, or --fresh to start over");
+    fileErrors = true;
+    LOG_RECORD(log, GreasyLog::devel, "AbstractEngine::openJournal", "Exiting...");
+    return;
+  }
+
+  if (journal->open(journalFile, checkpointFile, state, journalSync, resume)) {
+    LOG_RECORD(log, GreasyLog::debug, "Recording finished tasks in journal " + journalFile);
+    if (interval > 0) {
+      LOG_RECORD(log, GreasyLog::debug, "Writing checkpoint " + checkpointFile + " every " + toString(interval) + " seconds");
+      journal->startCheckpoints(interval);
+    }
+  } else {
+    LOG_RECORD(log, GreasyLog::error, "Could not open journal " + journalFile);
+    fileErrors = true;
+  }
+
+  LOG_RECORD(log, GreasyLog::devel, "AbstractEngine::openJournal", "Exiting...");
+
+}
+
+bool AbstractEngine::markCompleted(int taskId) {
+
+  GreasyTask* task = taskMap[taskId];
+  list<int>::iterator child;
+
+  if (task->getTaskState() == GreasyTask::completed) return false;
+
+  task->setTaskState(GreasyTask::completed);
+  task->setReturnCode(0);
+  for (child=revDepMap[taskId].begin(); child!=revDepMap[taskId].end(); child++) {
+    taskMap[*child]->removeDependency(taskId);
+  }
+  return true;
 
 }
 
 void AbstractEngine::recordInvalidTask(int taskId) {
 
   if (strictChecking) {
-    log->record(GreasyLog::error,  "Task " + toString(taskId) +
+    LOG_RECORD(log, GreasyLog::error,  "Task " + toString(taskId) +
 			  " does not seem to be correct");
     fileErrors=true;
   } else {
-    log->record(GreasyLog::warning,  "Task " + toString(taskId) +
+    LOG_RECORD(log, GreasyLog::warning,  "Task " + toString(taskId) +
 			  " does not seem to be correct. Skipping...");
 
     if (taskMap[taskId]!= NULL )
@@ -341,22 +576,24 @@ void AbstractEngine::writeRestartFile() {
 
   GreasyTask *task;
   map<int,GreasyTask*>::iterator it;
-  list<int> dependants;
+  list<int> deps;
   set<GreasyTask*> invalidTasks;
   list<int>::iterator lit;
   set<GreasyTask*>::iterator sit;
   int nindex;
+  // Line of each task in the restart, 0 for the ones left out
+  vector<int> newIndex(taskMap.empty() ? 1 : taskMap.rbegin()->first + 1, 0);
   ofstream rstfile( restartFile.c_str(), ios_base::out);
 
 
-  log->record(GreasyLog::devel, "AbstractEngine::writeRestartFile", "Entering...");
+  LOG_RECORD(log, GreasyLog::devel, "AbstractEngine::writeRestartFile", "Entering...");
 
   if (!rstfile.is_open()) {
-      log->record(GreasyLog::error,  "Could not create restart file " + restartFile);
+      LOG_RECORD(log, GreasyLog::error,  "Could not create restart file " + restartFile);
       return;
   }
 
-  log->record(GreasyLog::info, "Creating restart file " + restartFile + "...");
+  LOG_RECORD(log, GreasyLog::info, "Creating restart file " + restartFile + "...");
 
   string logFile = "Standard Error";
   if (config->keyExists("LogFile")&&((config->getValue("LogFile") != ""))) {
@@ -388,7 +625,8 @@ void AbstractEngine::writeRestartFile() {
     }
 
     if (task->getTaskState() == GreasyTask::failed) {
-      rstfile << "# Warning: Task " << task->getTaskId() << " failed" << endl;
+      rstfile << "# Warning: Task " << task->getTaskId() << " failed with exit code " << task->getReturnCode()
+              << " after " << GreasyTimer::usecsToTime(task->getElapsedTime()) << endl;
       nindex++;
     }
 
@@ -402,21 +640,22 @@ void AbstractEngine::writeRestartFile() {
       rstfile << "[@ " << task->getWorkDir() << " @] ";
     }
 
-    // Write the task in the restart with its dependencies if any
+    // Write the task in the restart with its dependencies if any, translated to
+    // the new lines. Parents always come first, so their lines are known, and
+    // completed ones are dropped.
+    deps.clear();
     if (task->hasDependencies()) {
-      rstfile << "[# " << task->dumpDependencies() << " #] ";
-    }
-    rstfile << ((*it).second)->getCommand() << endl;
-
-    //Update indexes of dependencies to the new lines in the restart
-    dependants = revDepMap[task->getTaskId()];
-    if (!dependants.empty()) {
-      for(lit=dependants.begin();lit!=dependants.end();lit++) {
-	taskMap[*lit]->removeDependency(task->getTaskId());
-	taskMap[*lit]->addDependency(nindex);
+      list<int> parents = task->getDependencies();
+      for(lit=parents.begin();lit!=parents.end();lit++) {
+	if (newIndex[*lit] > 0) deps.push_back(newIndex[*lit]);
       }
     }
+    if (!deps.empty()) {
+      rstfile << "[# " << GreasyTask::dumpDependencies(deps) << " #] ";
+    }
+    rstfile << ((*it).second)->getCommand() << endl;
 
+    newIndex[task->getTaskId()] = nindex;
     nindex++;
 
   }
@@ -442,9 +681,9 @@ void AbstractEngine::writeRestartFile() {
 
   // close restart file;
   rstfile.close();
-  log->record(GreasyLog::info, "Restart file created");
+  LOG_RECORD(log, GreasyLog::info, "Restart file created");
 
-  log->record(GreasyLog::devel, "AbstractEngine::writeRestartFile", "Exiting...");
+  LOG_RECORD(log, GreasyLog::devel, "AbstractEngine::writeRestartFile", "Exiting...");
 
 }
 
@@ -457,14 +696,35 @@ void AbstractEngine::buildFinalSummary() {
   int total = taskMap.size();
   map<int,GreasyTask*>::iterator it;
   GreasyTask* task;
-  unsigned long usedTime = 0;
+  unsigned long long usedTime = 0;
   float rup = 0;
-
-  log->record(GreasyLog::devel, "AbstractEngine::buildFinalSummary", "Entering...");
+  const taskUsage* usage;
+  taskUsage totals;
+  unsigned long long measuredTime = 0;
+  int measured = 0;
+  bool hasIO = false;
+
+  LOG_RECORD(log, GreasyLog::devel, "AbstractEngine::buildFinalSummary", "Entering...");
+  memset(&totals, 0, sizeof(totals));
   // Compute final stats
   for (it=taskMap.begin();it!=taskMap.end(); it++) {
     task = it->second;
     usedTime += task->getElapsedTimeAcc();
+    // Only the last execution of each task has its resources recorded
+    if ((usage = task->getUsage())) {
+      measured++;
+      measuredTime += task->getElapsedTime();
+      totals.utime += usage->utime;
+      totals.stime += usage->stime;
+      totals.maxrss = max(totals.maxrss, usage->maxrss);
+      totals.nvcsw += usage->nvcsw;
+      totals.nivcsw += usage->nivcsw;
+      if (usage->readBytes >= 0) {
+        hasIO = true;
+        totals.readBytes += usage->readBytes;
+        totals.writtenBytes += usage->writtenBytes;
+      }
+    }
     switch(task->getTaskState()) {
       case GreasyTask::invalid:
 	invalid++;
@@ -482,27 +742,60 @@ void AbstractEngine::buildFinalSummary() {
   }
 
   // Compute the resource utilization %
-  if (globalTimer.secsElapsed()>0&&nworkers>0) {
-    int aux = usedTime*10000 / (globalTimer.secsElapsed()*nworkers);
+  if (globalTimer.usecsElapsed()>0&&getConcurrency()>0) {
+    int aux = usedTime*10000 / ((unsigned long long)globalTimer.usecsElapsed()*getConcurrency());
     rup = (float)aux/(float)100;
   }
 
-  log->record(GreasyLog::info,"Summary of " + toString(total) + " tasks: " + toString(completed) +
+  LOG_RECORD(log, GreasyLog::info,"Summary of " + toString(total) + " tasks: " + toString(completed) +
 			      " OK, "+toString(failed) + " FAILED, " + toString(cancelled) +
 			      " CANCELLED, " + toString(invalid) + " INVALID.");
-  log->record(GreasyLog::info,"Total time: " + globalTimer.getElapsed());
-  log->record(GreasyLog::info,"Resource Utilization: " + toString(rup) +"%" );
+  LOG_RECORD(log, GreasyLog::info,"Total time: " + globalTimer.getElapsed());
+  LOG_RECORD(log, GreasyLog::info,"Resource Utilization: " + toString(rup) +"%" );
+  if (measured > 0) logResourceSummary(measured, measuredTime, totals, hasIO);
+  GreasyStats::getInstance()->logSummary();
+
+  // Write a restart if we find not completed tasks, including the ones
+  // that could not be run at all
+  if (completed < total) writeRestartFile();
+
+  LOG_RECORD(log, GreasyLog::devel, "AbstractEngine::buildFinalSummary", "Exiting...");
+
+}
+
+void AbstractEngine::logResourceSummary(int measured, unsigned long long measuredTime, const taskUsage& totals, bool hasIO) {
+
+  long long cpuTime = totals.utime + totals.stime;
+
+  LOG_RECORDF(log, GreasyLog::info, "", "Resources used by %d tasks: cpu %s (user %s, system %s), "
+              "max RSS %s, %lld voluntary and %lld involuntary context switches", measured,
+              GreasyTimer::usecsToTime(cpuTime).c_str(), GreasyTimer::usecsToTime(totals.utime).c_str(),
+              GreasyTimer::usecsToTime(totals.stime).c_str(), formatBytes(totals.maxrss*1024).c_str(),
+              totals.nvcsw, totals.nivcsw);
+  if (hasIO) {
+    LOG_RECORD(log, GreasyLog::info, "I/O of the tasks: " + formatBytes(totals.readBytes) + " read, "
+               + formatBytes(totals.writtenBytes) + " written");
+  }
+
+  // A task busy on one cpu all along is 100% efficient, so multithreaded
+  // tasks may go over it. Against the worker slots, it tells how much of the
+  // cpus given to Greasy was put to work.
+  if ((measuredTime > 0) && (globalTimer.usecsElapsed() > 0) && (getConcurrency() > 0)) {
+    LOG_RECORDF(log, GreasyLog::info, "", "CPU efficiency: %.2f%% of the run time of the tasks, %.2f%% of the worker slots",
+                100.0*cpuTime/measuredTime, 100.0*cpuTime/((double) globalTimer.usecsElapsed()*getConcurrency()));
+  }
+
+}
 
-  // Write a restart if we find not completed tasks
-  if (failed + cancelled + invalid > 0) writeRestartFile();
+int AbstractEngine::getConcurrency() {
 
-  log->record(GreasyLog::devel, "AbstractEngine::buildFinalSummary", "Exiting...");
+  return nworkers;
 
 }
 
 string AbstractEngine::dumpTaskMap() {
 
-  log->record(GreasyLog::devel, "AbstractEngine::dumpTasks", "Entering...");
+  LOG_RECORD(log, GreasyLog::devel, "AbstractEngine::dumpTasks", "Entering...");
   map<int,GreasyTask*>::iterator it;
   string s = "\nList of tasks:\n===============\n";
 
@@ -511,12 +804,12 @@ string AbstractEngine::dumpTaskMap() {
   }
   s+="\n";
 
-  log->record(GreasyLog::devel, "AbstractEngine::dumpTasks", "Exiting...");
+  LOG_RECORD(log, GreasyLog::devel, "AbstractEngine::dumpTasks", "Exiting...");
   return s;
 }
 
 void AbstractEngine::dumpTasks() {
 
-   log->record(GreasyLog::devel, dumpTaskMap());
+   LOG_RECORD(log, GreasyLog::devel, dumpTaskMap());
 
 }
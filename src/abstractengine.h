@@ -28,11 +28,18 @@
 #include <map>
 #include <list>
 #include <set>
+#include <pthread.h>
 
 #include "greasyconfig.h"
 #include "greasylog.h"
 #include "greasytimer.h"
 #include "greasytask.h"
+#include "greasyjournal.h"
+#include "greasyevents.h"
+#include "greasytrace.h"
+#include "greasystats.h"
+#include "greasymetrics.h"
+#include "greasynotify.h"
 
 using namespace std;
 
@@ -100,9 +107,31 @@ public:
    */
    virtual void writeRestartFile();
 
+  /**
+   * Write the restart file because the run is interrupted. It may be called from any
+   * thread: it waits until the engine leaves the state of the tasks alone, and keeps
+   * it from changing again, as the process is about to end.
+   * @param wait If false, the restart is not written when the state is busy, as it
+   * happens if the caller interrupted the very thread holding it.
+   */
+  void interrupt(bool wait);
+
 
 protected:
 
+  /**
+   * Take the state of the tasks to change it. Engines hold it while they schedule,
+   * and let it go while they wait for the workers, so that an interruption writes
+   * the restart file in between. Several threads may hold it at the same time, but
+   * not recursively.
+   */
+  void lockState();
+
+  /**
+   * Let go of the state of the tasks.
+   */
+  void unlockState();
+
   /**
    * It parses the task file and fills up the taskMap. It also checks if the task is syntactically
    * valid or not.
@@ -121,12 +150,42 @@ protected:
    */
   void recordInvalidTask(int taskId);
 
+  /**
+   * Open the journal where the tasks that reach a final state are recorded. When
+   * resuming, the tasks completed according to the checkpoint and the journal are
+   * marked as such first, so that they are not run again.
+   */
+  void openJournal();
+
+  /**
+   * Mark a task as completed by a previous execution, releasing its dependants.
+   * @param taskId The line of the task.
+   * @return True if the task was not marked yet.
+   */
+  bool markCompleted(int taskId);
+
   /**
    * It produces a final summary of the execution of greasy, with some statistics on the tasks completed,
    * failed, etc., the total amount of time consumed and the resource utilitzation percentage.
    */
   void buildFinalSummary();
 
+  /**
+   * Log the resources used by the tasks and how efficiently they used the cpus.
+   * @param measured The number of tasks whose resources are known.
+   * @param measuredTime The microseconds those tasks were running.
+   * @param totals The resources used, summed up, except maxrss that is the maximum.
+   * @param hasIO Whether the I/O of the tasks is known.
+   */
+  void logResourceSummary(int measured, unsigned long long measuredTime, const taskUsage& totals, bool hasIO);
+
+  /**
+   * Get the number of tasks the engine is able to run at the same time. It is used
+   * to compute the resource utilization.
+   * @return The number of concurrent tasks. By default, one per worker.
+   */
+  virtual int getConcurrency();
+
   /**
   * Debug method to dump in a pretty format the contents of the taskMap.
   */
@@ -147,6 +206,9 @@ protected:
   string engineType; /**< Type of the engine. Each subclass will have a different type. */
   string taskFile; /**< Path to the file containing the tasks to execute. */
   string restartFile; /**< Path to the file where the restart will be written. */
+  string journalFile; /**< Path to the journal of the tasks finished. */
+  string checkpointFile; /**< Path to the checkpoint of the task file. */
+  unsigned long long taskFileHash; /**< Hash of the contents of the task file. */
   int nworkers; /**< Number of greasy workers (possibly the number of cpus available). */
   bool ready; /**< Flag to know if the engine is ready to run. */
 
@@ -160,10 +222,13 @@ protected:
   GreasyLog *log; /**< log instance. */
   GreasyConfig *config; /**< config instance. */
   GreasyTimer globalTimer; /**< Global timer to count the time that engine takes to run. */
+  pthread_rwlock_t stateLock; /**< Shared by the threads changing the state of the tasks, taken alone to interrupt the run. */
 
 private:
   bool fileErrors; /**< Flag to know if there were any errors in the task file once processed. */
   bool strictChecking; /**< Flag to know if strict checking of the file is enabled. */
+  int journalSync; /**< Maximum milliseconds between syncs of the journal. */
+  bool finished; /**< Flag to know if the engine was finalized, and the restart written if needed. */
 
 };
 
@@ -26,21 +26,33 @@
 AbstractSchedulerEngine::AbstractSchedulerEngine ( const string& filename) : AbstractEngine(filename){
   
     engineType="abstractscheduler";
+    workerSlots = 1;
+    nslots = 0;
     
 }
 
 void AbstractSchedulerEngine::init() {
     
-  log->record(GreasyLog::devel, "AbstractSchedulerEngine::init", "Entering...");
+  LOG_RECORD(log, GreasyLog::devel, "AbstractSchedulerEngine::init", "Entering...");
   
   AbstractEngine::init();
   
-  // Fill the freeWorkers queue
-  for (int i=1;i<=nworkers; i++) {
-    freeWorkers.push(i);
+  // Fill the freeWorkers queue. Slots are interleaved so that the first
+  // round of tasks is spread among all the workers.
+  bool more = true;
+  nslots = 0;
+  for (int slot=0; more; slot++) {
+    more = false;
+    for (int i=1;i<=nworkers; i++) {
+      if (slot < getWorkerSlots(i)) {
+        freeWorkers.push(i);
+        nslots++;
+        more = true;
+      }
+    }
   }
   
-  log->record(GreasyLog::devel, "AbstractSchedulerEngine::init", "Exiting...");
+  LOG_RECORD(log, GreasyLog::devel, "AbstractSchedulerEngine::init", "Exiting...");
   
 }
 
@@ -68,54 +80,65 @@ void AbstractSchedulerEngine::runScheduler() {
   set<int>::iterator it;
   GreasyTask* task = NULL;
 
-  log->record(GreasyLog::devel, "AbstractSchedulerEngine::runScheduler", "Entering...");
+  LOG_RECORD(log, GreasyLog::devel, "AbstractSchedulerEngine::runScheduler", "Entering...");
   
   // Dummy check: let's see if there is any worker...
   if (nworkers==0) {
-    log->record(GreasyLog::error, "No workers found. Rerun greasy with more resources");    
+    LOG_RECORD(log, GreasyLog::error, "No workers found. Rerun greasy with more resources");    
     return;
   }
   
   globalTimer.start();
+  lockState();
 
   // Initialize the task queue with all the tasks ready to be executed
   for (it=validTasks.begin();it!=validTasks.end(); it++) {
     task = taskMap[*it];
-    if (task->isWaiting()) taskQueue.push(task);
-    else if (task->isBlocked()) blockedTasks.insert(task);
+    if (task->isWaiting()) {
+      taskQueue.push(task);
+      notifyTaskEvent(GreasyEvents::queued, task);
+    } else if (task->isBlocked()) blockedTasks.insert(task);
   }
    
-  // Main Scheduling loop
-  while (!(taskQueue.empty())||!(blockedTasks.empty())) {
-    while (!taskQueue.empty()) {
+  // Main Scheduling loop. It ends early if all the workers are lost, and
+  // it lasts until the last task finishes because the tasks of a lost
+  // worker are queued again.
+  while ((!(taskQueue.empty())||!(blockedTasks.empty())||((int) freeWorkers.size()!=nslots)) && (nslots > 0)) {
+    while (!taskQueue.empty() && (nslots > 0)) {
       if (!freeWorkers.empty()) {
 	// There is room to allocate a task...
 	task =  taskQueue.front();
 	taskQueue.pop();
+	GreasyStats::getInstance()->beginDispatch();
 	allocate(task);
+	GreasyStats::getInstance()->endDispatch();
       } else {
 	// All workers are busy. We need to wait anyone to finish.
+	GreasyTrace::getInstance()->beginWait();
 	waitForAnyWorker();
+	GreasyTrace::getInstance()->endWait();
       }
     }
     
-    if (!(blockedTasks.empty())) {
+    if ((!(blockedTasks.empty())||((int) freeWorkers.size()!=nslots)) && (nslots > 0)) {
       // There are no tasks to be scheduled on the queue, but there are
-      // dependencies not fulfilled and tasks already running, so we have
+      // dependencies not fulfilled or tasks still running, so we have
       // to wait for them to finish to release blocks on them.
+      GreasyTrace::getInstance()->beginWait();
       waitForAnyWorker();
+      GreasyTrace::getInstance()->endWait();
     }
   }
 
-  // At this point, all tasks are allocated / finished
-  // Wait for the last tasks to complete
-  while (freeWorkers.size()!=nworkers) {
-    waitForAnyWorker();
+  if (!(taskQueue.empty())||!(blockedTasks.empty())) {
+    LOG_RECORD(log, GreasyLog::error, "No workers left. " + toString(taskQueue.size() + blockedTasks.size())
+                + " tasks could not be run");
   }
   
+  unlockState();
   globalTimer.stop();
   
-  log->record(GreasyLog::devel, "AbstractSchedulerEngine::runScheduler", "Exiting...");
+  LOG_RECORD(log, GreasyLog::devel, "AbstractSchedulerEngine::runScheduler", "Exiting...");
   
 }
 
@@ -126,41 +149,47 @@ void AbstractSchedulerEngine::updateDependencies(GreasyTask* parent) {
   GreasyTask* child;
   list<int>::iterator it;
 
-  log->record(GreasyLog::devel, "AbstractSchedulerEngine::updateDependencies", "Entering...");
+  LOG_RECORD(log, GreasyLog::devel, "AbstractSchedulerEngine::updateDependencies", "Entering...");
   
   taskId = parent->getTaskId();
   state = parent->getTaskState();
-  log->record(GreasyLog::devel, "AbstractSchedulerEngine::updateDependencies", "Inspecting reverse deps for task " + toString(taskId));
+
+  // Every task reaching a final state comes through here
+  GreasyJournal::getInstance()->record(parent);
+  LOG_RECORD(log, GreasyLog::devel, "AbstractSchedulerEngine::updateDependencies", "Inspecting reverse deps for task " + toString(taskId));
   
   if ( revDepMap.find(taskId) == revDepMap.end() ){
-      log->record(GreasyLog::devel, "AbstractSchedulerEngine::updateDependencies", "The task "+ toString(taskId) + " does not have any other dependendant task. No update done.");
-      log->record(GreasyLog::devel, "AbstractSchedulerEngine::updateDependencies", "Exiting...");
+      LOG_RECORD(log, GreasyLog::devel, "AbstractSchedulerEngine::updateDependencies", "The task "+ toString(taskId) + " does not have any other dependendant task. No update done.");
+      LOG_RECORD(log, GreasyLog::devel, "AbstractSchedulerEngine::updateDependencies", "Exiting...");
       return;
   }
 
   for(it=revDepMap[taskId].begin() ; it!=revDepMap[taskId].end();it++ ) {
     child = taskMap[*it];
     if (state == GreasyTask::completed) {
-      log->record(GreasyLog::devel, "AbstractSchedulerEngine::updateDependencies", "Remove dependency " + toString(taskId) + " from task " + toString(child->getTaskId()));
+      LOG_RECORD(log, GreasyLog::devel, "AbstractSchedulerEngine::updateDependencies", "Remove dependency " + toString(taskId) + " from task " + toString(child->getTaskId()));
       child->removeDependency(taskId);
       if (!child->hasDependencies()) { 
-	log->record(GreasyLog::devel, "AbstractSchedulerEngine::updateDependencies", "Moving task from blocked set to the queue");
+	LOG_RECORD(log, GreasyLog::devel, "AbstractSchedulerEngine::updateDependencies", "Moving task from blocked set to the queue");
 	blockedTasks.erase(child);
 	taskQueue.push(child);
+	notifyTaskEvent(GreasyEvents::queued, child);
       } else {
-	log->record(GreasyLog::devel, "AbstractSchedulerEngine::updateDependencies", "The task still has dependencies, so leave it blocked");
+	LOG_RECORD(log, GreasyLog::devel, "AbstractSchedulerEngine::updateDependencies", "The task still has dependencies, so leave it blocked");
       }
     }
     else if ((state == GreasyTask::failed)||(state == GreasyTask::cancelled)) {
-      log->record(GreasyLog::warning,  "Cancelling task " + toString(child->getTaskId()) + " because of task " + toString(taskId) + " failure");
-      log->record(GreasyLog::devel, "AbstractSchedulerEngine::updateDependencies", "Parent failed: cancelling task and removing it from blocked");
-      child->setTaskState(GreasyTask::cancelled);
+      // A task reachable through several failed paths must only be cancelled once
+      if (!child->compareAndSetTaskState(GreasyTask::blocked, GreasyTask::cancelled)) continue;
+      notifyTaskEvent(GreasyEvents::cancelled, child, taskId);
+      LOG_RECORD(log, GreasyLog::warning,  "Cancelling task " + toString(child->getTaskId()) + " because of task " + toString(taskId) + " failure");
+      LOG_RECORD(log, GreasyLog::devel, "AbstractSchedulerEngine::updateDependencies", "Parent failed: cancelling task and removing it from blocked");
       blockedTasks.erase(child);
       updateDependencies(child);
     }
   }
   
-  log->record(GreasyLog::devel, "AbstractSchedulerEngine::updateDependencies", "Exiting...");
+  LOG_RECORD(log, GreasyLog::devel, "AbstractSchedulerEngine::updateDependencies", "Exiting...");
   
 }
 
@@ -168,41 +197,49 @@ void AbstractSchedulerEngine::taskEpilogue(GreasyTask *task) {
   
   int maxRetries=0;
 
-  log->record(GreasyLog::devel, "AbstractSchedulerEngine::taskEpilogue", "Entering...");
+  LOG_RECORD(log, GreasyLog::devel, "AbstractSchedulerEngine::taskEpilogue", "Entering...");
   
   if (config->keyExists("MaxRetries")) fromString(maxRetries, config->getValue("MaxRetries"));
-      
+
+  notifyTaskEvent(GreasyEvents::finished, task);
+
   if (task->getReturnCode() != 0) {
-    log->record(GreasyLog::error,  "Task " + toString(task->getTaskNum()) + " located in line " + toString(task->getTaskId()) + 
-		    " failed with exit code " + toString(task->getReturnCode()) + " on node " + 
-		    task->getHostname() +". Elapsed: " + GreasyTimer::secsToTime(task->getElapsedTime()));
+    LOG_RECORDF(log, GreasyLog::error, "", "Task %d located in line %d failed with exit code %d on node %s. Elapsed: %s",
+		task->getTaskNum(), task->getTaskId(), task->getReturnCode(), task->getHostname().c_str(),
+		GreasyTimer::usecsToTime(task->getElapsedTime()).c_str());
     // Task failed, let's retry if we need to
     if ((maxRetries > 0) && (task->getRetries() < maxRetries)) {
-      log->record(GreasyLog::warning,  "Retry "+ toString(task->getRetries()) + 
-		    "/" + toString(maxRetries) + " of task " + toString(task->getTaskId()));
+      LOG_RECORDF(log, GreasyLog::warning, "", "Retry %d/%d of task %d", task->getRetries(), maxRetries, task->getTaskId());
       task->addRetryAttempt();
+      notifyTaskEvent(GreasyEvents::retried, task);
       allocate(task);
     } else {
       task->setTaskState(GreasyTask::failed);
       updateDependencies(task);
     }
   } else {
-    log->record(GreasyLog::info,  "Task " + toString(task->getTaskNum()) + " located in line " + toString(task->getTaskId()) + 
-		    " completed successfully on node " + task->getHostname() + ". Elapsed: " + 
-		    GreasyTimer::secsToTime(task->getElapsedTime()));
+    LOG_RECORDF(log, GreasyLog::info, "", "Task %d located in line %d completed successfully on node %s. Elapsed: %s",
+		task->getTaskNum(), task->getTaskId(), task->getHostname().c_str(),
+		GreasyTimer::usecsToTime(task->getElapsedTime()).c_str());
     task->setTaskState(GreasyTask::completed);
     updateDependencies(task);
   }
   
-  log->record(GreasyLog::devel, "AbstractSchedulerEngine::taskEpilogue", "Exiting...");
+  LOG_RECORD(log, GreasyLog::devel, "AbstractSchedulerEngine::taskEpilogue", "Exiting...");
   
 }
 
+int AbstractSchedulerEngine::getWorkerSlots(int worker) {
+
+  return workerSlots;
+
+}
+
 void AbstractSchedulerEngine::getDefaultNWorkers() {
  
   nworkers = sysconf(_SC_NPROCESSORS_ONLN);
   if ( nworkers>4 ) nworkers=4;
   
-  log->record(GreasyLog::devel, "AbstractSchedulerEngine::getDefaultNWorkers", "Default nworkers: " + toString(nworkers));
+  LOG_RECORD(log, GreasyLog::devel, "AbstractSchedulerEngine::getDefaultNWorkers", "Default nworkers: " + toString(nworkers));
   
 }
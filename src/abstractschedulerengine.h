@@ -82,7 +82,9 @@ protected:
   
   /**
    * Wait for any worker to complete their tasks and retrieve
-   * results. It MUST be implemented in subclasses.
+   * results. It MUST be implemented in subclasses. It is called
+   * with the state of the tasks locked, and it must unlock it
+   * while it blocks.
    */
   virtual void waitForAnyWorker() = 0;
   
@@ -101,12 +103,21 @@ protected:
    * All the checks after a task finishes are done here, updating task and engine metadata.
    */  
   virtual void taskEpilogue(GreasyTask *task);
+
+  /**
+   * Get the number of tasks that can be assigned to a worker at the same time.
+   * @param worker The worker id.
+   * @return The number of slots of the worker. By default, workerSlots.
+   */
+  virtual int getWorkerSlots(int worker);
   
   
   map <int,int> taskAssignation; ///<  Map that holds the task assignation to workers.
 				 ///< worker -> taskId
   queue <int> freeWorkers; ///< The queue of free worker ids, from where the candidates
-			   ///< to run a task will be taken.
+			   ///< to run a task will be taken. A worker appears once per free slot.
+  int workerSlots; ///< Number of tasks that can be assigned to each worker at the same time.
+  int nslots; ///< Total number of slots among all workers.
   queue <GreasyTask*> taskQueue; ///< The queue of tasks to be executed.
   set <GreasyTask*> blockedTasks; ///< The set of blocked tasks.
 
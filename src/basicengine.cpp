@@ -31,6 +31,9 @@
 #define HOST_NAME_MAX sysconf (_SC_HOST_NAME_MAX)
 #endif
 
+// Pipe of the signal handler of the master, in greasy.cpp
+extern int signalPipe[2];
+
 BasicEngine::BasicEngine ( const string& filename) : AbstractSchedulerEngine(filename){
 
   engineType="basic";
@@ -41,7 +44,7 @@ void BasicEngine::init() {
 
   char hostname[HOST_NAME_MAX];
 
-  log->record(GreasyLog::devel, "BasicEngine::init", "Entering...");
+  LOG_RECORD(log, GreasyLog::devel, "BasicEngine::init", "Entering...");
 
   AbstractSchedulerEngine::init();
 
@@ -50,10 +53,10 @@ void BasicEngine::init() {
 
   // Setup the nodelist
   if (config->keyExists("NodeList")) {
-    log->record(GreasyLog::devel, "BasicEngine::init", "Nodelist setup");
+    LOG_RECORD(log, GreasyLog::devel, "BasicEngine::init", "Nodelist setup");
     vector<string> nodelist = split(config->getValue("NodeList"),',');
-    if (nworkers>nodelist.size()){
-      log->record(GreasyLog::error,  "Requested more workers than nodes in the nodelist. Check parameters Nworkers and NodeList");
+    if (nworkers>(int) nodelist.size()){
+      LOG_RECORD(log, GreasyLog::error,  "Requested more workers than nodes in the nodelist. Check parameters Nworkers and NodeList");
       ready = false;
     } else {
       // Fill the workerNodes map
@@ -66,15 +69,15 @@ void BasicEngine::init() {
     if (remote) {
       if (config->keyExists("BasicRemoteMethod")){
         if (config->getValue("BasicRemoteMethod")=="srun") {
-          log->record(GreasyLog::debug,  "Using srun to spawn remote tasks");
+          LOG_RECORD(log, GreasyLog::debug,  "Using srun to spawn remote tasks");
         } else if (config->getValue("BasicRemoteMethod")=="ssh") {
-          log->record(GreasyLog::debug,  "Using ssh to spawn remote tasks");
+          LOG_RECORD(log, GreasyLog::debug,  "Using ssh to spawn remote tasks");
         } else {
-          log->record(GreasyLog::error,  "No Basic Spawner in the system. Please run greasy locally unsetting the NodeList Parameter");
+          LOG_RECORD(log, GreasyLog::error,  "No Basic Spawner in the system. Please run greasy locally unsetting the NodeList Parameter");
           ready = false;
         }
       } else {
-        log->record(GreasyLog::error,  "No Basic Remote method configured. Please run greasy locally unsetting the NodeList Parameter");
+        LOG_RECORD(log, GreasyLog::error,  "No Basic Remote method configured. Please run greasy locally unsetting the NodeList Parameter");
         ready = false;
       }
     }
@@ -82,17 +85,17 @@ void BasicEngine::init() {
   }
 
 
-  log->record(GreasyLog::devel, "BasicEngine::init", "Exiting...");
+  LOG_RECORD(log, GreasyLog::devel, "BasicEngine::init", "Exiting...");
 
 }
 
 void BasicEngine::run() {
 
-  log->record(GreasyLog::devel, "BasicEngine::run", "Entering...");
+  LOG_RECORD(log, GreasyLog::devel, "BasicEngine::run", "Entering...");
 
   if (isReady()) runScheduler();
 
-  log->record(GreasyLog::devel, "BasicEngine::run", "Exiting...");
+  LOG_RECORD(log, GreasyLog::devel, "BasicEngine::run", "Exiting...");
 
 }
 
@@ -100,13 +103,16 @@ void BasicEngine::allocate(GreasyTask* task) {
 
   int worker;
 
-  log->record(GreasyLog::devel, "BasicEngine::allocate", "Entering...");
+  LOG_RECORD(log, GreasyLog::devel, "BasicEngine::allocate", "Entering...");
 
-  log->record(GreasyLog::info,  "Allocating task " + toString(task->getTaskId()));
+  LOG_RECORDF(log, GreasyLog::info, "", "Allocating task %d", task->getTaskId());
 
   worker = freeWorkers.front();
   freeWorkers.pop();
   taskAssignation[worker] = task->getTaskId();
+  task->setWorker(worker);
+  task->setHostname(getWorkerNode(worker));
+  notifyTaskEvent(GreasyEvents::dispatched, task);
 
   pid_t pid = fork();
 
@@ -114,30 +120,37 @@ void BasicEngine::allocate(GreasyTask* task) {
     // Child:
     // Disable signal handling in child processes
     // We only want to have the master in charge of the restarts and messages.
+    // The child does not exec, so it keeps the handler and the pipe of the
+    // master, and would pass it the signals sent to the whole process group.
     signal(SIGTERM, SIG_DFL);
     signal(SIGINT, SIG_DFL);
+    signal(SIGUSR1, SIG_DFL);
+    signal(SIGUSR2, SIG_DFL);
+    if (signalPipe[0] >= 0) close(signalPipe[0]);
+    if (signalPipe[1] >= 0) close(signalPipe[1]);
 
     // We use system instead of exec because of greater compatibility with command to be executed
     exit(executeTask(task,worker));
   } else if (pid > 0) {
     // Parent:
-    log->record(GreasyLog::debug,  "BasicEngine::allocate", "Task "
+    LOG_RECORD(log, GreasyLog::debug,  "BasicEngine::allocate", "Task "
               + toString(task->getTaskId()) + " to worker " + toString(worker)
               + " on node " + getWorkerNode(worker));
     pidToWorker[pid] = worker;
     task->setTaskState(GreasyTask::running);
     workerTimers[worker].reset();
     workerTimers[worker].start();
+    notifyTaskEvent(GreasyEvents::started, task);
 
   } else {
    //error
-   log->record(GreasyLog::error,  "Could not execute a new process");
+   LOG_RECORD(log, GreasyLog::error,  "Could not execute a new process");
    task->setTaskState(GreasyTask::failed);
    task->setReturnCode(-1);
    freeWorkers.push(worker);
   }
 
-  log->record(GreasyLog::devel, "BasicEngine::allocate", "Exiting...");
+  LOG_RECORD(log, GreasyLog::devel, "BasicEngine::allocate", "Exiting...");
 
 }
 
@@ -147,13 +160,16 @@ void BasicEngine::waitForAnyWorker() {
   int worker;
   pid_t pid;
   int status;
+  taskUsage usage;
   GreasyTask* task = NULL;
 
-  log->record(GreasyLog::devel, "BasicEngine::waitForAnyWorker", "Entering...");
+  LOG_RECORD(log, GreasyLog::devel, "BasicEngine::waitForAnyWorker", "Entering...");
 
   // Wait for any of the worker to finish
-  log->record(GreasyLog::debug,  "Waiting for any task to complete...");
-  pid = wait(&status);
+  LOG_RECORD(log, GreasyLog::debug,  "Waiting for any task to complete...");
+  unlockState();
+  pid = waitTask(-1, 0, &status, &usage);
+  lockState();
 
   // Identify the worker that was in charge of the child
   worker = pidToWorker[pid];
@@ -168,19 +184,20 @@ void BasicEngine::waitForAnyWorker() {
   // Update task info
   task = taskMap[taskAssignation[worker]];
   task->setReturnCode(retcode);
-  task->setElapsedTime(workerTimers[worker].secsElapsed());
+  task->setElapsedTime(workerTimers[worker].usecsElapsed());
   task->setHostname(getWorkerNode(worker));
+  task->setUsage(usage);
 
   // Run task epilogue stuff
   taskEpilogue(task);
 
-  log->record(GreasyLog::devel, "BasicEngine::waitForAnyWorker", "Exiting...");
+  LOG_RECORD(log, GreasyLog::devel, "BasicEngine::waitForAnyWorker", "Exiting...");
 
 }
 
 int BasicEngine::executeTask(GreasyTask *task, int worker) {
 
-  log->record(GreasyLog::devel, "BasicEngine::executeTask["+toString(worker) +"]", "Entering...");
+  LOG_RECORD(log, GreasyLog::devel, "BasicEngine::executeTask["+toString(worker) +"]", "Entering...");
   string command = "";
   string node = "";
   int ret;
@@ -212,12 +229,12 @@ int BasicEngine::executeTask(GreasyTask *task, int worker) {
     }
   }
 
-  log->record(GreasyLog::devel,  "BasicEngine::executeTask[" + toString(worker) +"]", "Task "
+  LOG_RECORD(log, GreasyLog::devel,  "BasicEngine::executeTask[" + toString(worker) +"]", "Task "
               + toString(task->getTaskId()) + " on node " + node + " with command: " + command);
   ret =  system(command.c_str());
   ret = WEXITSTATUS(ret);
-  log->record(GreasyLog::devel, "BasicEngine::executeTask["+toString(worker) +"]", "Task returned "+toString(ret));
-  log->record(GreasyLog::devel, "BasicEngine::executeTask["+toString(worker) +"]", "Exiting...");
+  LOG_RECORD(log, GreasyLog::devel, "BasicEngine::executeTask["+toString(worker) +"]", "Task returned "+toString(ret));
+  LOG_RECORD(log, GreasyLog::devel, "BasicEngine::executeTask["+toString(worker) +"]", "Exiting...");
   return ret;
 
 }
@@ -24,8 +24,13 @@
 #include "config.h"
 
 #include <string>
+#include <vector>
+#include <thread>
 #include <csignal>
 #include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
 
 #ifndef SYSTEM_CFG
 #define SYSTEM_CFG "../etc/greasy.conf"
@@ -38,20 +43,30 @@ using namespace std;
 
 AbstractEngine* engine = NULL;
 int my_pid;
+int signalPipe[2] = { -1, -1 };
 bool readConfig();
 void termHandler( int sig );
+void idleHandler( int sig );
+void interruptRun( bool wait );
+void signalHandler( int sig );
+void signalLoop();
+void dumpStatus();
+void writeCheckpoint();
 
 int main(int argc, char *argv[]) {
   my_pid=getpid();
   GreasyLog* log = GreasyLog::getInstance();
   GreasyConfig* config = GreasyConfig::getInstance();
     
-  if (argc != 2) {
-      cout << "Usage: greasy filename" << endl;
+  bool resume = (argc == 3) && (string(argv[1]) == "--resume");
+  bool fresh = (argc == 3) && (string(argv[1]) == "--fresh");
+
+  if ((argc != 2) && !resume && !fresh) {
+      cout << "Usage: greasy [--resume|--fresh] filename" << endl;
       return (0);
   }
   
-  string filename(argv[1]);
+  string filename(argv[argc-1]);
   
   // Read config
   if (!readConfig()) {
@@ -59,6 +74,11 @@ int main(int argc, char *argv[]) {
     return -1;
   }
 
+  // Skip the tasks already completed according to the journal
+  if (resume) config->insert("Resume", "yes");
+  // Or throw away the checkpoint and the journal of a previous run
+  if (fresh) config->insert("Fresh", "yes");
+
   // Log Init
   if(config->keyExists("LogFile"))
     log->logToFile(config->getValue("LogFile"));
@@ -67,17 +87,43 @@ int main(int argc, char *argv[]) {
     int logLevel = fromString(logLevel,config->getValue("LogLevel"));
     log->setLogLevel((GreasyLog::LogLevels)logLevel);
   }
+
+  // Write the log from a thread of its own, so that the scheduler never
+  // waits for the file system
+  int logBuffer = 4096;
+  if(config->keyExists("LogBuffer")) fromString(logBuffer, config->getValue("LogBuffer"));
+  log->startWriter(logBuffer);
   
-  // Handle interrupting signals appropiately.
-  signal(SIGTERM, termHandler);
-  signal(SIGINT,  termHandler);
-  signal(SIGUSR1, termHandler);
-  signal(SIGUSR2, termHandler);
+  // Handle interrupting signals appropiately. As there may be other threads,
+  // the handler only passes the signal to a thread of its own, where it is
+  // safe to take locks and allocate memory, and to wait for the engine to
+  // leave the tasks alone before writing the restart.
+  // There, SIGUSR1 dumps the status of the run and SIGUSR2 writes a
+  // checkpoint, while the scheduler goes on.
+  if (pipe(signalPipe) == 0) {
+    sigset_t all, previous;
+    fcntl(signalPipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(signalPipe[1], F_SETFD, FD_CLOEXEC);
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    thread(signalLoop).detach();
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    signal(SIGTERM, signalHandler);
+    signal(SIGINT,  signalHandler);
+    signal(SIGUSR1, signalHandler);
+    signal(SIGUSR2, signalHandler);
+  } else {
+    signal(SIGTERM, termHandler);
+    signal(SIGINT,  termHandler);
+    // Caught rather than ignored, as the tasks would inherit SIG_IGN
+    signal(SIGUSR1, idleHandler);
+    signal(SIGUSR2, idleHandler);
+  }
  
   // Create the proper engine selected and run it!
   engine = AbstractEngineFactory::getAbstractEngineInstance(filename,config->getValue("Engine"));
   if (!engine) {
-      log->record(GreasyLog::error,"Greasy could not load the engine");
+      LOG_RECORD(log, GreasyLog::error,"Greasy could not load the engine");
       return -1;
   }
   // Initialize the engine
@@ -107,16 +153,118 @@ bool readConfig () {
   
 }
 
+void signalHandler( int sig ) {
+
+  unsigned char number = sig;
+  int saved = errno;
+
+  if (write(signalPipe[1], &number, 1) < 0) termHandler(sig);
+  errno = saved;
+
+}
+
+void signalLoop() {
+
+  unsigned char number;
+  ssize_t n;
+
+  while (((n = read(signalPipe[0], &number, 1)) == 1) || ((n < 0) && (errno == EINTR))) {
+    if (n != 1) continue;
+    if (number == SIGUSR1) dumpStatus();
+    else if (number == SIGUSR2) writeCheckpoint();
+    else interruptRun(true);
+  }
+
+}
+
+void dumpStatus() {
+
+  GreasyLog* log = GreasyLog::getInstance();
+  GreasyConfig* config = GreasyConfig::getInstance();
+  string fileName = config->getValue("StatusFile");
+  string tmpFile = fileName + ".tmp";
+  vector<string> lines = GreasyMetrics::getInstance()->status();
+  FILE* out;
+  bool written;
+
+  // Only the master keeps the metrics. The other ranks of the mpi engine
+  // get the signal as well, and have nothing to say.
+  if (lines.empty()) {
+    if ((config->getValue("Metrics") == "no") && config->getValue("MetricsFile").empty())
+      LOG_RECORD(log, GreasyLog::warning, "No status to dump: the live metrics are disabled");
+    return;
+  }
+
+  if (fileName.empty()) {
+    for (unsigned int i = 0; i < lines.size(); i++) LOG_RECORD(log, GreasyLog::silent, lines[i]);
+    return;
+  }
+
+  // Written aside and then renamed, so readers never see it half written
+  out = fopen(tmpFile.c_str(), "w");
+  written = (out != NULL);
+  if (out) {
+    for (unsigned int i = 0; i < lines.size(); i++) fprintf(out, "%s\n", lines[i].c_str());
+    written = !ferror(out);
+    written = (fclose(out) == 0) && written;
+  }
+  if (written && (rename(tmpFile.c_str(), fileName.c_str()) == 0)) {
+    LOG_RECORD(log, GreasyLog::info, "Status written to " + fileName);
+  } else {
+    unlink(tmpFile.c_str());
+    LOG_RECORD(log, GreasyLog::warning, "Could not write the status to " + fileName);
+  }
+
+}
+
+void writeCheckpoint() {
+
+  GreasyLog* log = GreasyLog::getInstance();
+  GreasyJournal* journal = GreasyJournal::getInstance();
+
+  // As with the status, only the master keeps the journal
+  if (!journal->isOpen()) {
+    if (GreasyConfig::getInstance()->getValue("Journal") != "yes")
+      LOG_RECORD(log, GreasyLog::warning, "No checkpoint written: the journal is disabled");
+    return;
+  }
+
+  if (journal->checkpoint())
+    LOG_RECORD(log, GreasyLog::info, "Checkpoint written on request");
+  else
+    LOG_RECORD(log, GreasyLog::warning, "Could not write a checkpoint on request");
+
+}
+
 void termHandler( int sig ) {
+
+  // Without the signal thread, the engine may be interrupted in the middle of
+  // a change, so it cannot be waited for
+  interruptRun(false);
+
+}
+
+void idleHandler( int sig ) {
+
+  // Without the signal thread there is nobody to dump the status or write
+  // the checkpoint, so the signal is just dropped
+
+}
+
+void interruptRun( bool wait ) {
   char killTree[100];
   
   GreasyLog* log = GreasyLog::getInstance();
-  log->record(GreasyLog::error, "Caught TERM signal");
-  if (engine) engine->writeRestartFile();
-  log->record(GreasyLog::error, "Greasy was interrupted. Check restart & log files");
+  LOG_RECORD(log, GreasyLog::error, "Caught TERM signal");
+  if (engine) engine->interrupt(wait);
+  GreasyEvents::getInstance()->close();
+  GreasyTrace::getInstance()->close();
+  GreasyMetrics::getInstance()->close();
+  LOG_RECORD(log, GreasyLog::error, "Greasy was interrupted. Check restart & log files");
   log->logClose();
   sprintf(killTree, "kill  -- -%d", my_pid);
   system(killTree);
-  exit(1);
+  // Other threads are still running, so static objects are left alone
+  _exit(1);
 }
   
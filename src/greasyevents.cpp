@@ -0,0 +1,169 @@
+/* 
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ * 
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ * 
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#include "greasyevents.h"
+#include "greasyutils.h"
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/time.h>
+
+// Names of each one of the event types.
+const string GreasyEvents::eventTypesDesc[6] = {"queued", "dispatched", "started", "finished", "retried", "cancelled"};
+
+GreasyEvents::GreasyEvents() {
+
+  fd = -1;
+  enabled = false;
+  ownerPid = 0;
+
+}
+
+GreasyEvents::~GreasyEvents() {
+
+  // Forked children hold a copy of the events of their parent
+  if (getpid() == ownerPid) close();
+
+}
+
+GreasyEvents* GreasyEvents::getInstance() {
+
+  static GreasyEvents instance;
+  return &instance;
+
+}
+
+bool GreasyEvents::open(const string& fileName) {
+
+  lock_guard<mutex> guard(lock);
+
+  if (fd >= 0) return false;
+  fd = ::open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return false;
+  ownerPid = getpid();
+  buffer.reserve(2*EVENTS_BUFFER_SIZE);
+  enabled = true;
+  return true;
+
+}
+
+void GreasyEvents::record(EventTypes type, GreasyTask* task, int cause) {
+
+  char fields[256];
+  struct timeval tv;
+  const taskUsage* usage;
+  int worker;
+
+  // Runs without a stream never take the lock
+  if (!enabled) return;
+
+  lock_guard<mutex> guard(lock);
+  if ((fd < 0) || (getpid() != ownerPid)) return;
+
+  gettimeofday(&tv, NULL);
+  snprintf(fields, sizeof(fields), "{\"t\":%lld,\"event\":\"%s\",\"task\":%d,\"num\":%d",
+           (long long) tv.tv_sec*1000000 + tv.tv_usec, eventTypesDesc[type].c_str(),
+           task->getTaskId(), task->getTaskNum());
+  buffer += fields;
+
+  worker = task->getWorker();
+  if (((type == dispatched) || (type == started) || (type == finished)) && (worker >= 0)) {
+    snprintf(fields, sizeof(fields), ",\"worker\":%d", worker);
+    buffer += fields;
+  }
+
+  switch (type) {
+    case dispatched:
+      snprintf(fields, sizeof(fields), ",\"attempt\":%d", task->getRetries());
+      buffer += fields;
+      break;
+    case finished:
+      if (!task->getHostname().empty()) {
+        buffer += ",\"node\":";
+        appendJSONString(buffer, task->getHostname());
+      }
+      snprintf(fields, sizeof(fields), ",\"rc\":%d,\"elapsed\":%.6f,\"attempt\":%d",
+               task->getReturnCode(), task->getElapsedTime()/1e6, task->getRetries());
+      buffer += fields;
+      usage = task->getUsage();
+      if (usage) {
+        snprintf(fields, sizeof(fields), ",\"utime\":%lld,\"stime\":%lld,\"maxrss\":%lld,\"nvcsw\":%lld,\"nivcsw\":%lld",
+                 usage->utime, usage->stime, usage->maxrss, usage->nvcsw, usage->nivcsw);
+        buffer += fields;
+        if (usage->readBytes >= 0) {
+          snprintf(fields, sizeof(fields), ",\"read_bytes\":%lld,\"written_bytes\":%lld",
+                   usage->readBytes, usage->writtenBytes);
+          buffer += fields;
+        }
+      }
+      break;
+    case retried:
+      snprintf(fields, sizeof(fields), ",\"attempt\":%d", task->getRetries());
+      buffer += fields;
+      break;
+    case cancelled:
+      snprintf(fields, sizeof(fields), ",\"cause\":%d", cause);
+      buffer += fields;
+      break;
+    default:
+      break;
+  }
+  buffer += "}\n";
+
+  if (buffer.size() >= EVENTS_BUFFER_SIZE) writeBuffer();
+
+}
+
+void GreasyEvents::flush() {
+
+  lock_guard<mutex> guard(lock);
+  if ((fd >= 0) && (getpid() == ownerPid)) writeBuffer();
+
+}
+
+void GreasyEvents::close() {
+
+  lock_guard<mutex> guard(lock);
+
+  if (fd < 0) return;
+  if (getpid() == ownerPid) writeBuffer();
+  ::close(fd);
+  fd = -1;
+  enabled = false;
+
+}
+
+void GreasyEvents::writeBuffer() {
+
+  const char* data = buffer.data();
+  size_t left = buffer.size();
+  ssize_t n;
+
+  while (left > 0) {
+    n = write(fd, data, left);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    data += n;
+    left -= n;
+  }
+  buffer.clear();
+
+}
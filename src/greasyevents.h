@@ -0,0 +1,123 @@
+/* 
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ * 
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ * 
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#ifndef GREASYEVENTS_H
+#define GREASYEVENTS_H
+
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <unistd.h>
+
+#include "greasytask.h"
+
+#define EVENTS_BUFFER_SIZE 65536
+
+using namespace std;
+
+/**
+ * This class implements a structured stream of the events in the life of
+ * each task, written as JSON Lines: one JSON object per line, so that runs
+ * can be analysed without parsing the log. Every event carries a timestamp
+ * in microseconds since the epoch, its type and the task, plus the fields
+ * that make sense for the type: the worker and node, the return code, the
+ * elapsed time and the resources used by the task.
+ * Events are kept in memory and written in blocks of EVENTS_BUFFER_SIZE
+ * bytes, and whenever the stream is flushed or closed.
+ */
+class GreasyEvents {
+
+public:
+
+  /**
+  * Types of the events of a task.
+  */
+  enum EventTypes {
+    queued, /**< The task is ready to run and waits for a free worker. */
+    dispatched, /**< The task was sent to a worker. */
+    started, /**< The process of the task was started by the master itself. */
+    finished, /**< The task finished, successfully or not. */
+    retried, /**< The task failed or was lost, and it will be run again. */
+    cancelled /**< The task will never run because one of its dependencies failed. */
+  };
+
+  /**
+  * Names of the event types, as written in the stream.
+  */
+  static const string eventTypesDesc[6];
+
+  /**
+    * Get the unique GreasyEvents instance. Implementation of the Singleton Pattern.
+    * @return A pointer to the GreasyEvents instance.
+    */
+  static GreasyEvents* getInstance();
+
+  /**
+    * Destructor, which writes the events left in memory.
+    */
+  ~GreasyEvents();
+
+  /**
+    * Open the stream. Any stream left by a previous run is replaced.
+    * @param fileName Path to the stream.
+    * @return True if all is ok, false otherwise.
+    */
+  bool open(const string& fileName);
+
+  /**
+    * Record an event of a task, if the stream is open.
+    * It is safe to call it from several threads.
+    * @param type The type of the event.
+    * @param task The task.
+    * @param cause For cancelled tasks, the task whose failure cancelled it.
+    */
+  void record(EventTypes type, GreasyTask* task, int cause = -1);
+
+  /**
+    * Write all the events kept in memory.
+    */
+  void flush();
+
+  /**
+    * Write all the events kept in memory and close the stream.
+    */
+  void close();
+
+private:
+
+  /**
+    * Default constructor, hidden from everyone. If anyone wants to use the
+    * class, they should use the getInstance function.
+    */
+  GreasyEvents();
+
+  /**
+    * Write the buffer to the stream. Callers must hold lock.
+    */
+  void writeBuffer();
+
+  int fd; /**< Descriptor of the stream, or -1 if it is not open. */
+  atomic<bool> enabled; /**< Whether the stream is open, checked without the lock. */
+  string buffer; /**< Events not written yet. */
+  mutex lock; /**< Serializes the access to the buffer. */
+  pid_t ownerPid; /**< Process that opened the stream. Forked children leave it alone. */
+
+};
+
+#endif
@@ -0,0 +1,108 @@
+/* 
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ * 
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ * 
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#include "greasyhistogram.h"
+#include "greasyutils.h"
+#include <cstdio>
+#include <algorithm>
+
+GreasyHistogram::GreasyHistogram() {
+
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) counts[i] = 0;
+  count = 0;
+  total = 0;
+  maximum = 0;
+
+}
+
+void GreasyHistogram::add(long long usecs) {
+
+  int bucket = 0;
+
+  if (usecs < 0) usecs = 0;
+  // Bucket i > 0 holds the times from 2^(i-1) to 2^i
+  if (usecs > 0) bucket = min(64 - __builtin_clzll(usecs), HISTOGRAM_BUCKETS - 1);
+  counts[bucket]++;
+  count++;
+  total += usecs;
+  maximum = max(maximum, usecs);
+
+}
+
+unsigned long GreasyHistogram::getCount() {
+
+  return count;
+
+}
+
+long long GreasyHistogram::getTotal() {
+
+  return total;
+
+}
+
+long long GreasyHistogram::percentile(double percent) {
+
+  unsigned long target = (unsigned long) (count*percent/100.0 + 0.999999);
+  unsigned long seen = 0;
+
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += counts[i];
+    if ((seen >= target) && (seen > 0)) return min(1LL << i, maximum);
+  }
+  return maximum;
+
+}
+
+string GreasyHistogram::summary() {
+
+  if (count == 0) return "none";
+  return "count " + toString(count) + ", mean " + formatTime(total/count)
+          + ", p50 <= " + formatTime(percentile(50)) + ", p99 <= " + formatTime(percentile(99))
+          + ", max " + formatTime(maximum) + ", total " + formatTime(total);
+
+}
+
+vector<string> GreasyHistogram::buckets() {
+
+  vector<string> lines;
+  unsigned long largest = 0;
+  char line[128];
+
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) largest = max(largest, counts[i]);
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    if (counts[i] == 0) continue;
+    snprintf(line, sizeof(line), "[%9s, %9s) %8lu ", (i == 0) ? "0 us" : formatTime(1LL << (i-1)).c_str(),
+             formatTime(1LL << i).c_str(), counts[i]);
+    lines.push_back(string(line) + string((counts[i]*40 + largest - 1)/largest, '#'));
+  }
+  return lines;
+
+}
+
+string GreasyHistogram::formatTime(long long usecs) {
+
+  char buf[32];
+
+  if (usecs < 1000) snprintf(buf, sizeof(buf), "%lld us", usecs);
+  else if (usecs < 1000000) snprintf(buf, sizeof(buf), "%.2f ms", usecs/1e3);
+  else snprintf(buf, sizeof(buf), "%.2f s", usecs/1e6);
+  return string(buf);
+
+}
@@ -0,0 +1,99 @@
+/* 
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ * 
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ * 
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#ifndef GREASYHISTOGRAM_H
+#define GREASYHISTOGRAM_H
+
+#include <string>
+#include <vector>
+
+#define HISTOGRAM_BUCKETS 40
+
+using namespace std;
+
+/**
+ * Histogram of times in microseconds, with log-scale buckets: the first
+ * one holds the times under 1 us, and each of the others the times from
+ * a power of two up to the next one.
+ */
+class GreasyHistogram {
+
+public:
+
+  /**
+    * Default constructor of an empty histogram.
+    */
+  GreasyHistogram();
+
+  /**
+    * Add a time to the histogram. Negative times count as 0.
+    * @param usecs The time in microseconds.
+    */
+  void add(long long usecs);
+
+  /**
+    * Get the number of times added.
+    * @return The number of times.
+    */
+  unsigned long getCount();
+
+  /**
+    * Get the upper bound of the bucket where a percentile falls.
+    * @param percent The percentile, from 0 to 100.
+    * @return The bound in microseconds.
+    */
+  long long percentile(double percent);
+
+  /**
+    * Get a one line summary: count, mean, median, 99th percentile, maximum
+    * and total.
+    * @return The summary.
+    */
+  string summary();
+
+  /**
+    * Get a line for each bucket that is not empty, with its bounds, its
+    * count and a bar proportional to it.
+    * @return The lines.
+    */
+  vector<string> buckets();
+
+  /**
+    * Get the sum of the times added.
+    * @return The sum in microseconds.
+    */
+  long long getTotal();
+
+  /**
+    * Format a time with the unit that suits it best: us, ms or s.
+    * @param usecs The time in microseconds.
+    * @return The formatted time.
+    */
+  static string formatTime(long long usecs);
+
+private:
+
+  unsigned long counts[HISTOGRAM_BUCKETS]; /**< Times in each bucket. */
+  unsigned long count; /**< Number of times added. */
+  long long total; /**< Sum of the times added. */
+  long long maximum; /**< Largest time added. */
+
+};
+
+#endif
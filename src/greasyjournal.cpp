@@ -0,0 +1,454 @@
+/* 
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ * 
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ * 
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#include "greasyjournal.h"
+#include "greasylog.h"
+#include "greasyutils.h"
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <cstdio>
+#include <climits>
+#include <algorithm>
+
+// Monotonic time in seconds, to pace the syncs.
+static double monotonicNow() {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+
+}
+
+// Write a whole buffer, retrying on interruptions.
+static bool writeAll(int fd, const void* data, size_t size) {
+
+  const char* buffer = (const char*)data;
+  ssize_t n;
+
+  while (size > 0) {
+    n = write(fd, buffer, size);
+    if ((n < 0)&&(errno == EINTR)) continue;
+    if (n <= 0) return false;
+    buffer += n;
+    size -= n;
+  }
+  return true;
+
+}
+
+GreasyJournal::GreasyJournal() {
+
+  fd = -1;
+  lockFd = -1;
+  syncInterval = 1000;
+  lastSync = 0;
+  unsynced = 0;
+  pending = 0;
+  rotating = true;
+  checkpoints = 0;
+  checkpointTime = 0;
+  checkpointMaxTime = 0;
+  checkpointSize = 0;
+  checkpointMaxStall = 0;
+
+}
+
+GreasyJournal* GreasyJournal::getInstance() {
+
+  static GreasyJournal instance;
+  return &instance;
+
+}
+
+int GreasyJournal::read(const string& fileName, journalHeader& header, vector<journalRecord>& records) {
+
+  journalRecord buffer[1024];
+  ssize_t n;
+  size_t left = 0;
+  int in = ::open(fileName.c_str(), O_RDONLY);
+
+  if (in < 0) return 0;
+
+  if ((::read(in, &header, sizeof(header)) != sizeof(header)) || (memcmp(header.magic, "GRSJ", 4) != 0)
+      || (header.version != JOURNAL_VERSION)) {
+    ::close(in);
+    return -1;
+  }
+
+  // A record cut by a crash is left out
+  while ((n = ::read(in, (char*)buffer + left, sizeof(buffer) - left)) > 0) {
+    left += n;
+    records.insert(records.end(), buffer, buffer + left/sizeof(journalRecord));
+    memmove(buffer, (char*)buffer + left - left%sizeof(journalRecord), left%sizeof(journalRecord));
+    left %= sizeof(journalRecord);
+  }
+  ::close(in);
+
+  return 1;
+
+}
+
+bool GreasyJournal::reserve(const string& fileName) {
+
+  if (lockFd >= 0) return true;
+
+  lockFd = ::open((fileName + ".lock").c_str(), O_RDWR|O_CREAT|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+  if (lockFd < 0) return false;
+
+  // The lock goes away with the process, however it ends
+  if (flock(lockFd, LOCK_EX|LOCK_NB) != 0) {
+    ::close(lockFd);
+    lockFd = -1;
+    return false;
+  }
+  return true;
+
+}
+
+int GreasyJournal::create(const string& fileName, unsigned int generation) {
+
+  journalHeader header;
+  int out;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "GRSJ", 4);
+  header.version = JOURNAL_VERSION;
+  header.lines = state.getHeader().lines;
+  header.tasks = state.getHeader().tasks;
+  header.hash = state.getHeader().hash;
+  header.generation = generation;
+
+  out = ::open(fileName.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_APPEND|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+  if ((out >= 0) && (!writeAll(out, &header, sizeof(header)) || (fdatasync(out) != 0))) {
+    ::close(out);
+    out = -1;
+  }
+  return out;
+
+}
+
+bool GreasyJournal::open(const string& fileName, const string& checkpointName, const GreasyCheckpoint& initial,
+                         int interval, bool resumed) {
+
+  close();
+
+  journalFile = fileName;
+  checkpointFile = checkpointName;
+  syncInterval = interval;
+  state = initial;
+  rotating = true;
+  pending = 0;
+
+  // The previous journals can only go once what they hold is in a checkpoint
+  if (resumed) {
+    state.setGeneration(state.getGeneration() + 1);
+    if (state.write(checkpointFile) == 0) return false;
+  }
+
+  fd = create(journalFile, state.getGeneration());
+  if (fd < 0) return false;
+  unlink((journalFile + ".new").c_str());
+  lastSync = monotonicNow();
+  unsynced = 0;
+
+  return true;
+
+}
+
+void GreasyJournal::record(GreasyTask* task) {
+
+  journalRecord entry;
+  double now;
+  int syncFd = -1;
+
+  entry.taskId = task->getTaskId();
+  entry.state = task->getTaskState();
+  entry.retries = min(task->getRetries(), SHRT_MAX);
+  entry.retcode = task->getReturnCode();
+  entry.elapsed = task->getElapsedTime();
+
+  {
+    lock_guard<mutex> guard(lock);
+
+    if (fd < 0) return;
+
+    state.record(entry.taskId, entry.state, entry.retries);
+    pending++;
+
+    // Records reach the kernel right away. The disk is only synced once the
+    // interval has passed, so that many records share the same sync.
+    if (!writeAll(fd, &entry, sizeof(entry))) return;
+    unsynced++;
+    now = monotonicNow();
+    if ((now - lastSync)*1000 < syncInterval) return;
+    lastSync = now;
+    unsynced = 0;
+    // A checkpoint may close the journal meanwhile, so the sync goes
+    // through a descriptor of its own
+    syncFd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  }
+
+  // Other threads keep recording while the disk is synced
+  if (syncFd >= 0) {
+    fdatasync(syncFd);
+    ::close(syncFd);
+  }
+
+}
+
+bool GreasyJournal::isOpen() {
+
+  lock_guard<mutex> guard(lock);
+  return fd >= 0;
+
+}
+
+bool GreasyJournal::checkpoint() {
+
+  lock_guard<mutex> serial(checkpointLock);
+  GreasyLog* log = GreasyLog::getInstance();
+  GreasyCheckpoint snapshot;
+  string newFile = journalFile + ".new";
+  double start, elapsed;
+  size_t size;
+  int newFd, oldFd, generation;
+  bool sync;
+
+  // Only this method changes the generation, so the new journal can be
+  // created and synced before the recording is stopped.
+  {
+    lock_guard<mutex> guard(lock);
+    if ((fd < 0) || !rotating) return false;
+    generation = state.getGeneration() + 1;
+  }
+  newFd = create(newFile, generation);
+  if (newFd < 0) {
+    LOG_RECORD(log, GreasyLog::warning, "Could not create journal " + newFile + ". Checkpoint skipped");
+    return false;
+  }
+
+  // Only the copy of the state and the switch to the new journal stop the
+  // recording. The old journal is synced and the checkpoint is written
+  // afterwards.
+  start = monotonicNow();
+  {
+    lock_guard<mutex> guard(lock);
+    state.setGeneration(generation);
+    snapshot = state;
+    oldFd = fd;
+    sync = (unsynced > 0);
+    fd = newFd;
+    lastSync = monotonicNow();
+    unsynced = 0;
+    pending = 0;
+  }
+  elapsed = monotonicNow() - start;
+  checkpointMaxStall = max(checkpointMaxStall, elapsed);
+
+  start = monotonicNow();
+  if (sync) fdatasync(oldFd);
+  ::close(oldFd);
+  size = snapshot.write(checkpointFile);
+  // Until the new journal replaces the old one, a resume reads both
+  if ((size == 0) || (rename(newFile.c_str(), journalFile.c_str()) != 0)) {
+    lock_guard<mutex> guard(lock);
+    rotating = false;
+    LOG_RECORD(log, GreasyLog::warning, "Could not write checkpoint " + checkpointFile + ". Journals will be kept instead");
+    return false;
+  }
+  elapsed = monotonicNow() - start;
+
+  checkpoints++;
+  checkpointTime += elapsed;
+  checkpointMaxTime = max(checkpointMaxTime, elapsed);
+  checkpointSize = size;
+  LOG_RECORD(log, GreasyLog::debug, "Checkpoint " + checkpointFile + " written: " + toString(size) + " bytes in "
+              + toString(elapsed*1000) + " ms");
+
+  return true;
+
+}
+
+void GreasyJournal::startCheckpoints(int interval) {
+
+  if ((interval <= 0) || (fd < 0)) return;
+  writer.start(bind(&GreasyJournal::periodicCheckpoint, this), interval*1000);
+
+}
+
+void GreasyJournal::periodicCheckpoint() {
+
+  bool changed;
+
+  {
+    lock_guard<mutex> guard(lock);
+    changed = (pending > 0);
+  }
+  if (changed) checkpoint();
+
+}
+
+void GreasyJournal::close() {
+
+  GreasyLog* log = GreasyLog::getInstance();
+
+  // A checkpoint cut short by the exit is never renamed
+  writer.stop();
+
+  if (fd < 0) return;
+
+  checkpoint();
+
+  lock_guard<mutex> guard(lock);
+  if (unsynced > 0) fdatasync(fd);
+  ::close(fd);
+  fd = -1;
+  unsynced = 0;
+
+  if (checkpoints > 0)
+    LOG_RECORD(log, GreasyLog::info, "Wrote " + toString(checkpoints) + " checkpoints of up to " + toString(checkpointSize)
+                + " bytes, " + toString(checkpointTime*1000/checkpoints) + " ms on average and "
+                + toString(checkpointMaxTime*1000) + " ms at most. Recording stopped for up to "
+                + toString(checkpointMaxStall*1000) + " ms to take each snapshot");
+
+}
+
+GreasyCheckpoint::GreasyCheckpoint() {
+
+  reset(0, 0, 0, 0);
+
+}
+
+void GreasyCheckpoint::reset(unsigned long long hash, int lines, int tasks, unsigned int generation) {
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "GRSC", 4);
+  header.version = CHECKPOINT_VERSION;
+  header.hash = hash;
+  header.lines = lines;
+  header.tasks = tasks;
+  header.generation = generation;
+  completed.assign(lines/8 + 1, 0);
+  entries.clear();
+
+}
+
+void GreasyCheckpoint::record(int taskId, int state, int retries) {
+
+  map<int,checkpointEntry>::iterator it;
+
+  if ((taskId <= 0) || (taskId > header.lines)) return;
+
+  if (state == GreasyTask::completed) completed[taskId/8] |= 1 << (taskId%8);
+
+  // Tasks not completed are run again anyway, so only failures and retries need an entry
+  if ((state == GreasyTask::failed) || (retries > 0)) {
+    it = entries.find(taskId);
+    if (it == entries.end()) {
+      it = entries.insert(make_pair(taskId, checkpointEntry())).first;
+      it->second.taskId = taskId;
+      it->second.failures = 0;
+    }
+    it->second.state = state;
+    it->second.retries = retries;
+    if (state == GreasyTask::failed) it->second.failures++;
+    header.entries = entries.size();
+  }
+
+}
+
+bool GreasyCheckpoint::isCompleted(int taskId) {
+
+  if ((taskId <= 0) || (taskId > header.lines)) return false;
+  return completed[taskId/8] & (1 << (taskId%8));
+
+}
+
+int GreasyCheckpoint::read(const string& fileName, unsigned long long hash) {
+
+  checkpointHeader found;
+  vector<checkpointEntry> list;
+  bool ok;
+  int in = ::open(fileName.c_str(), O_RDONLY);
+
+  if (in < 0) return 0;
+
+  ok = (::read(in, &found, sizeof(found)) == sizeof(found)) && (memcmp(found.magic, "GRSC", 4) == 0)
+       && (found.version == CHECKPOINT_VERSION) && (found.hash == hash) && (found.lines >= 0) && (found.entries >= 0);
+  if (ok) {
+    reset(found.hash, found.lines, found.tasks, found.generation);
+    list.resize(found.entries);
+    ok = (::read(in, &completed[0], completed.size()) == (ssize_t)completed.size());
+    if (ok && !list.empty())
+      ok = (::read(in, &list[0], list.size()*sizeof(checkpointEntry)) == (ssize_t)(list.size()*sizeof(checkpointEntry)));
+  }
+  ::close(in);
+
+  if (!ok) {
+    reset(0, 0, 0, 0);
+    return -1;
+  }
+  for (size_t i = 0; i < list.size(); i++) entries[list[i].taskId] = list[i];
+  header.entries = entries.size();
+  return 1;
+
+}
+
+size_t GreasyCheckpoint::write(const string& fileName) {
+
+  string tmpFile = fileName + ".tmp";
+  vector<checkpointEntry> list;
+  map<int,checkpointEntry>::iterator it;
+  struct iovec parts[3];
+  size_t size;
+  ssize_t n;
+  bool ok;
+  int out = ::open(tmpFile.c_str(), O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+
+  if (out < 0) return 0;
+
+  list.reserve(entries.size());
+  for (it=entries.begin(); it!=entries.end(); it++) list.push_back(it->second);
+  size = sizeof(header) + completed.size() + list.size()*sizeof(checkpointEntry);
+
+  // Header, bitmap and entries go to disk in a single write
+  parts[0].iov_base = &header;
+  parts[0].iov_len = sizeof(header);
+  parts[1].iov_base = &completed[0];
+  parts[1].iov_len = completed.size();
+  parts[2].iov_base = list.empty() ? NULL : &list[0];
+  parts[2].iov_len = list.size()*sizeof(checkpointEntry);
+  do {
+    n = writev(out, parts, 3);
+  } while ((n < 0) && (errno == EINTR));
+
+  ok = (n == (ssize_t)size) && (fdatasync(out) == 0);
+  ok = (::close(out) == 0) && ok;
+  if (ok) ok = (rename(tmpFile.c_str(), fileName.c_str()) == 0);
+  if (!ok) unlink(tmpFile.c_str());
+
+  return ok ? size : 0;
+
+}
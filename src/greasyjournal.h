@@ -0,0 +1,302 @@
+/* 
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ * 
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ * 
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#ifndef GREASYJOURNAL_H
+#define GREASYJOURNAL_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <unistd.h>
+
+#include "greasytask.h"
+#include "greasyutils.h"
+
+using namespace std;
+
+// Versions of the journal and checkpoint layouts. They must be increased
+// whenever the structures below change.
+#define JOURNAL_VERSION 4
+#define CHECKPOINT_VERSION 1
+
+/**
+ * Header at the start of every journal, identifying the task file it belongs to.
+ */
+typedef struct {
+    char magic[4]; /**< Always "GRSJ". */
+    int version; /**< Layout version of the journal. */
+    int lines; /**< Number of the last task line in the task file. */
+    int tasks; /**< Number of valid tasks in the task file. */
+    unsigned long long hash; /**< Hash of the contents of the task file. */
+    unsigned int generation; /**< Generation of the checkpoint the journal continues. */
+    int reserved; /**< Padding, always 0. */
+} journalHeader;
+
+/**
+ * Record appended to the journal each time a task reaches a final state.
+ */
+typedef struct {
+    int taskId; /**< Line of the task in the task file. */
+    short state; /**< Final state reached, from GreasyTask::TaskStates. */
+    short retries; /**< Retries used by the task. */
+    int retcode; /**< Return code of the task. */
+    unsigned long long elapsed; /**< Microseconds elapsed in the last run of the task. */
+} journalRecord;
+
+/**
+ * Header at the start of every checkpoint. It is followed by the completion
+ * bitmap, one bit per line of the task file, and then by the entries.
+ */
+typedef struct {
+    char magic[4]; /**< Always "GRSC". */
+    int version; /**< Layout version of the checkpoint. */
+    unsigned long long hash; /**< Hash of the contents of the task file. */
+    int lines; /**< Number of the last task line in the task file. */
+    int tasks; /**< Number of valid tasks in the task file. */
+    unsigned int generation; /**< Increased every time a checkpoint is written. */
+    int entries; /**< Number of checkpointEntry after the bitmap. */
+} checkpointHeader;
+
+/**
+ * Entry of the checkpoint for a task that failed or needed retries.
+ */
+typedef struct {
+    int taskId; /**< Line of the task in the task file. */
+    int state; /**< State of the task, from GreasyTask::TaskStates. */
+    int retries; /**< Retries used in the last run of the task. */
+    int failures; /**< Number of runs, of this and previous executions, where the task failed. */
+} checkpointEntry;
+
+/**
+ * This class holds a compact image of the progress of a task file: a bitmap
+ * with the completed tasks plus an entry for each task that failed or was
+ * retried. It is stored next to the task file and tied to its hash, so a
+ * run can be resumed against the original file, and it is written with a
+ * single sequential write of about one bit per task.
+ */
+class GreasyCheckpoint {
+
+public:
+
+  /**
+    * Constructor of an empty checkpoint.
+    */
+  GreasyCheckpoint();
+
+  /**
+    * Clear the checkpoint and set it up for a task file.
+    * @param hash Hash of the contents of the task file.
+    * @param lines Number of the last task line in the task file.
+    * @param tasks Number of valid tasks in the task file.
+    * @param generation Generation of the checkpoint.
+    */
+  void reset(unsigned long long hash, int lines, int tasks, unsigned int generation);
+
+  /**
+    * Update the checkpoint with a task that reached a final state.
+    * @param taskId The line of the task.
+    * @param state The final state of the task.
+    * @param retries The retries used by the task.
+    */
+  void record(int taskId, int state, int retries);
+
+  /**
+    * Check if a task is completed.
+    * @param taskId The line of the task.
+    * @return True if the task is marked as completed.
+    */
+  bool isCompleted(int taskId);
+
+  /**
+    * Get the entries of the tasks that failed or were retried.
+    * @return The entries, by task line.
+    */
+  const map<int,checkpointEntry>& getEntries() { return entries; }
+
+  /**
+    * Get the header of the checkpoint.
+    * @return The header.
+    */
+  const checkpointHeader& getHeader() { return header; }
+
+  /**
+    * Get the generation of the checkpoint.
+    * @return The generation.
+    */
+  unsigned int getGeneration() { return header.generation; }
+
+  /**
+    * Set the generation of the checkpoint.
+    * @param generation The generation.
+    */
+  void setGeneration(unsigned int generation) { header.generation = generation; }
+
+  /**
+    * Read a checkpoint from disk.
+    * @param fileName Path to the checkpoint.
+    * @param hash Hash of the contents of the task file the checkpoint must belong to.
+    * @return 1 if it was read, 0 if there is none, and -1 if it belongs to another task file or is damaged.
+    */
+  int read(const string& fileName, unsigned long long hash);
+
+  /**
+    * Write the checkpoint to disk. It is written to a temporary file which then
+    * replaces the previous checkpoint, so there is always a complete one.
+    * @param fileName Path to the checkpoint.
+    * @return The bytes written, or 0 if it could not be written.
+    */
+  size_t write(const string& fileName);
+
+private:
+
+  checkpointHeader header; /**< Header of the checkpoint. */
+  vector<unsigned char> completed; /**< Completion bitmap, indexed by task line. */
+  map<int,checkpointEntry> entries; /**< Entries of the tasks that failed or were retried. */
+
+};
+
+/**
+ * This class implements an append-only binary journal of the tasks that
+ * reach a final state. Records are written as soon as they happen, so they
+ * survive the master being killed, and synced to disk in batches, at most
+ * every sync interval, so that they also survive the node going down.
+ * It also keeps the checkpoint of the run up to date in memory. Every time
+ * the checkpoint is written, the journal starts over in a new file, which
+ * only replaces the previous journal once the checkpoint is safe on disk.
+ * With both, a run can be resumed without running again the tasks completed.
+ */
+class GreasyJournal {
+
+public:
+
+  /**
+    * Get the unique GreasyJournal instance. Implementation of the Singleton Pattern.
+    * @return A pointer to the GreasyJournal instance.
+    */
+  static GreasyJournal* getInstance();
+
+  /**
+    * Read the header and the records of an existing journal.
+    * @param fileName Path to the journal.
+    * @param header The header where the one found is stored.
+    * @param records The vector where the records are added.
+    * @return 1 if the journal was read, 0 if there is none, and -1 if it is not a valid journal.
+    */
+  int read(const string& fileName, journalHeader& header, vector<journalRecord>& records);
+
+  /**
+    * Take the lock of a journal, so that no other run records in it at the
+    * same time. The lock is kept in a file next to the journal, with the
+    * .lock extension, and held until the process ends.
+    * @param fileName Path to the journal.
+    * @return True if the lock was taken, false if another run holds it or it could not be created.
+    */
+  bool reserve(const string& fileName);
+
+  /**
+    * Open the journal to record the tasks. Any journal left by a previous run is replaced.
+    * @param fileName Path to the journal.
+    * @param checkpointFile Path to the checkpoint.
+    * @param state The checkpoint to start from, for the current task file.
+    * @param syncInterval Maximum milliseconds between syncs to disk. With 0, every record is synced.
+    * @param resumed If true, the state comes from a previous run, so it is written as a new
+    * checkpoint before the previous journals are replaced.
+    * @return True if all is ok, false otherwise.
+    */
+  bool open(const string& fileName, const string& checkpointFile, const GreasyCheckpoint& state,
+            int syncInterval, bool resumed);
+
+  /**
+    * Append the final state of a task to the journal, if it is open.
+    * It is safe to call it from several threads. Only the write is done under
+    * the lock; syncing to disk, when due, happens after releasing it.
+    * @param task The task.
+    */
+  void record(GreasyTask* task);
+
+  /**
+    * Check if the journal is open.
+    * @return True if the tasks are being recorded.
+    */
+  bool isOpen();
+
+  /**
+    * Write the checkpoint with the tasks recorded so far. Recording goes on
+    * meanwhile, in a new journal.
+    * @return True if the checkpoint was written.
+    */
+  bool checkpoint();
+
+  /**
+    * Start a thread that writes the checkpoint periodically, if there are new records.
+    * @param interval Seconds between checkpoints.
+    */
+  void startCheckpoints(int interval);
+
+  /**
+    * Write the last checkpoint, sync the pending records and close the journal.
+    */
+  void close();
+
+private:
+
+  /**
+    * Default constructor, hidden from everyone. If anyone wants to use the
+    * class, they should use the getInstance function.
+    */
+  GreasyJournal();
+
+  /**
+    * Create a new journal file, with its header.
+    * @param fileName Path to the journal.
+    * @param generation Generation of the checkpoint the journal continues.
+    * @return The descriptor of the journal, or -1 if it could not be created.
+    */
+  int create(const string& fileName, unsigned int generation);
+
+  /**
+    * Body of the thread of the periodic checkpoints, which writes one if there are new records.
+    */
+  void periodicCheckpoint();
+
+  int fd; /**< Descriptor of the journal, or -1 if it is not open. */
+  int lockFd; /**< Descriptor of the lock file of the journal, or -1 if not reserved. */
+  string journalFile; /**< Path to the journal. */
+  string checkpointFile; /**< Path to the checkpoint. */
+  int syncInterval; /**< Maximum milliseconds between syncs to disk. */
+  double lastSync; /**< Time of the last sync to disk. */
+  unsigned long unsynced; /**< Number of records written since the last sync. */
+  unsigned long pending; /**< Number of records not in the checkpoint yet. */
+  bool rotating; /**< False once a checkpoint failed, so the journals are kept. */
+  GreasyCheckpoint state; /**< Checkpoint of the run, up to date with the records. */
+  mutex lock; /**< Lock to record from several threads. */
+  mutex checkpointLock; /**< Lock to write one checkpoint at a time. */
+
+  GreasyPeriodicThread writer; /**< Thread of the periodic checkpoints. */
+
+  unsigned long checkpoints; /**< Number of checkpoints written. */
+  double checkpointTime; /**< Seconds spent writing checkpoints. */
+  double checkpointMaxTime; /**< Longest time spent writing a checkpoint. */
+  size_t checkpointSize; /**< Size of the last checkpoint written. */
+  double checkpointMaxStall; /**< Longest time recording was stopped to take a snapshot. */
+
+};
+
+#endif // GREASYJOURNAL_H
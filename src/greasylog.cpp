@@ -18,7 +18,13 @@
 */
 
 #include "greasylog.h"
-#include "greasytimer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdarg>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
 
 // Description of each one of the levels.
 const string GreasyLog::logLevelsDesc[NUM_LEVELS] = {"", "ERROR: ", "WARNING: ","INFO: ","DEBUG: ","DEVEL: "};
@@ -29,7 +35,18 @@ GreasyLog::GreasyLog()
   // By default, set level log to info until it is inited.
   logLevel =  getDefaultLogLevel();
   isFile = false;
-  logFile = (ofstream*) &cerr;
+  fd = STDERR_FILENO;
+  ring = NULL;
+  mask = 0;
+  enqueuePos = 0;
+  dequeuePos = 0;
+  wakeRequested = false;
+
+}
+
+GreasyLog::~GreasyLog() {
+
+  logClose();
 
 }
 
@@ -66,19 +83,19 @@ void GreasyLog::setLogLevel(LogLevels level) {
 
 bool GreasyLog::logToFile(string fileName) {
 
-  if(fileName=="") {
-    logFile = (ofstream*) &cerr;
-  } else {
-    if((isFile)&&(logFile->is_open())) logFile->close();
-    logFile = new ofstream();
-    logFile->open(fileName.c_str(), ios::out| ios::app );
-    if(!logFile->is_open()) {
-      delete logFile;
-      logFile = (ofstream*) &cerr;
-    } else {
-      isFile = true;
-    }
+  int newFd = STDERR_FILENO;
+
+  if(fileName!="") {
+    newFd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (newFd < 0) newFd = STDERR_FILENO;
   }
+
+  // Entries already queued go to the previous file
+  lock_guard<mutex> guard(writeLock);
+  if (writer.isRunning()) drain();
+  if (isFile) close(fd);
+  fd = newFd;
+  isFile = (fd != STDERR_FILENO);
   return isFile;
 
 }
@@ -86,32 +103,210 @@ bool GreasyLog::logToFile(string fileName) {
 void GreasyLog::logClose() {
 
   logLevel = 0;
+  // A forked child leaves the entries of its parent to the parent
+  if (writer.isRunning()) {
+    writer.stop();
+    lock_guard<mutex> guard(writeLock);
+    drain();
+  }
   if (isFile) {
-    if (logFile->is_open()) logFile->close();
-    if (logFile) delete logFile;
-    isFile=0;
+    close(fd);
+    isFile = false;
   }
-  logFile = (ofstream*) &cerr;
+  fd = STDERR_FILENO;
+
+}
+
+bool GreasyLog::startWriter(int size) {
+
+  size_t capacity = 2;
+
+  // The ring is never freed, as threads may still be recording while exiting
+  if ((size <= 0) || ring) return false;
+
+  while (capacity < (size_t) size) capacity <<= 1;
+  ring = new logSlot[capacity];
+  for (size_t i = 0; i < capacity; i++) ring[i].sequence = i;
+  mask = capacity - 1;
+  enqueuePos = 0;
+  dequeuePos = 0;
+  wakeRequested = false;
+
+  return writer.start(bind(&GreasyLog::writeQueued, this), LOG_FLUSH_INTERVAL);
 
 }
 
-void GreasyLog::record(LogLevels level, string message) {
+void GreasyLog::flush() {
+
+  if (!writer.isRunning()) return;
+  lock_guard<mutex> guard(writeLock);
+  drain();
+
+}
+
+void GreasyLog::record(LogLevels level, const string& message) {
   
-  record(level,"",message);
+  if (isEnabled(level)) commit(level, beginEntry(level, NULL, 0) += message);
   
 }
 
-void GreasyLog::record(LogLevels level, string prefix, string message) {
+void GreasyLog::record(LogLevels level, const string& prefix, const string& message) {
 
-  string mes="";
-  if (level<=logLevel) {
-    if (prefix.empty()) 
-      mes = "[" + GreasyTimer::now() + "] " + logLevelsDesc[level] + message + "\n";
-    else
-      mes = "[" + GreasyTimer::now() + "] " + logLevelsDesc[level] + "[" + prefix + "] " + message + "\n";
-    
-    (*logFile) << mes;
-    logFile->flush();
+  if (isEnabled(level)) commit(level, beginEntry(level, prefix.data(), prefix.size()) += message);
+
+}
+
+void GreasyLog::recordf(LogLevels level, const char* prefix, const char* format, ...) {
+
+  va_list args, retry;
+  size_t start;
+  int n;
+
+  if (!isEnabled(level)) return;
+  string& entry = beginEntry(level, prefix, strlen(prefix));
+
+  // Try first with the room left in the buffer, which is usually enough
+  start = entry.size();
+  entry.resize(max(entry.capacity(), start + 128));
+  va_start(args, format);
+  va_copy(retry, args);
+  n = vsnprintf(&entry[start], entry.size() - start, format, args);
+  if ((n >= 0) && (start + n >= entry.size())) {
+    entry.resize(start + n + 1);
+    vsnprintf(&entry[start], n + 1, format, retry);
   }
+  va_end(retry);
+  va_end(args);
+  entry.resize(start + max(n, 0));
+
+  commit(level, entry);
+
+}
+
+string& GreasyLog::beginEntry(LogLevels level, const char* prefix, size_t length) {
+
+  // Each thread reuses its buffer, and the time is only formatted once per second
+  static thread_local string entry;
+  static thread_local time_t lastTime = 0;
+  static thread_local char timeStamp[64];
+  time_t t = time(NULL);
+  struct tm now;
+
+  if (t != lastTime) {
+    localtime_r(&t, &now);
+    strftime(timeStamp, sizeof(timeStamp), "%Y-%m-%d %X", &now);
+    lastTime = t;
+  }
+
+  entry.clear();
+  entry += '[';
+  entry += timeStamp;
+  entry += "] ";
+  entry += logLevelsDesc[level];
+  if (length > 0) {
+    entry += '[';
+    entry.append(prefix, length);
+    entry += "] ";
+  }
+  return entry;
+
+}
+
+void GreasyLog::commit(LogLevels level, string& entry) {
+
+  size_t used;
+
+  entry += '\n';
+
+  // Forked children have no writer of their own
+  if (!writer.isRunning()) {
+    output(entry);
+    return;
+  }
+
+  // If the buffer is full, write it from this thread
+  while (!push(entry)) flush();
+
+  if (level <= GreasyLog::error) {
+    flush();
+  } else {
+    used = enqueuePos.load(memory_order_relaxed) - dequeuePos.load(memory_order_relaxed);
+    if ((used > mask/2) && !wakeRequested.exchange(true)) {
+      writer.wake();
+    }
+  }
+
+}
+
+bool GreasyLog::push(string& entry) {
+
+  logSlot* slot;
+  size_t pos = enqueuePos.load(memory_order_relaxed);
+  long diff;
+
+  for (;;) {
+    slot = &ring[pos & mask];
+    diff = (long) slot->sequence.load(memory_order_acquire) - (long) pos;
+    if (diff == 0) {
+      if (enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = enqueuePos.load(memory_order_relaxed);
+    }
+  }
+
+  slot->entry.swap(entry);
+  slot->sequence.store(pos + 1, memory_order_release);
+  return true;
+
+}
+
+void GreasyLog::drain() {
+
+  logSlot* slot;
+  size_t pos = dequeuePos.load(memory_order_relaxed);
+
+  for (;;) {
+    slot = &ring[pos & mask];
+    // Stop at the first entry not published yet, even if later ones are
+    if (slot->sequence.load(memory_order_acquire) != pos + 1) break;
+    batch += slot->entry;
+    slot->entry.clear();
+    slot->sequence.store(pos + mask + 1, memory_order_release);
+    dequeuePos.store(++pos, memory_order_relaxed);
+    if (batch.size() >= 65536) {
+      output(batch);
+      batch.clear();
+    }
+  }
+  if (!batch.empty()) output(batch);
+  batch.clear();
+
+}
+
+void GreasyLog::output(const string& data) {
+
+  const char* buf = data.data();
+  size_t left = data.size();
+  ssize_t n;
+
+  while (left > 0) {
+    n = ::write(fd, buf, left);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    buf += n;
+    left -= n;
+  }
+
+}
+
+void GreasyLog::writeQueued() {
+
+  wakeRequested = false;
+  lock_guard<mutex> guard(writeLock);
+  drain();
 
 }
@@ -23,11 +23,35 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <atomic>
+#include <mutex>
+#include <unistd.h>
 
 #include "greasyutils.h"
 #include "config.h"
 
 #define NUM_LEVELS 6
+#define LOG_FLUSH_INTERVAL 100
+
+// Entries above this level are removed at compile time. It is set with
+// the --with-max-log-level option of configure.
+#ifndef GREASY_LOG_MAX_LEVEL
+#define GREASY_LOG_MAX_LEVEL 5
+#endif
+
+/**
+ * Record an entry with GreasyLog::record only if its level is enabled. The
+ * message is not even evaluated otherwise, so disabled entries cost a
+ * comparison, and nothing at all above GREASY_LOG_MAX_LEVEL.
+ */
+#define LOG_RECORD(log, level, ...) \
+  do { if ((log)->isEnabled(level)) (log)->record(level, __VA_ARGS__); } while (0)
+
+/**
+ * Record an entry with GreasyLog::recordf only if its level is enabled.
+ */
+#define LOG_RECORDF(log, level, ...) \
+  do { if ((log)->isEnabled(level)) (log)->recordf(level, __VA_ARGS__); } while (0)
 
 using namespace std;
 
@@ -38,6 +62,12 @@ using namespace std;
  * recorded if the entry's level is less or equal than the log level 
  * configured at the beginning.
  * 
+ * Once the writer is started, entries are formatted by the thread recording
+ * them and pushed into a lock-free ring buffer. A background thread writes
+ * them in batches every LOG_FLUSH_INTERVAL milliseconds, or earlier if the
+ * buffer gets half full. Errors are written before record returns, along with
+ * every entry queued before them.
+ * 
 */
 class GreasyLog{
 
@@ -74,9 +104,23 @@ public:
   bool logToFile(string fileName);
   
   /**
-    * Close the log.
+    * Close the log, writing all the entries still in the buffer.
     */
   void logClose();
+
+  /**
+    * Start the background writer with a buffer of the given number of entries,
+    * rounded up to a power of 2. Until then, and in forked children, entries
+    * are written right away.
+    * @param size The number of entries in the buffer. 0 keeps writing right away.
+    * @return True if the writer was started, false otherwise.
+    */
+  bool startWriter(int size);
+
+  /**
+    * Write all the entries in the buffer to the log.
+    */
+  void flush();
   
   /**
     * Get the default level for the log
@@ -96,34 +140,117 @@ public:
     */
   void setLogLevel(LogLevels level);
 
+  /**
+    * Check whether entries of a level will be recorded. It is inlined so that
+    * LOG_RECORD can skip the call altogether.
+    * @param level The log level to check.
+    * @return True if the level is enabled, false otherwise.
+    */
+  bool isEnabled(LogLevels level) const { return (level <= GREASY_LOG_MAX_LEVEL) && (level <= logLevel); }
+
   /**
     * Record an entry to the log with a prefix.
     * @param level The log level of this message.
     * @param prefix The prefix to be set in the message.
     * @param message The message to record.
     */
-  void record(LogLevels level, string prefix, string message);
+  void record(LogLevels level, const string& prefix, const string& message);
   
   /**
     * Record an entry to the log.
     * @param level The log level of this message.
     * @param message The message to record.
     */
-  void record(LogLevels level, string message);
+  void record(LogLevels level, const string& message);
+
+  /**
+    * Record an entry to the log with a prefix, formatting the message as
+    * printf does. The entry is built in a buffer reused by each thread, so
+    * that it does not allocate memory.
+    * @param level The log level of this message.
+    * @param prefix The prefix to be set in the message. Empty for none.
+    * @param format The printf format of the message, followed by its arguments.
+    */
+  void recordf(LogLevels level, const char* prefix, const char* format, ...)
+    __attribute__((format(printf, 4, 5)));
  
 
 private:
   
+  /**
+    * An entry of the ring buffer. The sequence tells whether the slot is free
+    * for the producer of position sequence, or holds the entry of position
+    * sequence - 1 for the writer.
+    */
+  struct logSlot {
+    atomic<size_t> sequence; /**< Position of the slot in the ring. */
+    string entry; /**< The formatted entry. */
+  };
+
   /**
     * Default constructor, hidden from everyone. If anyone wants to use the 
     * class, they should use the getInstance function.
     */
   GreasyLog();
 
+  /**
+    * Destructor. Writes the entries left in the buffer.
+    */
+  ~GreasyLog();
+
+  /**
+    * Start a new entry in the buffer of the calling thread, with the time,
+    * the level and the prefix.
+    * @param level The log level of the entry.
+    * @param prefix The prefix of the entry, or NULL for none.
+    * @param length The length of the prefix.
+    * @return The buffer holding the entry.
+    */
+  string& beginEntry(LogLevels level, const char* prefix, size_t length);
+
+  /**
+    * Record an entry built with beginEntry.
+    * @param level The log level of the entry.
+    * @param entry The entry, without the final newline.
+    */
+  void commit(LogLevels level, string& entry);
+
+  /**
+    * Push an entry into the ring buffer.
+    * @param entry The formatted entry. Its contents are swapped with the ones of
+    * an entry already written, so that their memory is reused.
+    * @return True if the entry was queued, false if the buffer was full.
+    */
+  bool push(string& entry);
+
+  /**
+    * Write all the entries queued in the buffer. Callers must hold writeLock.
+    */
+  void drain();
+
+  /**
+    * Write a string to the log descriptor, retrying on partial writes.
+    * @param data The string to write.
+    */
+  void output(const string& data);
+
+  /**
+    * Body of the background writer, which writes the entries queued.
+    */
+  void writeQueued();
+
   static GreasyLog instance; /**< Unique instance of the log. */
-  ofstream *logFile; /**< Descriptor of the log file. */
+  int fd; /**< Descriptor of the log file. */
   int logLevel; /**< LogLevel configured. */
   bool isFile; /**< Boolean to know if the log is going to a file */
+  logSlot* ring; /**< Ring buffer of entries waiting to be written. */
+  size_t mask; /**< Size of the ring minus 1. */
+  atomic<size_t> enqueuePos; /**< Next position to be claimed by a producer. */
+  atomic<size_t> dequeuePos; /**< Next position to be written. */
+  atomic<bool> wakeRequested; /**< Whether a producer already woke up the writer. */
+  mutex writeLock; /**< Serializes the writes of the queued entries. */
+  string batch; /**< Entries being written, reused under writeLock. */
+  GreasyPeriodicThread writer; /**< Background writer thread. */
 
 };
 
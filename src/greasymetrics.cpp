@@ -0,0 +1,397 @@
+/* 
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ * 
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ * 
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#include "greasymetrics.h"
+#include "greasyutils.h"
+#include "greasytimer.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+// States of the tasks in the metrics
+enum { untracked, queuedTask, runningTask, completedTask, failedTask, cancelledTask };
+
+// Begin and end a change of the metrics, for the readers to notice it.
+static void beginChange(metricsSegment* segment) {
+
+  __atomic_store_n(&segment->sequence, segment->sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+}
+
+static void endChange(metricsSegment* segment) {
+
+  __atomic_store_n(&segment->sequence, segment->sequence + 1, __ATOMIC_RELEASE);
+
+}
+
+// Write a label value in the Prometheus text format.
+static string labelValue(const string& value) {
+
+  string out;
+
+  for (size_t i = 0; i < value.size(); i++) {
+    if (value[i] == '\n') out += "\\n";
+    else if ((value[i] == '"') || (value[i] == '\\')) out += string("\\") + value[i];
+    else out += value[i];
+  }
+  return "\"" + out + "\"";
+
+}
+
+GreasyMetrics::GreasyMetrics() {
+
+  segment = NULL;
+  enabled = false;
+  ownerPid = 0;
+
+}
+
+GreasyMetrics* GreasyMetrics::getInstance() {
+
+  static GreasyMetrics instance;
+  return &instance;
+
+}
+
+bool GreasyMetrics::open(const string& taskFile, const string& engine, int total, int completed, bool shared) {
+
+  void* memory = MAP_FAILED;
+  char hostname[64];
+  int fd;
+
+  if (segment) return true;
+
+  if (shared) {
+    segmentName = metricsSegmentName(getpid());
+    fd = shm_open(segmentName.c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0600);
+    // A segment with this pid can only be left by a killed master
+    if ((fd < 0) && (errno == EEXIST) && (shm_unlink(segmentName.c_str()) == 0))
+      fd = shm_open(segmentName.c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+      if (ftruncate(fd, sizeof(metricsSegment)) == 0)
+        memory = mmap(NULL, sizeof(metricsSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      ::close(fd);
+    }
+    if (memory == MAP_FAILED) {
+      if (fd >= 0) shm_unlink(segmentName.c_str());
+      segmentName.clear();
+      return false;
+    }
+  } else {
+    memory = mmap(NULL, sizeof(metricsSegment), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return false;
+  }
+
+  segment = (metricsSegment*) memory;
+  memset(segment, 0, sizeof(metricsSegment));
+  segment->version = METRICS_VERSION;
+  segment->pid = getpid();
+  segment->startTime = time(NULL);
+  segment->startClock = metricsNow();
+  segment->updated = segment->startClock;
+  strncpy(segment->taskFile, taskFile.c_str(), sizeof(segment->taskFile) - 1);
+  strncpy(segment->engine, engine.c_str(), sizeof(segment->engine) - 1);
+  segment->total = total;
+  segment->completed = completed;
+  // Readers check the magic last, once the rest is in place
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(segment->magic, "GRSM", 4);
+
+  if (gethostname(hostname, sizeof(hostname)) != 0) strcpy(hostname, "localhost");
+  hostname[sizeof(hostname) - 1] = '\0';
+  localNode = hostname;
+  ownerPid = getpid();
+  enabled = true;
+  return true;
+
+}
+
+int GreasyMetrics::nodeIndex(const string& name) {
+
+  map<string,int>::iterator it = nodes.find(name);
+  int index;
+
+  if (it != nodes.end()) return it->second;
+  if (segment->nodes >= METRICS_MAX_NODES) return -1;
+
+  index = segment->nodes;
+  strncpy(segment->node[index].name, name.c_str(), sizeof(segment->node[index].name) - 1);
+  segment->nodes++;
+  nodes[name] = index;
+  return index;
+
+}
+
+void GreasyMetrics::leave(int taskId) {
+
+  int node = taskNodes[taskId];
+
+  switch (states[taskId]) {
+    case queuedTask:
+      segment->waiting--;
+      break;
+    case runningTask:
+      segment->running--;
+      if (node >= 0) segment->node[node].running--;
+      runningSince.erase(taskId);
+      break;
+    case completedTask:
+      segment->completed--;
+      break;
+    case failedTask:
+      segment->failed--;
+      break;
+    case cancelledTask:
+      segment->cancelled--;
+      break;
+  }
+  states[taskId] = untracked;
+
+}
+
+void GreasyMetrics::record(GreasyEvents::EventTypes type, GreasyTask* task) {
+
+  int taskId = task->getTaskId();
+  int node;
+  long long now;
+
+  if (!enabled || (getpid() != ownerPid) || (type == GreasyEvents::started)) return;
+
+  lock_guard<mutex> guard(lock);
+  if (!segment) return;
+  if (taskId >= (int) states.size()) {
+    states.resize(2*taskId + 1, untracked);
+    taskNodes.resize(2*taskId + 1, -1);
+  }
+  now = metricsNow();
+
+  beginChange(segment);
+  switch (type) {
+    case GreasyEvents::queued:
+      leave(taskId);
+      states[taskId] = queuedTask;
+      segment->waiting++;
+      break;
+    case GreasyEvents::dispatched:
+      leave(taskId);
+      states[taskId] = runningTask;
+      segment->running++;
+      segment->dispatches++;
+      node = nodeIndex(task->getHostname().empty() ? localNode : task->getHostname());
+      if (node >= 0) segment->node[node].running++;
+      taskNodes[taskId] = node;
+      runningSince[taskId] = now;
+      segment->dispatchRate = decayedRate(segment->dispatchRate, segment->dispatchTime, now) + 1.0/METRICS_RATE_WINDOW;
+      segment->dispatchTime = now;
+      break;
+    case GreasyEvents::finished:
+      // Tasks the workers took by themselves were never dispatched
+      node = taskNodes[taskId];
+      if (states[taskId] != runningTask) node = nodeIndex(task->getHostname().empty() ? localNode : task->getHostname());
+      leave(taskId);
+      if (task->getReturnCode() == 0) {
+        states[taskId] = completedTask;
+        segment->completed++;
+        if (node >= 0) segment->node[node].completed++;
+      } else {
+        states[taskId] = failedTask;
+        segment->failed++;
+        if (node >= 0) segment->node[node].failed++;
+      }
+      taskNodes[taskId] = -1;
+      segment->endRate = decayedRate(segment->endRate, segment->endTime, now) + 1.0/METRICS_RATE_WINDOW;
+      segment->endTime = now;
+      break;
+    case GreasyEvents::retried:
+      leave(taskId);
+      taskNodes[taskId] = -1;
+      segment->retries++;
+      break;
+    case GreasyEvents::cancelled:
+      leave(taskId);
+      states[taskId] = cancelledTask;
+      segment->cancelled++;
+      segment->endRate = decayedRate(segment->endRate, segment->endTime, now) + 1.0/METRICS_RATE_WINDOW;
+      segment->endTime = now;
+      break;
+    default:
+      break;
+  }
+  segment->updated = now;
+  endChange(segment);
+
+}
+
+bool GreasyMetrics::exportMetrics() {
+
+  metricsSegment* copy;
+  FILE* out;
+  string tmpFile = exportFile + ".tmp";
+  string run;
+  long long now = metricsNow();
+  double endRate;
+  unsigned int left;
+  bool written;
+
+  if (!segment || exportFile.empty()) return false;
+
+  // The segment is too big for the stack of the thread
+  copy = new metricsSegment;
+  if (!readMetrics(segment, *copy)) {
+    delete copy;
+    return false;
+  }
+
+  out = fopen(tmpFile.c_str(), "w");
+  if (!out) {
+    delete copy;
+    return false;
+  }
+
+  run = "task_file=" + labelValue(copy->taskFile);
+  endRate = currentRate(*copy, copy->endRate, copy->endTime, now);
+  left = copy->total - min(copy->total, copy->completed + copy->failed + copy->cancelled);
+
+  fprintf(out, "# HELP greasy_info Run of greasy.\n# TYPE greasy_info gauge\n");
+  fprintf(out, "greasy_info{%s,engine=%s,pid=\"%d\"} 1\n", run.c_str(), labelValue(copy->engine).c_str(), copy->pid);
+  fprintf(out, "# HELP greasy_finished Whether the run ended.\n# TYPE greasy_finished gauge\n");
+  fprintf(out, "greasy_finished{%s} %d\n", run.c_str(), copy->finished);
+  fprintf(out, "# HELP greasy_start_time_seconds Start of the run, in seconds since the epoch.\n# TYPE greasy_start_time_seconds gauge\n");
+  fprintf(out, "greasy_start_time_seconds{%s} %lld\n", run.c_str(), copy->startTime);
+  fprintf(out, "# HELP greasy_tasks Tasks of the run in each state.\n# TYPE greasy_tasks gauge\n");
+  fprintf(out, "greasy_tasks{%s,state=\"pending\"} %u\n", run.c_str(),
+          copy->total - min(copy->total, copy->waiting + copy->running + copy->completed + copy->failed + copy->cancelled));
+  fprintf(out, "greasy_tasks{%s,state=\"waiting\"} %u\n", run.c_str(), copy->waiting);
+  fprintf(out, "greasy_tasks{%s,state=\"running\"} %u\n", run.c_str(), copy->running);
+  fprintf(out, "greasy_tasks{%s,state=\"completed\"} %u\n", run.c_str(), copy->completed);
+  fprintf(out, "greasy_tasks{%s,state=\"failed\"} %u\n", run.c_str(), copy->failed);
+  fprintf(out, "greasy_tasks{%s,state=\"cancelled\"} %u\n", run.c_str(), copy->cancelled);
+  fprintf(out, "# HELP greasy_node_running_tasks Tasks running on each node.\n# TYPE greasy_node_running_tasks gauge\n");
+  for (int i = 0; i < copy->nodes; i++)
+    fprintf(out, "greasy_node_running_tasks{%s,node=%s} %u\n", run.c_str(), labelValue(copy->node[i].name).c_str(), copy->node[i].running);
+  fprintf(out, "# HELP greasy_dispatches_total Tasks dispatched, including retries.\n# TYPE greasy_dispatches_total counter\n");
+  fprintf(out, "greasy_dispatches_total{%s} %llu\n", run.c_str(), copy->dispatches);
+  fprintf(out, "# HELP greasy_retries_total Retries of failed or lost tasks.\n# TYPE greasy_retries_total counter\n");
+  fprintf(out, "greasy_retries_total{%s} %llu\n", run.c_str(), copy->retries);
+  fprintf(out, "# HELP greasy_dispatch_rate Tasks dispatched per second over the last minute.\n# TYPE greasy_dispatch_rate gauge\n");
+  fprintf(out, "greasy_dispatch_rate{%s} %g\n", run.c_str(), currentRate(*copy, copy->dispatchRate, copy->dispatchTime, now));
+  fprintf(out, "# HELP greasy_end_rate Tasks ended per second over the last minute.\n# TYPE greasy_end_rate gauge\n");
+  fprintf(out, "greasy_end_rate{%s} %g\n", run.c_str(), endRate);
+  if ((left == 0) || (endRate > 0)) {
+    fprintf(out, "# HELP greasy_eta_seconds Estimated seconds until all the tasks end, at the current rate.\n# TYPE greasy_eta_seconds gauge\n");
+    fprintf(out, "greasy_eta_seconds{%s} %.0f\n", run.c_str(), (left == 0) ? 0.0 : left/endRate);
+  }
+  delete copy;
+
+  written = !ferror(out);
+  written = (fclose(out) == 0) && written;
+  if (!written || (rename(tmpFile.c_str(), exportFile.c_str()) != 0)) {
+    unlink(tmpFile.c_str());
+    return false;
+  }
+  return true;
+
+}
+
+vector<string> GreasyMetrics::status() {
+
+  vector<string> lines;
+  vector<pair<long long,int> > running;
+  vector<int> runningNodes;
+  map<int,long long>::iterator it;
+  metricsSegment* copy;
+  long long now = metricsNow();
+  double dispatchRate, endRate;
+  unsigned int left, pending;
+  char line[512];
+
+  lock_guard<mutex> guard(lock);
+  if (!segment || (getpid() != ownerPid)) return lines;
+
+  // Changes only happen under the lock, so the copy is always consistent
+  copy = new metricsSegment;
+  memcpy(copy, segment, sizeof(metricsSegment));
+  for (it = runningSince.begin(); it != runningSince.end(); it++) running.push_back(make_pair(it->second, it->first));
+  sort(running.begin(), running.end());
+  for (unsigned int i = 0; (i < running.size()) && (i < STATUS_MAX_RUNNING); i++) runningNodes.push_back(taskNodes[running[i].second]);
+
+  dispatchRate = currentRate(*copy, copy->dispatchRate, copy->dispatchTime, now);
+  endRate = currentRate(*copy, copy->endRate, copy->endTime, now);
+  left = copy->total - min(copy->total, copy->completed + copy->failed + copy->cancelled);
+  pending = copy->total - min(copy->total, copy->waiting + copy->running + copy->completed + copy->failed + copy->cancelled);
+
+  lines.push_back("Status of " + string(copy->taskFile) + " after " + GreasyTimer::usecsToTime(now - copy->startClock));
+  snprintf(line, sizeof(line), "Tasks: %u total, %u pending, %u waiting, %u running, %u completed, %u failed, %u cancelled. "
+           "%llu retries of %llu dispatches", copy->total, pending, copy->waiting, copy->running, copy->completed,
+           copy->failed, copy->cancelled, copy->retries, copy->dispatches);
+  lines.push_back(line);
+  snprintf(line, sizeof(line), "Rates: %.2f dispatched/s, %.2f ended/s over the last minute. ETA: %s", dispatchRate, endRate,
+           (left == 0) ? "done" : (endRate > 0) ? GreasyTimer::secsToTime((unsigned long) (left/endRate)).c_str() : "unknown");
+  lines.push_back(line);
+  for (int i = 0; i < copy->nodes; i++) {
+    snprintf(line, sizeof(line), "Node %s: %u running, %u completed, %u failed", copy->node[i].name,
+             copy->node[i].running, copy->node[i].completed, copy->node[i].failed);
+    lines.push_back(line);
+  }
+  for (unsigned int i = 0; i < runningNodes.size(); i++) {
+    snprintf(line, sizeof(line), "Task %d running on %s for %s", running[i].second,
+             (runningNodes[i] >= 0) ? copy->node[runningNodes[i]].name : "an unknown node",
+             GreasyTimer::usecsToTime(now - running[i].first).c_str());
+    lines.push_back(line);
+  }
+  if (running.size() > runningNodes.size()) {
+    lines.push_back("And " + toString(running.size() - runningNodes.size()) + " more tasks running");
+  }
+
+  delete copy;
+  return lines;
+
+}
+
+void GreasyMetrics::startExports(const string& fileName, int interval) {
+
+  if (!segment || writer.isRunning() || (interval <= 0)) return;
+
+  exportFile = fileName;
+  exportMetrics();
+  writer.start(bind(&GreasyMetrics::exportMetrics, this), interval*1000);
+
+}
+
+void GreasyMetrics::close() {
+
+  if (!segment || (getpid() != ownerPid)) return;
+
+  writer.stop();
+
+  lock_guard<mutex> guard(lock);
+  enabled = false;
+  beginChange(segment);
+  segment->finished = 1;
+  segment->updated = metricsNow();
+  endChange(segment);
+  exportMetrics();
+  if (!segmentName.empty()) shm_unlink(segmentName.c_str());
+  munmap(segment, sizeof(metricsSegment));
+  segment = NULL;
+
+}
@@ -0,0 +1,144 @@
+/* 
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ * 
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ * 
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#ifndef GREASYMETRICS_H
+#define GREASYMETRICS_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <unistd.h>
+
+#include "greasytask.h"
+#include "greasyutils.h"
+#include "greasyevents.h"
+#include "greasystat.h"
+
+// Running tasks listed at most in a status of the run
+#define STATUS_MAX_RUNNING 100
+
+using namespace std;
+
+/**
+ * This class keeps the live metrics of the run: the tasks in each state,
+ * the tasks running on each node, the rates of dispatches and ends, and
+ * the retries. They are kept in a shared memory segment, where greasy-stat
+ * reads them while the run goes on, and they can be exported periodically
+ * as a Prometheus textfile, for the node exporter.
+ * They are updated from the events of the tasks under a lock of their own,
+ * which readers of the segment never take: they take a consistent copy by
+ * themselves, so the master never waits for them. Only the status of the
+ * run, written on request, takes the lock to list the tasks running.
+ */
+class GreasyMetrics {
+
+public:
+
+  /**
+    * Get the unique GreasyMetrics instance. Implementation of the Singleton Pattern.
+    * @return A pointer to the GreasyMetrics instance.
+    */
+  static GreasyMetrics* getInstance();
+
+  /**
+    * Start keeping the metrics of the run.
+    * @param taskFile The task file of the run.
+    * @param engine The engine of the run.
+    * @param total Number of valid tasks in the task file.
+    * @param completed Number of tasks completed by a previous run.
+    * @param shared If true, the metrics are kept in a shared memory segment
+    * for greasy-stat. Otherwise, they are only kept for the exports.
+    * @return True if all is ok, false otherwise.
+    */
+  bool open(const string& taskFile, const string& engine, int total, int completed, bool shared);
+
+  /**
+    * Update the metrics with an event of a task.
+    * @param type The type of the event.
+    * @param task The task.
+    */
+  void record(GreasyEvents::EventTypes type, GreasyTask* task);
+
+  /**
+    * Start a thread that exports the metrics periodically.
+    * @param fileName Path to the Prometheus textfile.
+    * @param interval Seconds between exports.
+    */
+  void startExports(const string& fileName, int interval);
+
+  /**
+    * Write the Prometheus textfile with the current metrics. It is written
+    * aside and then renamed, so readers never see it half written.
+    * @return True if it was written.
+    */
+  bool exportMetrics();
+
+  /**
+    * Get the status of the run: the tasks in each state, the rates and the
+    * estimated time left, the load of each node and the tasks running, the
+    * longest first. It is safe to call it from other threads.
+    * @return The lines of the status, or none if the metrics are not kept.
+    */
+  vector<string> status();
+
+  /**
+    * Export the metrics for the last time and remove the segment.
+    */
+  void close();
+
+private:
+
+  /**
+    * Default constructor, hidden from everyone. If anyone wants to use the
+    * class, they should use the getInstance function.
+    */
+  GreasyMetrics();
+
+  /**
+    * Get the metrics of a node, adding it if it is new.
+    * @param name The name of the node.
+    * @return The index of the node, or -1 if there is no room.
+    */
+  int nodeIndex(const string& name);
+
+  /**
+    * Take a task out of the counter of its current state.
+    * @param taskId The id of the task.
+    */
+  void leave(int taskId);
+
+  metricsSegment* segment; /**< The metrics, or NULL if they are not kept. */
+  string segmentName; /**< Name of the shared memory segment, or empty if not shared. */
+  pid_t ownerPid; /**< Process that keeps the metrics. Forked children leave them alone. */
+  string localNode; /**< Node of the tasks the engine does not place. */
+  vector<char> states; /**< State of each task, by task id, in the metrics. */
+  vector<short> taskNodes; /**< Node where each task runs, by task id, or -1. */
+  map<string,int> nodes; /**< Index of each node in the segment. */
+  map<int,long long> runningSince; /**< Dispatch time of each running task, in monotonic microseconds. */
+  atomic<bool> enabled; /**< Whether the metrics are kept, checked without the lock. */
+  mutex lock; /**< Serializes the changes, and the listing of the running tasks. */
+
+  string exportFile; /**< Path to the Prometheus textfile. */
+  GreasyPeriodicThread writer; /**< Thread of the exports. */
+
+};
+
+#endif
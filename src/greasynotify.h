@@ -0,0 +1,50 @@
+/* 
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ * 
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ * 
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#ifndef GREASYNOTIFY_H
+#define GREASYNOTIFY_H
+
+#include "greasytask.h"
+#include "greasyevents.h"
+#include "greasytrace.h"
+#include "greasystats.h"
+#include "greasymetrics.h"
+
+/**
+  * Inline function to tell everyone who follows the tasks about an event of
+  * one of them: the stream of events, the trace, the overhead of the
+  * scheduler and the live metrics. Each of them returns at once if it is not
+  * enabled, and takes a lock of its own otherwise, so engines running tasks
+  * from several threads only wait for each other on what is enabled.
+  * @param type The type of the event.
+  * @param task The task.
+  * @param cause For cancelled tasks, the task whose failure cancelled it.
+  */
+inline void notifyTaskEvent(GreasyEvents::EventTypes type, GreasyTask* task, int cause = -1) {
+
+  GreasyEvents::getInstance()->record(type, task, cause);
+  if (type == GreasyEvents::dispatched) GreasyTrace::getInstance()->dispatched(task);
+  else if ((type == GreasyEvents::finished) || (type == GreasyEvents::retried))
+    GreasyTrace::getInstance()->ended(task, type == GreasyEvents::retried);
+  GreasyStats::getInstance()->record(type, task);
+  GreasyMetrics::getInstance()->record(type, task);
+
+}
+
+#endif
@@ -0,0 +1,464 @@
+/*
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ *
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+/**
+ * greasy-report analyses a finished run from its event stream: how busy
+ * the workers were along the run, how long the tasks took, how much each
+ * node did, which chain of tasks decided when the run ended, and how long
+ * it would have taken with other numbers of workers.
+ * The stream is read once, and only the tasks waiting or running at any
+ * time are kept in memory, so it copes with streams of any length.
+ */
+
+#include "greasyhistogram.h"
+#include "greasytimer.h"
+#include "greasyutils.h"
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+using namespace std;
+
+#define REPORT_TIMELINE_ROWS 24
+#define REPORT_PATH_LENGTH 10
+#define REPORT_BAR_WIDTH 50
+
+/**
+ * What a task of the critical path waited for before it started.
+ */
+enum pathCauses { runStart, dependency, freeWorker, retry };
+
+static const char* pathCausesDesc[] = { "start of the run", "dependency", "free worker", "retry" };
+
+/**
+ * A run of a task in the critical path.
+ */
+typedef struct {
+  int task; /**< Task that ran. */
+  string node; /**< Node where it ran. */
+  long long start; /**< Microseconds since the epoch when it started. */
+  long long end; /**< Microseconds since the epoch when it ended. */
+  int cause; /**< What it waited for, from pathCauses. */
+  int after; /**< Task it waited for, or -1. */
+} pathLink;
+
+/**
+ * The chain of runs that ends with the end of a task. Only its last links
+ * are kept.
+ */
+typedef struct {
+  vector<pathLink> tail; /**< Last links of the chain, the task itself the last one. */
+  unsigned long length; /**< Number of links in the whole chain. */
+  long long depth; /**< Microseconds of the longest chain of dependencies up to the task. */
+} pathChain;
+
+/**
+ * A task dispatched and not finished yet.
+ */
+typedef struct {
+  shared_ptr<const pathChain> after; /**< Chain the task waited for, if any. */
+  int cause; /**< What it waited for, from pathCauses. */
+  long long parentDepth; /**< Depth of the dependency that released it. */
+} runningTask;
+
+/**
+ * A task released by a dependency and not dispatched yet.
+ */
+typedef struct {
+  long long queued; /**< Microseconds since the epoch when it was queued. */
+  shared_ptr<const pathChain> parent; /**< Chain of the dependency that released it. */
+} pendingTask;
+
+/**
+ * Activity of a node.
+ */
+typedef struct {
+  unsigned long runs; /**< Runs finished. */
+  unsigned long failed; /**< Runs that failed. */
+  long long busy; /**< Microseconds running tasks. */
+  long long cpu; /**< Microseconds of cpu used by the tasks, when known. */
+  long long measured; /**< Microseconds running the tasks whose cpu is known. */
+} nodeActivity;
+
+/**
+ * Busy time along the run, in rows of the same length. The rows get
+ * twice as long whenever the run does not fit in them anymore.
+ */
+typedef struct {
+  long long origin; /**< Microseconds since the epoch when the first row starts. */
+  long long width; /**< Microseconds of each row. */
+  long long busy[REPORT_TIMELINE_ROWS]; /**< Microseconds spent running tasks in each row. */
+} timeline;
+
+static void usage() {
+
+  cerr << "Usage: greasy-report [-n workers[,workers...]] [-p length] eventfile" << endl;
+  cerr << "       Use - as eventfile to read the events from the standard input." << endl;
+  exit(1);
+
+}
+
+// Find the value of a field in an event line. Returns NULL if it is not there.
+static const char* findField(const char* line, const char* key) {
+
+  char pattern[32];
+  const char* value;
+
+  snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+  value = strstr(line, pattern);
+  return value ? value + strlen(pattern) : NULL;
+
+}
+
+// Get a number field of an event line. Returns false if it is not there.
+static bool numberField(const char* line, const char* key, long long& number) {
+
+  const char* value = findField(line, key);
+
+  if (!value) return false;
+  number = strtoll(value, NULL, 10);
+  return true;
+
+}
+
+// Get a string field of an event line, unescaped. Returns false if it is not there.
+static bool stringField(const char* line, const char* key, string& text) {
+
+  const char* value = findField(line, key);
+
+  if (!value || (*value != '"')) return false;
+  text.clear();
+  for (value++; *value && (*value != '"'); value++) {
+    if ((*value == '\\') && value[1]) {
+      value++;
+      if ((*value == 'u') && (strlen(value) >= 5)) {
+        text += (char) strtol(string(value+1, 4).c_str(), NULL, 16);
+        value += 4;
+        continue;
+      }
+    }
+    text += *value;
+  }
+  return true;
+
+}
+
+// Add the time between start and end to the rows it falls in.
+static void addBusy(timeline& line, long long start, long long end) {
+
+  long long rowStart;
+
+  start = max(start, line.origin);
+  if (end <= start) return;
+
+  // Make the rows longer until the run fits in them
+  while (end > line.origin + line.width*REPORT_TIMELINE_ROWS) {
+    for (int i = 0; i < REPORT_TIMELINE_ROWS/2; i++) line.busy[i] = line.busy[2*i] + line.busy[2*i+1];
+    for (int i = REPORT_TIMELINE_ROWS/2; i < REPORT_TIMELINE_ROWS; i++) line.busy[i] = 0;
+    line.width *= 2;
+  }
+
+  for (int i = (start - line.origin)/line.width; i < REPORT_TIMELINE_ROWS; i++) {
+    rowStart = line.origin + i*line.width;
+    if (rowStart >= end) break;
+    line.busy[i] += min(end, rowStart + line.width) - max(start, rowStart);
+  }
+
+}
+
+// Parse a comma separated list of worker counts. Returns false if it is wrong.
+static bool parseWorkers(const string& list, vector<long>& workers) {
+
+  vector<string> items = split(list, ',');
+  long number;
+  char* end;
+
+  for (unsigned int i = 0; i < items.size(); i++) {
+    number = strtol(items[i].c_str(), &end, 10);
+    if ((number < 1) || (*end != '\0')) return false;
+    workers.push_back(number);
+  }
+  return !workers.empty();
+
+}
+
+int main(int argc, char *argv[]) {
+
+  FILE* in;
+  char* line = NULL;
+  size_t capacity = 0;
+  int option;
+  string file, event, node;
+  vector<long> workers;
+  unsigned long pathLength = REPORT_PATH_LENGTH;
+
+  unordered_map<int, runningTask> running;
+  unordered_map<int, pendingTask> pending;
+  unordered_map<int, runningTask>::iterator runningIt;
+  unordered_map<int, pendingTask>::iterator pendingIt;
+  map<string, nodeActivity> nodes;
+  map<string, nodeActivity>::iterator nodeIt;
+  shared_ptr<const pathChain> lastEnd;
+  shared_ptr<pathChain> chain;
+  GreasyHistogram durations;
+  timeline busyTime;
+  pathLink link;
+
+  long long t, task, rc, utime, stime;
+  long long first = -1, last = -1, elapsed, work = 0, depth = 0, longest = 0;
+  unsigned long lines = 0, skipped = 0, queued = 0, dispatched = 0, failed = 0, retried = 0, cancelled = 0;
+  unsigned long peak = 0, peakPending = 0;
+  int retriedTask = -1;
+  double elapsedSecs;
+
+  while ((option = getopt(argc, argv, "n:p:")) != -1) {
+    switch (option) {
+      case 'n':
+        if (!parseWorkers(optarg, workers)) usage();
+        break;
+      case 'p':
+        pathLength = strtoul(optarg, NULL, 10);
+        if (pathLength < 1) usage();
+        break;
+      default: usage();
+    }
+  }
+  if (optind != argc-1) usage();
+  file = argv[optind];
+
+  in = (file == "-") ? stdin : fopen(file.c_str(), "r");
+  if (!in) {
+    cerr << "greasy-report: could not open " << file << ": " << strerror(errno) << endl;
+    return 1;
+  }
+
+  busyTime.width = 1000000;
+  for (int i = 0; i < REPORT_TIMELINE_ROWS; i++) busyTime.busy[i] = 0;
+
+  while (getline(&line, &capacity, in) > 0) {
+    lines++;
+    if (!numberField(line, "t", t) || !numberField(line, "task", task) || !stringField(line, "event", event)) {
+      skipped++;
+      continue;
+    }
+    if (first < 0) {
+      first = t;
+      busyTime.origin = t;
+    }
+    last = max(last, t);
+
+    if (event == "queued") {
+      queued++;
+      // Only the tasks released by the end of another one matter to the
+      // critical path. Those queued at the start, or queued again after
+      // losing their worker, are not kept.
+      if (lastEnd && (task != retriedTask)) {
+        pending[task].queued = t;
+        pending[task].parent = lastEnd;
+        peakPending = max(peakPending, (unsigned long) pending.size());
+      }
+      retriedTask = -1;
+
+    } else if (event == "dispatched") {
+      dispatched++;
+      runningTask& run = running[task];
+      run.after.reset();
+      run.cause = runStart;
+      run.parentDepth = 0;
+      pendingIt = pending.find(task);
+      if (pendingIt != pending.end()) run.parentDepth = pendingIt->second.parent->depth;
+      // The task waited for its dependency if it was released after the last
+      // end, and for a worker to get free otherwise
+      if ((pendingIt != pending.end()) && (!lastEnd || (pendingIt->second.queued >= lastEnd->tail.back().end))) {
+        run.after = pendingIt->second.parent;
+        run.cause = dependency;
+      } else if (lastEnd) {
+        run.after = lastEnd;
+        run.cause = (lastEnd->tail.back().task == task) ? retry : freeWorker;
+      }
+      if (pendingIt != pending.end()) pending.erase(pendingIt);
+      peak = max(peak, (unsigned long) running.size());
+
+    } else if (event == "finished") {
+      elapsedSecs = 0;
+      const char* field = findField(line, "elapsed");
+      if (field) elapsedSecs = strtod(field, NULL);
+      elapsed = (long long) (elapsedSecs*1e6 + 0.5);
+      if (!numberField(line, "rc", rc)) rc = 0;
+      if (!stringField(line, "node", node)) node = "(unknown)";
+
+      work += elapsed;
+      longest = max(longest, elapsed);
+      durations.add(elapsed);
+      addBusy(busyTime, t - elapsed, t);
+      if (rc != 0) failed++;
+
+      nodeActivity& activity = nodes[node];
+      activity.runs++;
+      if (rc != 0) activity.failed++;
+      activity.busy += elapsed;
+      if (numberField(line, "utime", utime) && numberField(line, "stime", stime)) {
+        activity.cpu += utime + stime;
+        activity.measured += elapsed;
+      }
+
+      // Link the task to the chain it waited for
+      link.task = task;
+      link.node = node;
+      link.start = t - elapsed;
+      link.end = t;
+      link.cause = runStart;
+      link.after = -1;
+      chain = make_shared<pathChain>();
+      chain->length = 1;
+      chain->depth = elapsed;
+      runningIt = running.find(task);
+      if (runningIt != running.end()) {
+        const runningTask& run = runningIt->second;
+        link.cause = run.cause;
+        chain->depth += run.parentDepth;
+        if (run.after) {
+          link.after = run.after->tail.back().task;
+          chain->length += run.after->length;
+          chain->tail.assign(run.after->tail.begin() + ((run.after->tail.size() >= pathLength) ? 1 : 0), run.after->tail.end());
+        }
+        running.erase(runningIt);
+      }
+      chain->tail.push_back(link);
+      depth = max(depth, chain->depth);
+      lastEnd = chain;
+
+    } else if (event == "retried") {
+      retried++;
+      // Lost with its worker: it will not finish from the last dispatch
+      running.erase(task);
+      retriedTask = task;
+
+    } else if (event == "cancelled") {
+      cancelled++;
+    }
+  }
+  free(line);
+  if (in != stdin) fclose(in);
+
+  if (!lastEnd) {
+    cerr << "greasy-report: no finished tasks in " << file << endl;
+    return 1;
+  }
+
+  long long makespan = last - first;
+  long long slots = max(peak, 1UL);
+  char row[256];
+
+  cout << "Greasy report of " << file << endl;
+  cout << "  Events:    " << lines << " read";
+  if (skipped > 0) cout << ", " << skipped << " not understood";
+  cout << endl;
+  cout << "  Tasks:     " << queued << " queued, " << dispatched << " dispatched, " << durations.getCount() << " finished ("
+       << failed << " failed), " << retried << " retried, " << cancelled << " cancelled" << endl;
+  printf("  Makespan:  %s with up to %lld tasks running at once, busy %.2f%% of the time\n",
+         GreasyTimer::usecsToTime(makespan).c_str(), slots, makespan > 0 ? 100.0*work/((double) makespan*slots) : 0.0);
+  cout << "  Work:      " << GreasyTimer::usecsToTime(work) << " running tasks, the longest "
+       << GreasyHistogram::formatTime(longest) << ", the longest chain of dependencies "
+       << GreasyHistogram::formatTime(depth) << endl;
+  cout << "  Memory:    up to " << peak << " tasks running and " << peakPending << " released tasks waiting were tracked" << endl;
+
+  cout << endl << "Utilisation along the run, " << GreasyHistogram::formatTime(busyTime.width)
+       << " per row, 100% being " << slots << " tasks running:" << endl;
+  for (int i = 0; (i < REPORT_TIMELINE_ROWS) && (i*busyTime.width < makespan); i++) {
+    long long width = min(busyTime.width, makespan - i*busyTime.width);
+    double used = (double) busyTime.busy[i]/((double) width*slots);
+    snprintf(row, sizeof(row), "  %s |%-*s| %6.2f%%", GreasyTimer::usecsToTime(i*busyTime.width).c_str(), REPORT_BAR_WIDTH,
+             string((size_t) (min(used, 1.0)*REPORT_BAR_WIDTH + 0.5), '#').c_str(), 100*used);
+    cout << row << endl;
+  }
+
+  cout << endl << "Task durations: " << durations.summary() << endl;
+  vector<string> buckets = durations.buckets();
+  for (unsigned int i = 0; i < buckets.size(); i++) cout << "  " << buckets[i] << endl;
+
+  cout << endl << "Nodes:" << endl;
+  printf("  %-32s %10s %8s %10s %12s %10s %9s\n", "Node", "Tasks", "Failed", "Tasks/s", "Busy", "Mean", "CPU eff");
+  for (nodeIt = nodes.begin(); nodeIt != nodes.end(); nodeIt++) {
+    nodeActivity& activity = nodeIt->second;
+    string efficiency = "-";
+    if (activity.measured > 0) {
+      snprintf(row, sizeof(row), "%.2f%%", 100.0*activity.cpu/activity.measured);
+      efficiency = row;
+    }
+    printf("  %-32.63s %10lu %8lu %10.3f %12s %10s %9s\n", nodeIt->first.c_str(), activity.runs, activity.failed,
+           makespan > 0 ? activity.runs*1e6/makespan : 0.0, GreasyTimer::usecsToTime(activity.busy).c_str(),
+           GreasyHistogram::formatTime(activity.busy/activity.runs).c_str(), efficiency.c_str());
+  }
+
+  cout << endl << "Critical path: the last " << lastEnd->tail.size() << " of " << lastEnd->length
+       << " tasks in the chain that ended the run" << endl;
+  printf("  %10s %-24s %14s %12s %12s  %s\n", "Task", "Node", "Start", "Run time", "Waited", "Waited for");
+  long long previous = first;
+  for (unsigned int i = 0; i < lastEnd->tail.size(); i++) {
+    const pathLink& step = lastEnd->tail[i];
+    string cause = pathCausesDesc[step.cause];
+    if (step.after >= 0) cause += " " + toString(step.after);
+    if ((i == 0) && (step.after >= 0)) previous = step.start;
+    printf("  %10d %-24.24s %14s %12s %12s  %s\n", step.task, step.node.c_str(),
+           GreasyTimer::usecsToTime(max(step.start - first, 0LL)).c_str(), GreasyHistogram::formatTime(step.end - step.start).c_str(),
+           (i == 0) && (step.after >= 0) ? "-" : GreasyHistogram::formatTime(max(step.start - previous, 0LL)).c_str(), cause.c_str());
+    previous = step.end;
+  }
+  if (last > lastEnd->tail.back().end) {
+    cout << "  The run ended " << GreasyHistogram::formatTime(last - lastEnd->tail.back().end) << " after its last task" << endl;
+  }
+
+  // Neither the work nor the longest chain can be spread over more workers,
+  // and a greedy scheduler never takes longer than the work spread plus the
+  // longest chain (Graham's bound). The estimate keeps the ratio between
+  // the actual makespan and the lower bound observed in this run, within
+  // both bounds.
+  long long chainBound = max(depth, longest);
+  double lowerNow = max((double) work/slots, (double) chainBound);
+  double overhead = (lowerNow > 0) ? max((double) makespan/lowerNow, 1.0) : 1.0;
+  if (workers.empty()) {
+    const long factors[] = { 1, 2, 4, 8 };
+    for (int i = 3; i > 0; i--) if (slots/factors[i] >= 1) workers.push_back(slots/factors[i]);
+    for (int i = 0; i < 4; i++) workers.push_back(slots*factors[i]);
+    sort(workers.begin(), workers.end());
+    workers.erase(unique(workers.begin(), workers.end()), workers.end());
+  }
+  cout << endl << "Makespan with other numbers of workers:" << endl;
+  printf("  %10s %14s %14s %14s\n", "Workers", "Lower bound", "Estimate", "Upper bound");
+  for (unsigned int i = 0; i < workers.size(); i++) {
+    double lower = max((double) work/workers[i], (double) chainBound);
+    double upper = max((double) work/workers[i] + (1.0 - 1.0/workers[i])*chainBound, lower);
+    double estimate = min(max(lower*overhead, lower), upper);
+    printf("  %10ld %14s %14s %14s%s\n", workers[i], GreasyTimer::usecsToTime((unsigned long) lower).c_str(),
+           GreasyTimer::usecsToTime((unsigned long) estimate).c_str(), GreasyTimer::usecsToTime((unsigned long) upper).c_str(),
+           (workers[i] == slots) ? "  (this run)" : "");
+  }
+
+  return 0;
+
+}
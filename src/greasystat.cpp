@@ -0,0 +1,188 @@
+/* 
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ * 
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ * 
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+/**
+ * greasy-stat shows the live metrics of the greasy runs of this node. It
+ * only reads the shared memory segment the master keeps them in, so it
+ * never disturbs the scheduler, and it may be run as often as wanted. The
+ * segments of masters that were killed are removed once shown.
+ */
+
+#include "greasystat.h"
+#include "greasyutils.h"
+
+#include <iostream>
+#include <vector>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+
+using namespace std;
+
+static void usage() {
+
+  cerr << "Usage: greasy-stat [-w seconds] [pid]" << endl;
+  exit(1);
+
+}
+
+// Format a number of seconds as HH:MM:SS.
+static string formatSeconds(long long secs) {
+
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%02lld:%02lld:%02lld", secs/3600, (secs/60)%60, secs%60);
+  return string(buf);
+
+}
+
+// Find the segments of the runs that can be read, by the pid of their master.
+static vector<int> findRuns() {
+
+  vector<int> pids;
+  DIR* dir = opendir("/dev/shm");
+  struct dirent* entry;
+  int pid;
+  char tail;
+
+  if (!dir) return pids;
+  while ((entry = readdir(dir)) != NULL) {
+    if (sscanf(entry->d_name, "greasy-%d%c", &pid, &tail) == 1) pids.push_back(pid);
+  }
+  closedir(dir);
+  return pids;
+
+}
+
+// Show the metrics of a run. Returns false if they could not be read.
+static bool showRun(int pid) {
+
+  string name = metricsSegmentName(pid);
+  metricsSegment* segment;
+  metricsSegment* copy;
+  long long now = metricsNow();
+  double endRate, dispatchRate;
+  unsigned int left, pending;
+  bool alive;
+  int fd;
+
+  fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    cerr << "greasy-stat: no metrics for pid " << pid << ": " << strerror(errno) << endl;
+    return false;
+  }
+  segment = (metricsSegment*) mmap(NULL, sizeof(metricsSegment), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED) {
+    cerr << "greasy-stat: could not map the metrics of pid " << pid << endl;
+    return false;
+  }
+
+  copy = new metricsSegment;
+  if ((memcmp(segment->magic, "GRSM", 4) != 0) || (segment->version != METRICS_VERSION) || !readMetrics(segment, *copy)) {
+    cerr << "greasy-stat: the metrics of pid " << pid << " are not readable by this version" << endl;
+    munmap(segment, sizeof(metricsSegment));
+    delete copy;
+    return false;
+  }
+  munmap(segment, sizeof(metricsSegment));
+
+  alive = (kill(pid, 0) == 0) || (errno == EPERM);
+  dispatchRate = currentRate(*copy, copy->dispatchRate, copy->dispatchTime, now);
+  endRate = currentRate(*copy, copy->endRate, copy->endTime, now);
+  left = copy->total - min(copy->total, copy->completed + copy->failed + copy->cancelled);
+  pending = copy->total - min(copy->total, copy->waiting + copy->running + copy->completed + copy->failed + copy->cancelled);
+
+  cout << "Greasy " << pid << ": " << copy->taskFile << " with the " << copy->engine << " engine, ";
+  if (copy->finished) cout << "finished";
+  else if (!alive) cout << "not running anymore";
+  else cout << "running for " << formatSeconds(time(NULL) - copy->startTime);
+  cout << endl;
+  cout << "  Tasks:   " << copy->total << " total, " << pending << " pending, " << copy->waiting << " waiting, "
+       << copy->running << " running, " << copy->completed << " completed, " << copy->failed << " failed, "
+       << copy->cancelled << " cancelled" << endl;
+  cout << "  Retries: " << copy->retries << " of " << copy->dispatches << " dispatches" << endl;
+  printf("  Rates:   %.2f dispatched/s, %.2f ended/s over the last minute\n", dispatchRate, endRate);
+  cout << "  ETA:     ";
+  if (left == 0) cout << "done";
+  else if ((endRate > 0) && alive && !copy->finished) cout << formatSeconds((long long) (left/endRate));
+  else cout << "unknown";
+  cout << endl;
+  if (copy->nodes > 0) {
+    printf("  %-32s %8s %10s %8s\n", "Node", "Running", "Completed", "Failed");
+    for (int i = 0; i < copy->nodes; i++) {
+      printf("  %-32.63s %8u %10u %8u\n", copy->node[i].name, copy->node[i].running, copy->node[i].completed, copy->node[i].failed);
+    }
+  }
+  // The master removes its metrics when it ends, unless it was killed.
+  // Nobody else would, so they would stay in /dev/shm until the node reboots.
+  if (!alive && !copy->finished) {
+    if (shm_unlink(name.c_str()) == 0) cout << "  Removed the metrics left by the run" << endl;
+    else cerr << "greasy-stat: could not remove the metrics of pid " << pid << ": " << strerror(errno) << endl;
+  }
+  cout.flush();
+  fflush(stdout);
+
+  delete copy;
+  return true;
+
+}
+
+int main(int argc, char *argv[]) {
+
+  int interval = 0, opt, pid = 0;
+  vector<int> pids;
+  bool shown;
+
+  while ((opt = getopt(argc, argv, "w:h")) != -1) {
+    switch (opt) {
+      case 'w': fromString(interval, optarg); break;
+      default: usage();
+    }
+  }
+  if (optind < argc) {
+    fromString(pid, string(argv[optind]));
+    if (pid <= 0) usage();
+    optind++;
+  }
+  if (optind < argc) usage();
+
+  do {
+    shown = false;
+    pids.clear();
+    if (pid > 0) pids.push_back(pid);
+    else pids = findRuns();
+    if (pids.empty()) cerr << "greasy-stat: no greasy runs found" << endl;
+    for (size_t i = 0; i < pids.size(); i++) {
+      if (i > 0) cout << endl;
+      shown = showRun(pids[i]) || shown;
+    }
+    if (interval > 0) {
+      sleep(interval);
+      cout << endl;
+    }
+  } while (interval > 0);
+
+  return shown ? 0 : 1;
+
+}
@@ -0,0 +1,165 @@
+/* 
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ * 
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ * 
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#ifndef GREASYSTAT_H
+#define GREASYSTAT_H
+
+#include <string>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+
+using namespace std;
+
+/**
+ * Layout of the shared memory segment where the master keeps the live
+ * metrics of a run, and where greasy-stat reads them. The segment is
+ * named after the pid of the master, and it is removed when the run ends.
+ * The version must be increased whenever the layout changes.
+ */
+#define METRICS_VERSION 1
+#define METRICS_MAX_NODES 1024
+#define METRICS_RATE_WINDOW 60
+
+/**
+ * Metrics of the tasks of a node.
+ */
+typedef struct {
+    char name[64]; /**< Name of the node. */
+    unsigned int running; /**< Tasks running on the node. */
+    unsigned int completed; /**< Tasks completed on the node. */
+    unsigned int failed; /**< Runs that failed on the node, including the ones retried. */
+    unsigned int reserved; /**< Padding, always 0. */
+} nodeMetrics;
+
+/**
+ * Metrics of a run. Only the master writes them: the sequence is odd while
+ * it does, so that readers can tell a consistent copy without locks.
+ */
+typedef struct {
+    char magic[4]; /**< Always "GRSM". */
+    int version; /**< Layout version of the segment. */
+    unsigned int sequence; /**< Increased before and after every change. */
+    int pid; /**< Pid of the master. */
+    long long startTime; /**< Start of the run, in seconds since the epoch. */
+    long long startClock; /**< Start of the run, in monotonic microseconds. */
+    long long updated; /**< Time of the last change, in monotonic microseconds. */
+    char taskFile[256]; /**< Task file of the run. */
+    char engine[16]; /**< Engine of the run. */
+    unsigned int total; /**< Valid tasks in the task file. */
+    unsigned int waiting; /**< Tasks ready to run, waiting for a worker. */
+    unsigned int running; /**< Tasks dispatched and not finished. */
+    unsigned int completed; /**< Tasks completed successfully. */
+    unsigned int failed; /**< Tasks failed, not to be retried. */
+    unsigned int cancelled; /**< Tasks cancelled by a dependency. */
+    unsigned long long dispatches; /**< Tasks dispatched, including retries. */
+    unsigned long long retries; /**< Retries of failed or lost tasks. */
+    double dispatchRate; /**< Dispatches per second over the last METRICS_RATE_WINDOW seconds, at dispatchTime. */
+    long long dispatchTime; /**< Time of the last dispatch, in monotonic microseconds. */
+    double endRate; /**< Tasks ended per second over the last METRICS_RATE_WINDOW seconds, at endTime. */
+    long long endTime; /**< Time of the last end, in monotonic microseconds. */
+    int finished; /**< 1 once the run ended. */
+    int nodes; /**< Number of nodes in use. */
+    nodeMetrics node[METRICS_MAX_NODES]; /**< Metrics of each node. */
+} metricsSegment;
+
+/**
+  * Inline function to get the name of the segment of a run.
+  * @param pid The pid of the master.
+  * @return The name, to be used with shm_open.
+  */
+inline string metricsSegmentName(int pid) {
+
+  char name[32];
+  snprintf(name, sizeof(name), "/greasy-%d", pid);
+  return string(name);
+
+}
+
+/**
+  * Inline function to get the time of the monotonic clock, the one used
+  * in the segment. It is the same for all the processes of a node.
+  * @return The time in microseconds.
+  */
+inline long long metricsNow() {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec*1000000 + ts.tv_nsec/1000;
+
+}
+
+/**
+  * Inline function to bring a moving rate up to a later time, as if no
+  * events happened since it was updated.
+  * @param rate The rate, in events per second.
+  * @param since The time the rate was updated, in monotonic microseconds.
+  * @param now The time wanted, in monotonic microseconds.
+  * @return The rate at the time wanted.
+  */
+inline double decayedRate(double rate, long long since, long long now) {
+
+  if (now <= since) return rate;
+  return rate*exp(-(now - since)/(METRICS_RATE_WINDOW*1e6));
+
+}
+
+/**
+  * Inline function to get a moving rate of the segment at a given time.
+  * Early in the run, when the window is not full yet, it is scaled up
+  * to the part of the window elapsed.
+  * @param segment The segment.
+  * @param rate The rate, in events per second.
+  * @param since The time the rate was updated, in monotonic microseconds.
+  * @param now The time wanted, in monotonic microseconds.
+  * @return The rate at the time wanted.
+  */
+inline double currentRate(const metricsSegment& segment, double rate, long long since, long long now) {
+
+  double filled = 1 - exp(-(now - segment.startClock)/(METRICS_RATE_WINDOW*1e6));
+
+  if (filled <= 0) return 0;
+  return decayedRate(rate, since, now)/filled;
+
+}
+
+/**
+  * Inline function to take a consistent copy of the metrics, retrying
+  * while the master is changing them. The master never waits for it.
+  * @param segment The segment.
+  * @param copy Where the copy is stored.
+  * @return true if a consistent copy was taken.
+  */
+inline bool readMetrics(const metricsSegment* segment, metricsSegment& copy) {
+
+  unsigned int before, after;
+
+  for (int tries = 0; tries < 1000; tries++) {
+    before = __atomic_load_n(&segment->sequence, __ATOMIC_ACQUIRE);
+    if (before & 1) continue;
+    memcpy(&copy, segment, sizeof(metricsSegment));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&segment->sequence, __ATOMIC_RELAXED);
+    if (before == after) return true;
+  }
+  return false;
+
+}
+
+#endif
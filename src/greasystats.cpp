@@ -0,0 +1,182 @@
+/* 
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ * 
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ * 
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#include "greasystats.h"
+#include "greasylog.h"
+#include "greasytimer.h"
+#include "greasyutils.h"
+#include <cstdio>
+#include <ctime>
+
+GreasyStats::GreasyStats() {
+
+  enabled = false;
+  ownerPid = 0;
+  origin = 0;
+  dispatchCpu = -1;
+
+}
+
+GreasyStats* GreasyStats::getInstance() {
+
+  static GreasyStats instance;
+  return &instance;
+
+}
+
+long long GreasyStats::threadCpuTime() {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (long long) ts.tv_sec*1000000 + ts.tv_nsec/1000;
+
+}
+
+void GreasyStats::reserve(vector<long long>& times, int index) {
+
+  if (index >= (int) times.size()) times.resize(2*index + 1, -1);
+
+}
+
+void GreasyStats::start() {
+
+  origin = GreasyTimer::usecsNow();
+  ownerPid = getpid();
+  enabled = true;
+
+}
+
+void GreasyStats::record(GreasyEvents::EventTypes type, GreasyTask* task) {
+
+  long long now;
+  int taskId = task->getTaskId();
+  int worker = task->getWorker();
+
+  if (!enabled || (getpid() != ownerPid)) return;
+
+  lock_guard<mutex> guard(lock);
+  now = GreasyTimer::usecsNow();
+  reserve(readyTimes, taskId);
+  reserve(dispatchTimes, taskId);
+  reserve(startTimes, taskId);
+
+  switch (type) {
+    case GreasyEvents::queued:
+      readyTimes[taskId] = now;
+      break;
+    case GreasyEvents::dispatched:
+      if (readyTimes[taskId] >= 0) readyToDispatch.add(now - readyTimes[taskId]);
+      readyTimes[taskId] = -1;
+      dispatchTimes[taskId] = now;
+      if (worker < 0) break;
+      reserve(idleSince, worker);
+      reserve(assigned, worker);
+      // Workers are idle since the beginning of the run until their first task
+      if (assigned[worker] < 0) {
+        assigned[worker] = 0;
+        idleSince[worker] = origin;
+      }
+      if ((assigned[worker] == 0) && (idleSince[worker] >= 0)) workerIdle.add(now - idleSince[worker]);
+      assigned[worker]++;
+      idleSince[worker] = -1;
+      break;
+    case GreasyEvents::started:
+      if (dispatchTimes[taskId] >= 0) dispatchToStart.add(now - dispatchTimes[taskId]);
+      startTimes[taskId] = now;
+      break;
+    case GreasyEvents::finished:
+      runTime.add(task->getElapsedTime());
+      // Tasks of remote workers are never seen starting by the master, so
+      // their workers measure both delays
+      if (task->getStartDelay() >= 0) dispatchToStart.add(task->getStartDelay());
+      if (task->getNoticeDelay() >= 0) endToNotice.add(task->getNoticeDelay());
+      else if (startTimes[taskId] >= 0) endToNotice.add(now - startTimes[taskId] - (long long) task->getElapsedTime());
+      if (dispatchTimes[taskId] >= 0) turnaround.add(now - dispatchTimes[taskId] - (long long) task->getElapsedTime());
+      release(task, now);
+      break;
+    case GreasyEvents::retried:
+      // Tasks lost with their worker never finished
+      release(task, now);
+      break;
+    default:
+      break;
+  }
+
+}
+
+void GreasyStats::release(GreasyTask* task, long long now) {
+
+  int taskId = task->getTaskId();
+  int worker = task->getWorker();
+
+  if ((dispatchTimes[taskId] >= 0) && (worker >= 0) && (worker < (int) assigned.size()) && (assigned[worker] > 0)) {
+    assigned[worker]--;
+    if (assigned[worker] == 0) idleSince[worker] = now;
+  }
+  dispatchTimes[taskId] = -1;
+  startTimes[taskId] = -1;
+
+}
+
+void GreasyStats::beginDispatch() {
+
+  if (enabled) dispatchCpu = threadCpuTime();
+
+}
+
+void GreasyStats::endDispatch() {
+
+  if (!enabled || (dispatchCpu < 0)) return;
+  masterCpu.add(threadCpuTime() - dispatchCpu);
+  dispatchCpu = -1;
+
+}
+
+void GreasyStats::logSummary() {
+
+  GreasyLog* log = GreasyLog::getInstance();
+  long long now = GreasyTimer::usecsNow();
+  vector<string> lines;
+  string names[7] = {"Ready to dispatch", "Dispatch to start", "End to notice", "Turnaround overhead",
+                     "Worker idle", "Master cpu per dispatch", "Task run time"};
+  GreasyHistogram* histograms[7] = {&readyToDispatch, &dispatchToStart, &endToNotice, &turnaround,
+                                    &workerIdle, &masterCpu, &runTime};
+
+  if (!enabled || (getpid() != ownerPid)) return;
+  lock_guard<mutex> guard(lock);
+  enabled = false;
+
+  // Workers left without tasks stay idle until the end
+  for (size_t worker = 0; worker < idleSince.size(); worker++) {
+    if (idleSince[worker] >= 0) workerIdle.add(now - idleSince[worker]);
+  }
+
+  if ((turnaround.getCount() > 0) && (runTime.getTotal() > 0)) {
+    LOG_RECORDF(log, GreasyLog::info, "", "Scheduler overhead: %.2f%% of the run time of the tasks",
+                turnaround.getTotal()*100.0/runTime.getTotal());
+  }
+  for (int i = 0; i < 7; i++) {
+    if (histograms[i]->getCount() == 0) continue;
+    LOG_RECORD(log, GreasyLog::info, names[i] + ": " + histograms[i]->summary());
+    if (!log->isEnabled(GreasyLog::debug)) continue;
+    lines = histograms[i]->buckets();
+    for (size_t j = 0; j < lines.size(); j++) LOG_RECORD(log, GreasyLog::debug, "  " + lines[j]);
+  }
+
+}
@@ -0,0 +1,136 @@
+/* 
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ * 
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ * 
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#ifndef GREASYSTATS_H
+#define GREASYSTATS_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <unistd.h>
+
+#include "greasytask.h"
+#include "greasyevents.h"
+#include "greasyhistogram.h"
+
+using namespace std;
+
+/**
+ * This class measures the overhead of the scheduler, to tell whether
+ * Greasy or the tasks themselves limit a run. From the events of each
+ * task it takes the time it waits to be dispatched once ready, the time
+ * from the dispatch to the start of its process and from its end until
+ * the master notices it, and the whole turnaround of the task that is not
+ * spent running it. It also measures how long workers stay idle and the
+ * cpu time of the master for each dispatch. All of them are kept in
+ * histograms, written in the summary of the run.
+ * Times are taken by the master on its monotonic clock, under a lock of
+ * their own. When a remote worker runs the task, the worker measures
+ * instead the time from receiving it to starting it, and from its end to
+ * sending the report, and the master takes them from the task.
+ */
+class GreasyStats {
+
+public:
+
+  /**
+    * Get the unique GreasyStats instance. Implementation of the Singleton Pattern.
+    * @return A pointer to the GreasyStats instance.
+    */
+  static GreasyStats* getInstance();
+
+  /**
+    * Start measuring. Workers count as idle from now on.
+    */
+  void start();
+
+  /**
+    * Take the times of an event of a task.
+    * @param type The type of the event.
+    * @param task The task.
+    */
+  void record(GreasyEvents::EventTypes type, GreasyTask* task);
+
+  /**
+    * Note that the master starts a dispatch.
+    */
+  void beginDispatch();
+
+  /**
+    * Note that the master ends a dispatch.
+    */
+  void endDispatch();
+
+  /**
+    * Write the histograms in the log: a summary line for each one, and
+    * their buckets at debug level.
+    */
+  void logSummary();
+
+private:
+
+  /**
+    * Default constructor, hidden from everyone. If anyone wants to use the
+    * class, they should use the getInstance function.
+    */
+  GreasyStats();
+
+  /**
+    * Get the cpu time of the calling thread.
+    * @return The time in microseconds.
+    */
+  static long long threadCpuTime();
+
+  /**
+    * Make room for the times of a task or a worker.
+    * @param times The vector of times.
+    * @param index The index needed.
+    */
+  static void reserve(vector<long long>& times, int index);
+
+  /**
+    * Forget the dispatch of a task that ended, and free its worker.
+    * @param task The task.
+    * @param now The current time.
+    */
+  void release(GreasyTask* task, long long now);
+
+  atomic<bool> enabled; /**< Whether start was called, checked without the lock. */
+  mutex lock; /**< Serializes the access to the times and the histograms. */
+  pid_t ownerPid; /**< Process that started measuring. Forked children leave it alone. */
+  long long origin; /**< Time of the start. */
+  long long dispatchCpu; /**< Cpu time of the master when the current dispatch began, or -1. */
+  vector<long long> readyTimes; /**< Time each task was queued, by task id, or -1. */
+  vector<long long> dispatchTimes; /**< Time each task was dispatched, by task id, or -1. */
+  vector<long long> startTimes; /**< Time each task was started, by task id, or -1. */
+  vector<long long> idleSince; /**< Time each worker ran out of tasks, by worker, or -1 while busy. */
+  vector<long long> assigned; /**< Tasks dispatched to each worker and not finished yet, by worker, or -1 if never used. */
+
+  GreasyHistogram readyToDispatch; /**< From queued to dispatched. */
+  GreasyHistogram dispatchToStart; /**< From dispatched to started. */
+  GreasyHistogram endToNotice; /**< From the end of the process to its report. */
+  GreasyHistogram turnaround; /**< From dispatched to reported, minus the run time. */
+  GreasyHistogram workerIdle; /**< Intervals of the workers without tasks. */
+  GreasyHistogram masterCpu; /**< Cpu time of the master in each dispatch. */
+  GreasyHistogram runTime; /**< Run time of the tasks. */
+
+};
+
+#endif
@@ -50,6 +50,11 @@ void GreasyTask::initAttributes ( ) {
   retries = 0;
   elapsed = 0;
   elapsedAcc = 0;
+  pendingParents = 0;
+  worker = -1;
+  hasUsage = false;
+  startDelay = -1;
+  noticeDelay = -1;
   
 }
 
@@ -150,6 +155,13 @@ void GreasyTask::setTaskState(TaskStates state) {
   
 }
 
+bool GreasyTask::compareAndSetTaskState(TaskStates expected, TaskStates desired) {
+
+  int current = expected;
+  return taskState.compare_exchange_strong(current, desired);
+
+}
+
 int GreasyTask::getReturnCode() {
   
   return returnCode; 
@@ -193,6 +205,50 @@ void GreasyTask::setHostname(string h) {
   
 }
 
+int GreasyTask::getWorker() {
+
+  return worker;
+
+}
+
+void GreasyTask::setWorker(int w) {
+
+  worker = w;
+
+}
+
+const taskUsage* GreasyTask::getUsage() {
+
+  return hasUsage ? &usage : NULL;
+
+}
+
+void GreasyTask::setUsage(const taskUsage& u) {
+
+  usage = u;
+  hasUsage = (u.utime >= 0);
+
+}
+
+long long GreasyTask::getStartDelay() {
+
+  return startDelay;
+
+}
+
+long long GreasyTask::getNoticeDelay() {
+
+  return noticeDelay;
+
+}
+
+void GreasyTask::setDelays(long long start, long long notice) {
+
+  startDelay = start;
+  noticeDelay = notice;
+
+}
+
 int GreasyTask::getRetries() {
   
   return retries;
@@ -236,6 +292,18 @@ void GreasyTask::removeDependency(int parentTask){
   
 }
 
+void GreasyTask::resetPendingParents() {
+
+  pendingParents = dependencies.size();
+
+}
+
+int GreasyTask::releaseParent() {
+
+  return pendingParents.fetch_sub(1) - 1;
+
+}
+
 bool GreasyTask::addDependencies(string deps) {
   
   bool valid = true;
@@ -343,20 +411,26 @@ string GreasyTask::dump() {
 
 string GreasyTask::dumpDependencies(){
 
+  return dumpDependencies(dependencies);
+
+}
+
+string GreasyTask::dumpDependencies(list<int>& deps){
+
   string out = "";
   list<int>::iterator it;
   int last = 0;
   int left = 1;
   
   //Make sure list is sorted
-  dependencies.sort();
-  dependencies.unique(); 
+  deps.sort();
+  deps.unique(); 
   
-  if (!hasDependencies()) return out;
+  if (deps.empty()) return out;
 
   // Walk through the dependency list always comparing with the previous value
   // to properly write intervals when possible.
-  for (it = dependencies.begin(); it != dependencies.end(); it++) {
+  for (it = deps.begin(); it != deps.end(); it++) {
     if (*it == last + 1){
       last = *it;
     } else {
@@ -22,6 +22,9 @@
 
 #include <string>
 #include <list>
+#include <atomic>
+
+#include "greasyutils.h"
 
 using namespace std;
 
@@ -130,6 +133,16 @@ public:
    */
   void setTaskState(TaskStates state);
 
+  /**
+   * Atomically set the task state to desired, but only if the current state
+   * is expected. Engines running tasks concurrently use it to make sure only
+   * one thread performs a given transition.
+   * @param expected The state the task must be in.
+   * @param desired The new state of the task.
+   * @return true if this call changed the state, false otherwise.
+   */
+  bool compareAndSetTaskState(TaskStates expected, TaskStates desired);
+
   /**
    * Get the (last) return code of the task.
    * @return The exit code from the task.
@@ -144,21 +157,21 @@ public:
 
   /**
    * Get the last value of elapsed time of the task.
-   * @return the elapsed time in seconds of the task.
+   * @return the elapsed time in microseconds of the task.
    */
   unsigned long getElapsedTime();
 
   /**
    * Get the accumulated value of elapsed time of the task
    * along the retries.
-   * @return the total elapsed time in seconds of the task.
+   * @return the total elapsed time in microseconds of the task.
    */
   unsigned long getElapsedTimeAcc();
 
   /**
    * Set the elapsed time of the task. The time will be also
    * added to the total counter elapsedAcc.
-   * @param et the elapsed time in seconds.
+   * @param et the elapsed time in microseconds.
    */
   void setElapsedTime(unsigned long et);
 
@@ -174,6 +187,50 @@ public:
    */
   void setHostname(string h);
 
+  /**
+   * Get the worker where this task was allocated last.
+   * @return the worker, or -1 if it is unknown.
+   */
+  int getWorker();
+
+  /**
+   * Set the worker where this task was allocated.
+   * @param w the worker.
+   */
+  void setWorker(int w);
+
+  /**
+   * Get the resources used by the last execution of the task.
+   * @return the resource usage, or NULL if the engine could not get it.
+   */
+  const taskUsage* getUsage();
+
+  /**
+   * Set the resources used by the last execution of the task.
+   * @param u the resource usage, as given by waitTask. It is ignored if cleared.
+   */
+  void setUsage(const taskUsage& u);
+
+  /**
+   * Get the time the last execution of the task waited on its worker before starting.
+   * @return the delay in microseconds, or -1 if the task was not run by a remote worker.
+   */
+  long long getStartDelay();
+
+  /**
+   * Get the time from the end of the last execution of the task until its
+   * worker reported it.
+   * @return the delay in microseconds, or -1 if the task was not run by a remote worker.
+   */
+  long long getNoticeDelay();
+
+  /**
+   * Set the delays of the last execution of the task, as measured by its worker.
+   * @param start microseconds from the task reaching the worker to its start, or -1.
+   * @param notice microseconds from the end of the task to its report, or -1.
+   */
+  void setDelays(long long start, long long notice);
+
   /**
    * Get the number of retries performed with this task.
    * @return the number of retries.
@@ -209,6 +266,19 @@ public:
    */
   void removeDependency(int parentTask);
 
+  /**
+   * Reset the counter of pending parents to the current number of dependencies.
+   * It must be called before any parent may complete.
+   */
+  void resetPendingParents();
+
+  /**
+   * Atomically account for the completion of one parent task. The dependency
+   * list is left untouched, so it is safe to call from several threads.
+   * @return the number of parents still pending after this one.
+   */
+  int releaseParent();
+
   /**
    * Add task depenencies as written in the task file. It will parse the contents
    * of [# deps #]. Deps contains a list of comma separated tokens, which can be:
@@ -232,6 +302,13 @@ public:
    */
   string dumpDependencies();
 
+  /**
+   * Generate a pretty string with a list of dependencies, using intervals when possible.
+   * @param deps The list of dependencies. It is sorted and deduplicated.
+   * @return string with the dependencies.
+   */
+  static string dumpDependencies(list<int>& deps);
+
   /**
    * Checks if the task has a dedicated workdir.
    * @return true if the task has a dedicated workdir, false otherwise.
@@ -265,13 +342,19 @@ protected:
   int taskId;  /**< Task id corresponding to the line of the file (starting at 1). */
     int taskNum; /**< Real number of the task (ignoring comments). */
   string command; /**< Command to be executed. */
-  int taskState; /**< Task state at a given time. */
+  atomic<int> taskState; /**< Task state at a given time. */
   string hostname; /**< Return code of the executed command. */
+  int worker; /**< Worker where the task was allocated last. */
+  taskUsage usage; /**< Resources used by the last execution. */
+  bool hasUsage; /**< Whether usage was set by the engine. */
+  long long startDelay; /**< Microseconds the last execution waited on its worker, or -1. */
+  long long noticeDelay; /**< Microseconds from the end of the last execution to its report, or -1. */
   int returnCode;  /**< Return code of the executed command. */
   int retries; /**< Number of execution retries of the task. */
-  unsigned long elapsed; /**< Seconds elapsed of the last execution of the task. */
-  unsigned long elapsedAcc; /**< Seconds elapsed accumulated among retries. */
+  unsigned long elapsed; /**< Microseconds elapsed of the last execution of the task. */
+  unsigned long elapsedAcc; /**< Microseconds elapsed accumulated among retries. */
   list<int> dependencies; /**< List of the taskIds of the dependencies. */
+  atomic<int> pendingParents; /**< Number of parents not completed yet. */
   string workdir; /**< Dedicated workdir for the task. */
 
 };
@@ -0,0 +1,121 @@
+/* 
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ * 
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ * 
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#ifndef GREASYTCP_H
+#define GREASYTCP_H
+
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "greasyutils.h"
+
+using namespace std;
+
+/**
+ * Lines exchanged by the tcp engine and the greasy-worker agents:
+ *
+ *   HELLO <version> <slots> <token> <hostname>   agent to master, once connected
+ *   TASK <taskId> <command>                      master to agent
+ *   DONE <taskId> <retcode> <usecs> <delays> <usage>   agent to master, when a task ends
+ *   BYE                                          master to agent, when all is done
+ *
+ * The delays are the microseconds from receiving the task to starting it and
+ * from noticing its end to sending the DONE line, as measured by the agent,
+ * or -1 -1 if it did not run. The usage are the fields of taskUsage, in order
+ * and separated by spaces.
+ * The version must be increased whenever any of them changes.
+ */
+#define TCP_PROTOCOL_VERSION 4
+
+// Longest line accepted from a connection that did not say hello yet, and
+// from then on. Longer lines close the connection.
+#define TCP_MAX_HELLO_LINE 1024
+#define TCP_MAX_LINE (1024*1024)
+
+// Most slots an agent may announce
+#define TCP_MAX_SLOTS 4096
+
+/**
+  * Inline function to format the resources used by a task for a DONE line.
+  * @param usage The resources used by the task.
+  * @return The fields, separated by spaces.
+  */
+inline string usageFields(const taskUsage& usage) {
+
+  char fields[160];
+
+  snprintf(fields, sizeof(fields), "%lld %lld %lld %lld %lld %lld %lld", usage.utime, usage.stime,
+           usage.maxrss, usage.nvcsw, usage.nivcsw, usage.readBytes, usage.writtenBytes);
+  return fields;
+
+}
+
+/**
+  * Inline function to send a whole line through a socket.
+  * @param fd The socket.
+  * @param line The line to send, without the end of line.
+  * @return true if it was sent, false if the connection failed.
+  */
+inline bool sendLine(int fd, const string& line) {
+
+  string data = line + "\n";
+  size_t sent = 0;
+  ssize_t n;
+
+  while (sent < data.size()) {
+    n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if ((n < 0)&&(errno == EINTR)) continue;
+    if (n <= 0) return false;
+    sent += n;
+  }
+  return true;
+
+}
+
+/**
+  * Inline function to read what is available in a socket and split it in lines.
+  * @param fd The socket, which must be readable.
+  * @param buffer The data read before that did not complete a line.
+  * @param lines The vector where the complete lines are added.
+  * @param maxLine The longest line accepted, without the end of line.
+  * @return false if the connection was closed or failed, or sent a longer line.
+  */
+inline bool readLines(int fd, string& buffer, vector<string>& lines, size_t maxLine) {
+
+  char chunk[4096];
+  size_t pos;
+  ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+
+  if ((n < 0)&&((errno == EINTR)||(errno == EAGAIN))) return true;
+  if (n <= 0) return false;
+
+  buffer.append(chunk, n);
+  while ((pos = buffer.find('\n')) != string::npos) {
+    if (pos > maxLine) return false;
+    lines.push_back(buffer.substr(0, pos));
+    buffer.erase(0, pos + 1);
+  }
+  return (buffer.size() <= maxLine);
+
+}
+
+#endif // GREASYTCP_H
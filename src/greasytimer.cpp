@@ -20,6 +20,7 @@
 
 #include "greasytimer.h"
 #include <cstring>
+#include <ctime>
 
 GreasyTimer::GreasyTimer() {
 
@@ -33,10 +34,8 @@ GreasyTimer::GreasyTimer() {
 
 void GreasyTimer::start() {
 
-  struct timeval t;
   if (startTime == 0) {
-    gettimeofday(&t,0);
-    startTime = t.tv_sec*1000000+t.tv_usec;
+    startTime = usecsNow();
     on = true;
   }
 
@@ -44,10 +43,8 @@ void GreasyTimer::start() {
 
 void GreasyTimer::stop() {
 
-  struct timeval t;
   if ((on) && (startTime > 0)) {
-    gettimeofday(&t,NULL);
-    endTime = t.tv_sec*1000000+t.tv_usec;
+    endTime = usecsNow();
     elapsed += endTime - startTime;
     startTime = endTime;
     on = false;
@@ -84,7 +81,7 @@ unsigned long GreasyTimer::getEndTime() {
 
 string GreasyTimer::getElapsed() {
   
- return secsToTime(secsElapsed());
+ return usecsToTime(elapsed);
  
 }
 
@@ -106,6 +103,14 @@ unsigned long GreasyTimer::usecsElapsed() {
 }
 
 
+unsigned long GreasyTimer::usecsNow() {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long) ts.tv_sec*1000000 + ts.tv_nsec/1000;
+
+}
+
 string GreasyTimer::now() {
 
   struct tm *tmp;
@@ -118,8 +123,8 @@ string GreasyTimer::now() {
 
 string GreasyTimer::secsToTime(unsigned long secs) {
 
-  int hours, minutes, seconds;
-  char buf[10];
+  unsigned long hours, minutes, seconds;
+  char buf[32];
   string time;
   
   hours=secs/3600;
@@ -128,11 +133,21 @@ string GreasyTimer::secsToTime(unsigned long secs) {
   secs=secs%60;
   seconds=secs;
   
-  sprintf(buf,"%02d:%02d:%02d",hours,minutes,seconds);
+  // Summed up times, as the cpu time of the tasks, may well go over 99 hours
+  snprintf(buf,sizeof(buf),"%02lu:%02lu:%02lu",hours,minutes,seconds);
   return string(buf);
   
 }
 
+string GreasyTimer::usecsToTime(unsigned long usecs) {
+
+  char buf[8];
+  
+  snprintf(buf,sizeof(buf),".%03lu",(usecs/1000)%1000);
+  return secsToTime(usecs/1000000) + buf;
+  
+}
+
 string GreasyTimer::timeToString(struct tm * ts) {
  
   char buffer[100];
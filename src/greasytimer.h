@@ -29,6 +29,8 @@ using namespace std;
 /**
  * A simple timer class with usecs resolution. Timer can be started and stopped as many 
  * times as desired, and elapsed will be added each time until reset is called.
+ * It counts on the monotonic clock, so changes to the system date do not
+ * affect the times measured.
  * It also provide some useful static methods for datetime querying.
  */
 class GreasyTimer {
@@ -86,8 +88,8 @@ public:
   unsigned long usecsElapsed();
   
   /**
-   * Get a well formatted HH:MM:SS of the elapsed time of the timer.
-   * @return string with the time in hours, minutes and seconds.
+   * Get a well formatted HH:MM:SS.mmm of the elapsed time of the timer.
+   * @return string with the time in hours, minutes, seconds and milliseconds.
    */
   string getElapsed();
   
@@ -97,6 +99,13 @@ public:
    * */
   bool isOn();
   
+  /**
+   * Get the current time of the monotonic clock. It only makes sense
+   * to compare it with other values of the same clock.
+   * @return The time in usecs.
+   */
+  static unsigned long usecsNow();
+  
   /**
    * Function to get current date time as a string in the format 
    * "YYYY-MM-DD HH:MM:SS".
@@ -112,6 +121,14 @@ public:
    */
   static string secsToTime(unsigned long secs);
   
+  /**
+   * Static method to convert microseconds to a string in the format
+   * HH:MM:SS.mmm
+   * @param usecs the microseconds to convert
+   * @return the microseconds in HH:MM:SS.mmm
+   */
+  static string usecsToTime(unsigned long usecs);
+  
  
   /**
    * Function to transform a time struct as given by time syscall to a
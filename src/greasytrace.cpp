@@ -0,0 +1,266 @@
+/* 
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ * 
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ * 
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#include "greasytrace.h"
+#include "greasyutils.h"
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+
+// Names of each one of the states.
+const string GreasyTrace::traceStatesDesc[6] = {"Idle", "Completed", "Failed", "Lost", "Scheduling", "Waiting"};
+
+// Colors of each one of the states, among the ones reserved by the trace viewer.
+static const char* stateColors[6] = {"grey", "good", "bad", "terrible", "thread_state_running", "thread_state_sleeping"};
+
+// Order the records by worker, and then by time.
+static bool byWorkerAndTime(const traceRecord& a, const traceRecord& b) {
+
+  if (a.worker != b.worker) return a.worker < b.worker;
+  return a.begin < b.begin;
+
+}
+
+// Append a complete event of the trace viewer, for an interval of a row.
+static void appendInterval(string& out, const traceRecord& record, int row) {
+
+  char fields[320];
+  string name = GreasyTrace::traceStatesDesc[record.state];
+  bool isTask = (record.state >= GreasyTrace::completed) && (record.state <= GreasyTrace::lost);
+  bool isMaster = (record.state >= GreasyTrace::scheduling);
+
+  if (isTask) name = "Task " + toString(record.taskNum);
+  snprintf(fields, sizeof(fields), "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+           "\"pid\":%d,\"tid\":%d,\"cname\":\"%s\"",
+           name.c_str(), GreasyTrace::traceStatesDesc[record.state].c_str(), record.begin, record.end - record.begin,
+           isMaster ? 0 : record.worker, row, stateColors[record.state]);
+  out += fields;
+  if (isTask) {
+    snprintf(fields, sizeof(fields), ",\"args\":{\"line\":%d,\"rc\":%d,\"attempt\":%d}",
+             record.taskId, record.retcode, record.attempt);
+    out += fields;
+  }
+  out += "},\n";
+
+}
+
+GreasyTrace::GreasyTrace() {
+
+  enabled = false;
+  ownerPid = 0;
+  origin = 0;
+  waitStart = -1;
+
+}
+
+GreasyTrace* GreasyTrace::getInstance() {
+
+  static GreasyTrace instance;
+  return &instance;
+
+}
+
+long long GreasyTrace::now() {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec*1000000 + ts.tv_nsec/1000 - origin;
+
+}
+
+bool GreasyTrace::open(const string& fileName) {
+
+  FILE* out;
+
+  // Fail early if the trace could not be written at the end
+  out = fopen(fileName.c_str(), "w");
+  if (!out) return false;
+  fclose(out);
+
+  this->fileName = fileName;
+  origin = 0;
+  origin = now();
+  ownerPid = getpid();
+  enabled = true;
+  return true;
+
+}
+
+void GreasyTrace::dispatched(GreasyTask* task) {
+
+  int taskId = task->getTaskId();
+
+  if (!enabled || (task->getWorker() < 0)) return;
+  lock_guard<mutex> guard(lock);
+  if (taskId >= (int) dispatchTimes.size()) dispatchTimes.resize(2*taskId + 1, -1);
+  dispatchTimes[taskId] = now();
+
+}
+
+void GreasyTrace::ended(GreasyTask* task, bool isLost) {
+
+  traceRecord record;
+  int taskId = task->getTaskId();
+
+  if (!enabled || (task->getWorker() < 0)) return;
+
+  lock_guard<mutex> guard(lock);
+  record.end = now();
+  if ((taskId < (int) dispatchTimes.size()) && (dispatchTimes[taskId] >= 0)) {
+    record.begin = dispatchTimes[taskId];
+    dispatchTimes[taskId] = -1;
+  } else if (!isLost) {
+    // Tasks taken by the workers themselves were never dispatched by the master
+    record.begin = max(0LL, record.end - (long long) task->getElapsedTime());
+  } else {
+    return;
+  }
+
+  record.worker = task->getWorker();
+  record.taskId = taskId;
+  record.taskNum = task->getTaskNum();
+  record.retcode = task->getReturnCode();
+  record.attempt = task->getRetries() - (isLost ? 1 : 0);
+  if (isLost) record.state = lost;
+  else record.state = (record.retcode == 0) ? completed : failed;
+  executions.push_back(record);
+  if (!task->getHostname().empty()) nodes[record.worker] = task->getHostname();
+
+}
+
+void GreasyTrace::beginWait() {
+
+  if (!enabled) return;
+  lock_guard<mutex> guard(lock);
+  waitStart = now();
+
+}
+
+void GreasyTrace::endWait() {
+
+  traceRecord record;
+
+  if (!enabled) return;
+  lock_guard<mutex> guard(lock);
+  if (waitStart < 0) return;
+  record.begin = waitStart;
+  record.end = now();
+  record.state = waiting;
+  waits.push_back(record);
+  waitStart = -1;
+
+}
+
+bool GreasyTrace::close() {
+
+  string out;
+  FILE* file;
+  traceRecord gap;
+  vector<long long> rowEnds;
+  vector<int> rows;
+  map<int,int> rowsPerWorker;
+  map<int,string>::iterator node;
+  long long end, last = 0;
+  int row;
+  char fields[256];
+  bool written;
+
+  if (!enabled || (getpid() != ownerPid)) return false;
+  lock_guard<mutex> guard(lock);
+  if (!enabled) return false;
+  enabled = false;
+  end = now();
+
+  out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  out += "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"tid\":0,\"args\":{\"name\":\"Master\"}},\n";
+  out += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":0,\"args\":{\"name\":\"Scheduler\"}},\n";
+
+  // The master schedules whenever it is not waiting
+  gap.state = scheduling;
+  for (vector<traceRecord>::iterator it = waits.begin(); it != waits.end(); it++) {
+    gap.begin = last;
+    gap.end = it->begin;
+    if (gap.end > gap.begin) appendInterval(out, gap, 0);
+    appendInterval(out, *it, 0);
+    last = it->end;
+  }
+  gap.begin = last;
+  gap.end = end;
+  if (gap.end > gap.begin) appendInterval(out, gap, 0);
+
+  // Executions of each worker are spread over as few rows as possible,
+  // each one taking the first row free when it was dispatched. The master
+  // row of a worker running in the master is left alone.
+  sort(executions.begin(), executions.end(), byWorkerAndTime);
+  for (size_t i = 0; i < executions.size(); i++) {
+    traceRecord& record = executions[i];
+    if ((i == 0) || (executions[i-1].worker != record.worker)) rowEnds.clear();
+    for (row = 0; (row < (int) rowEnds.size()) && (rowEnds[row] > record.begin); row++);
+    if (row == (int) rowEnds.size()) rowEnds.push_back(0);
+    gap.state = idle;
+    gap.worker = record.worker;
+    gap.begin = rowEnds[row];
+    gap.end = record.begin;
+    if (gap.end > gap.begin) appendInterval(out, gap, row + 1);
+    appendInterval(out, record, row + 1);
+    rowEnds[row] = record.end;
+    rowsPerWorker[record.worker] = rowEnds.size();
+    // Rows idle until the end of the run
+    if ((i + 1 == executions.size()) || (executions[i+1].worker != record.worker)) {
+      for (row = 0; row < (int) rowEnds.size(); row++) {
+        gap.begin = rowEnds[row];
+        gap.end = end;
+        if (gap.end > gap.begin) appendInterval(out, gap, row + 1);
+      }
+    }
+  }
+
+  // Names of the workers and their rows
+  for (map<int,int>::iterator it = rowsPerWorker.begin(); it != rowsPerWorker.end(); it++) {
+    if (it->first > 0) {
+      snprintf(fields, sizeof(fields), "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":", it->first);
+      out += fields;
+      node = nodes.find(it->first);
+      appendJSONString(out, "Worker " + toString(it->first) + ((node != nodes.end()) ? " on " + node->second : ""));
+      out += "}},\n";
+      snprintf(fields, sizeof(fields), "{\"name\":\"process_sort_index\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"sort_index\":%d}},\n",
+               it->first, it->first);
+      out += fields;
+    }
+    for (row = 1; row <= it->second; row++) {
+      snprintf(fields, sizeof(fields), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"Slot %d\"}},\n",
+               it->first, row, row);
+      out += fields;
+    }
+  }
+
+  // The last event takes no trailing comma
+  out.erase(out.size() - 2);
+  out += "\n]}\n";
+
+  file = fopen(fileName.c_str(), "w");
+  if (!file) return false;
+  written = (fwrite(out.data(), 1, out.size(), file) == out.size());
+  written = (fclose(file) == 0) && written;
+
+  executions.clear();
+  waits.clear();
+  return written;
+
+}
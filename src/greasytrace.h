@@ -0,0 +1,149 @@
+/* 
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ * 
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ * 
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#ifndef GREASYTRACE_H
+#define GREASYTRACE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <unistd.h>
+
+#include "greasytask.h"
+
+using namespace std;
+
+/**
+ * An execution of a task, or an interval of the master, in the trace.
+ */
+struct traceRecord {
+  long long begin; /**< Microseconds since the trace was opened. */
+  long long end; /**< Microseconds since the trace was opened. */
+  int worker; /**< Worker that ran the task. */
+  int taskId; /**< Task id, its line in the task file. */
+  int taskNum; /**< Task number. */
+  int retcode; /**< Return code of the task. */
+  short state; /**< One of GreasyTrace::TraceStates. */
+  short attempt; /**< Attempt number of the execution, starting at 0. */
+};
+
+/**
+ * This class builds a timeline of the run from the timestamps of the master,
+ * to be loaded in Chrome's trace viewer (chrome://tracing) or Perfetto. Each
+ * worker is shown as a process with a row per slot, holding the tasks it
+ * ran and the idle intervals in between. The master has a row of its own
+ * with the time spent scheduling and waiting for the workers.
+ * During the run, only the dispatch and the end of each execution are kept
+ * in memory, under a lock of the trace. The rows and the file are built
+ * when the trace is closed.
+ */
+class GreasyTrace {
+
+public:
+
+  /**
+  * States of the intervals in the trace.
+  */
+  enum TraceStates {
+    idle, /**< The slot has no task. */
+    completed, /**< The slot runs a task that completes successfully. */
+    failed, /**< The slot runs a task that fails. */
+    lost, /**< The slot runs a task that is lost with its worker. */
+    scheduling, /**< The master is scheduling. */
+    waiting /**< The master is waiting for the workers. */
+  };
+
+  /**
+  * Names of the states, as shown in the trace.
+  */
+  static const string traceStatesDesc[6];
+
+  /**
+    * Get the unique GreasyTrace instance. Implementation of the Singleton Pattern.
+    * @return A pointer to the GreasyTrace instance.
+    */
+  static GreasyTrace* getInstance();
+
+  /**
+    * Start the trace. Time in the trace counts from now on.
+    * @param fileName Path where the trace is written when it is closed.
+    * @return True if all is ok, false otherwise.
+    */
+  bool open(const string& fileName);
+
+  /**
+    * Note that a task was dispatched to its worker.
+    * @param task The task.
+    */
+  void dispatched(GreasyTask* task);
+
+  /**
+    * Note that the execution of a task ended, because it finished or because
+    * it was lost with its worker.
+    * @param task The task.
+    * @param isLost True if the task was lost with its worker.
+    */
+  void ended(GreasyTask* task, bool isLost);
+
+  /**
+    * Note that the master starts waiting for the workers.
+    */
+  void beginWait();
+
+  /**
+    * Note that the master stops waiting for the workers.
+    */
+  void endWait();
+
+  /**
+    * Build the trace and write it.
+    * @return True if the trace was written.
+    */
+  bool close();
+
+private:
+
+  /**
+    * Default constructor, hidden from everyone. If anyone wants to use the
+    * class, they should use the getInstance function.
+    */
+  GreasyTrace();
+
+  /**
+    * Get the current time in the trace.
+    * @return Microseconds since the trace was opened.
+    */
+  long long now();
+
+  atomic<bool> enabled; /**< Whether the trace was opened, checked without the lock. */
+  mutex lock; /**< Serializes the access to the records. */
+  string fileName; /**< Path of the trace. */
+  pid_t ownerPid; /**< Process that opened the trace. Forked children leave it alone. */
+  long long origin; /**< Monotonic time of the opening, in microseconds. */
+  long long waitStart; /**< Beginning of the current wait of the master, or -1. */
+  vector<long long> dispatchTimes; /**< Dispatch time of the running tasks by task id, or -1. */
+  vector<traceRecord> executions; /**< Executions of the tasks ended so far. */
+  vector<traceRecord> waits; /**< Waits of the master. */
+  map<int,string> nodes; /**< Node of each worker. */
+
+};
+
+#endif
@@ -23,8 +23,21 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <thread>
+#include <atomic>
+#include <functional>
 
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <csignal>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
 
 using namespace std;
 
@@ -122,5 +135,259 @@ inline string getWorkingDir() {
 
 }
 
+/**
+  * Inline function to append a string to a JSON document, quoted and escaped.
+  * @param out The document.
+  * @param value The string to append.
+  */
+inline void appendJSONString(string& out, const string& value) {
+
+  const char hex[] = "0123456789abcdef";
+
+  out += '"';
+  for (size_t i = 0; i < value.length(); ++i) {
+    unsigned char c = value[i];
+    if ((c == '"') || (c == '\\')) {
+      out += '\\';
+      out += c;
+    } else if (c < 0x20) {
+      out += "\\u00";
+      out += hex[c >> 4];
+      out += hex[c & 0xf];
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+
+}
+
+/**
+  * Inline function to write an amount of bytes in a readable way.
+  * @param bytes The amount of bytes.
+  * @return The amount, in the largest unit that keeps it above 1.
+  */
+inline string formatBytes(long long bytes) {
+
+  const char* units[] = { "B", "KB", "MB", "GB", "TB", "PB" };
+  char text[32];
+  double value = bytes;
+  int unit = 0;
+
+  while ((value >= 1024) && (unit < 5)) {
+    value /= 1024;
+    unit++;
+  }
+  if (unit == 0) snprintf(text, sizeof(text), "%lld B", bytes);
+  else snprintf(text, sizeof(text), "%.1f %s", value, units[unit]);
+  return text;
+
+}
+
+/**
+ * Resources used by one execution of a task. Times are in microseconds and
+ * memory in kilobytes. Any field the system could not tell is -1.
+ */
+typedef struct {
+  long long utime; /**< User cpu time. */
+  long long stime; /**< System cpu time. */
+  long long maxrss; /**< Maximum resident set size. */
+  long long nvcsw; /**< Voluntary context switches. */
+  long long nivcsw; /**< Involuntary context switches. */
+  long long readBytes; /**< Bytes read, including the page cache. */
+  long long writtenBytes; /**< Bytes written, including the page cache. */
+} taskUsage;
+
+/**
+  * Inline function to mark all the resources of a task as unknown.
+  * @param usage The usage to clear.
+  */
+inline void clearUsage(taskUsage& usage) {
+
+  usage.utime = usage.stime = usage.maxrss = -1;
+  usage.nvcsw = usage.nivcsw = -1;
+  usage.readBytes = usage.writtenBytes = -1;
+
+}
+
+/**
+  * Inline function to reap a finished child and get the resources it used.
+  * The child is first waited for without reaping, as its I/O counters can
+  * only be read from /proc while it is a zombie. As with wait4, the usage
+  * includes the descendants the child waited for.
+  * @param pid The child to wait for, or -1 for any of them.
+  * @param options 0, or WNOHANG not to block.
+  * @param status Where the status of the child will be stored.
+  * @param usage Where the resources used by the child will be stored.
+  * @return The pid of the child, 0 if none finished yet with WNOHANG, or -1 on errors.
+  */
+inline pid_t waitTask(pid_t pid, int options, int* status, taskUsage* usage) {
+
+  siginfo_t info;
+  struct rusage ru;
+  char buffer[512];
+  const char* field;
+  ssize_t n;
+  int fd;
+
+  info.si_pid = 0;
+  if (waitid(pid > 0 ? P_PID : P_ALL, pid > 0 ? pid : 0, &info, WEXITED|WNOWAIT|options) != 0) return -1;
+  if (info.si_pid == 0) return 0;
+  pid = info.si_pid;
+
+  clearUsage(*usage);
+  snprintf(buffer, sizeof(buffer), "/proc/%d/io", (int) pid);
+  if ((fd = open(buffer, O_RDONLY|O_CLOEXEC)) >= 0) {
+    n = read(fd, buffer, sizeof(buffer)-1);
+    close(fd);
+    if (n > 0) {
+      buffer[n] = '\0';
+      if ((field = strstr(buffer, "rchar:"))) usage->readBytes = strtoll(field+6, NULL, 10);
+      if ((field = strstr(buffer, "wchar:"))) usage->writtenBytes = strtoll(field+6, NULL, 10);
+    }
+  }
+
+  while (wait4(pid, status, 0, &ru) < 0) {
+    if (errno != EINTR) return -1;
+  }
+
+  usage->utime = (long long) ru.ru_utime.tv_sec*1000000 + ru.ru_utime.tv_usec;
+  usage->stime = (long long) ru.ru_stime.tv_sec*1000000 + ru.ru_stime.tv_usec;
+  usage->maxrss = ru.ru_maxrss;
+  usage->nvcsw = ru.ru_nvcsw;
+  usage->nivcsw = ru.ru_nivcsw;
+  return pid;
+
+}
+
+/**
+ * Background thread that runs a body periodically, or as soon as it is woken
+ * up, until it is stopped. It is used by the log, the journal and the metrics.
+ *
+ * Signals are blocked in the thread, so that they are always handled by the
+ * threads of the engine. Forked children get a copy of the object but not the
+ * thread, so only the process that started it may wake it up or stop it. On
+ * exit, maybe from a signal handler that interrupted the body, the thread is
+ * left behind instead of waited for.
+ */
+class GreasyPeriodicThread {
+
+public:
+
+  /**
+    * Constructor of a thread not started yet.
+    */
+  GreasyPeriodicThread() : worker(NULL), stopping(false), ownerPid(0), interval(0) {
+
+    wakeup[0] = wakeup[1] = -1;
+
+  }
+
+  /**
+    * Destructor, which leaves the thread behind if it is still running.
+    */
+  ~GreasyPeriodicThread() {
+
+    thread* running = worker.load();
+    if (running && (getpid() == ownerPid)) running->detach();
+
+  }
+
+  /**
+    * Start the thread. The body is run every interval, and every time the thread is woken up.
+    * @param task The body of the thread.
+    * @param intervalMs Milliseconds between two runs of the body.
+    * @return True if the thread was started, false if it was already running or could not start.
+    */
+  bool start(const function<void()>& task, int intervalMs) {
+
+    sigset_t all, previous;
+
+    if (worker.load() || (intervalMs <= 0)) return false;
+    // The pipe outlives the thread, so that waking it up is always safe
+    if (wakeup[0] < 0) {
+      if (pipe(wakeup) != 0) return false;
+      fcntl(wakeup[0], F_SETFD, FD_CLOEXEC);
+      fcntl(wakeup[1], F_SETFD, FD_CLOEXEC);
+      fcntl(wakeup[1], F_SETFL, O_NONBLOCK);
+    }
+
+    body = task;
+    interval = intervalMs;
+    stopping = false;
+    ownerPid = getpid();
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    worker = new thread(&GreasyPeriodicThread::loop, this);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    return true;
+
+  }
+
+  /**
+    * Check if the thread is running in the calling process.
+    * @return True if it was started by this process and not stopped yet.
+    */
+  bool isRunning() { return worker.load() && (getpid() == ownerPid); }
+
+  /**
+    * Wake up the thread, so that it runs the body right away. It never blocks.
+    */
+  void wake() {
+
+    if (isRunning() && (::write(wakeup[1], "w", 1) < 0)) {}
+
+  }
+
+  /**
+    * Stop the thread and wait for it to finish the body it was running.
+    * It may be called from any thread, even from several at the same time.
+    */
+  void stop() {
+
+    thread* running;
+
+    if (getpid() != ownerPid) return;
+    running = worker.exchange(NULL);
+    if (!running) return;
+    stopping = true;
+    if (::write(wakeup[1], "q", 1) < 0) {}
+    running->join();
+    delete running;
+
+  }
+
+private:
+
+  /**
+    * Main loop of the thread.
+    */
+  void loop() {
+
+    struct pollfd pfd;
+    char discard[64];
+
+    pfd.fd = wakeup[0];
+    pfd.events = POLLIN;
+
+    for (;;) {
+      if (poll(&pfd, 1, interval) > 0) {
+        if (read(wakeup[0], discard, sizeof(discard)) < 0) {}
+      }
+      if (stopping) break;
+      body();
+    }
+
+  }
+
+  atomic<thread*> worker; /**< The thread, or NULL if not running. */
+  atomic<bool> stopping; /**< Whether the thread has to finish. */
+  pid_t ownerPid; /**< Process that started the thread. */
+  int interval; /**< Milliseconds between two runs of the body. */
+  int wakeup[2]; /**< Pipe to wake up the thread. */
+  function<void()> body; /**< Body of the thread. */
+
+};
 
 #endif
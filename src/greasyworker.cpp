@@ -0,0 +1,300 @@
+/* 
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ * 
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ * 
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+/**
+ * greasy-worker is the agent of the tcp engine. It connects to the greasy
+ * master, runs the tasks it receives in as many slots as it announces, and
+ * reports them back when they finish. Agents may join and leave at any time
+ * during the run.
+ */
+
+#include "greasytcp.h"
+#include "greasyutils.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#ifndef HOST_NAME_MAX
+#include <limits>
+#define HOST_NAME_MAX sysconf (_SC_HOST_NAME_MAX)
+#endif
+
+using namespace std;
+
+static int childPipe[2]; ///< Self pipe to wake up the poll when a task finishes.
+
+/**
+ * Task being run by the agent, until it ends.
+ */
+typedef struct {
+  int taskId; /**< Task being run. */
+  double start; /**< Time the task started. */
+  long long startDelay; /**< Microseconds from receiving the task to starting it. */
+} runningTask;
+
+static void childHandler(int sig) {
+
+  int saved = errno;
+  char c = 0;
+  if (write(childPipe[1], &c, 1) < 0) {}
+  errno = saved;
+
+}
+
+static void usage() {
+
+  cerr << "Usage: greasy-worker [-s slots] [-w seconds] [-t token] (-f addressfile | host:port)" << endl;
+  exit(1);
+
+}
+
+static double now() {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+
+}
+
+/**
+ * Read the address written by the master, waiting for it to appear.
+ */
+static bool readAddressFile(const string& file, int wait, string& host, string& port, string& token) {
+
+  double deadline = now() + wait;
+  string fileToken;
+
+  do {
+    ifstream in(file.c_str());
+    if (in >> host >> port >> fileToken) {
+      if (token.empty()) token = fileToken;
+      return true;
+    }
+    sleep(1);
+  } while (now() < deadline);
+
+  return false;
+
+}
+
+/**
+ * Connect to the master, retrying while it is not listening yet.
+ */
+static int connectMaster(const string& host, const string& port, int wait) {
+
+  struct addrinfo hints, *res, *ai;
+  double deadline = now() + wait;
+  int fd;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  do {
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) == 0) {
+      for (ai=res; ai!=NULL; ai=ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+          freeaddrinfo(res);
+          fcntl(fd, F_SETFD, FD_CLOEXEC);
+          return fd;
+        }
+        close(fd);
+      }
+      freeaddrinfo(res);
+    }
+    sleep(1);
+  } while (now() < deadline);
+
+  return -1;
+
+}
+
+static pid_t spawnTask(const string& command) {
+
+  pid_t pid = fork();
+
+  if (pid == 0) {
+    // Each task gets its own process group, so that it can be killed with all its children
+    setpgid(0, 0);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    execl("/bin/sh", "sh", "-c", command.c_str(), (char*) NULL);
+    _exit(127);
+  }
+
+  return pid;
+
+}
+
+int main(int argc, char *argv[]) {
+
+  int slots = 0, wait = 60, opt, fd;
+  string host, port, token, addressFile;
+  char hostname[HOST_NAME_MAX];
+  cpu_set_t cpus;
+  map<pid_t, runningTask> running;
+  map<pid_t, runningTask>::iterator it;
+  double woken;
+  string input;
+  vector<string> lines;
+  bool done = false;
+
+  if (getenv("GREASY_TCPTOKEN")) token = getenv("GREASY_TCPTOKEN");
+
+  while ((opt = getopt(argc, argv, "s:w:t:f:h")) != -1) {
+    switch (opt) {
+      case 's': fromString(slots, optarg); break;
+      case 'w': fromString(wait, optarg); break;
+      case 't': token = optarg; break;
+      case 'f': addressFile = optarg; break;
+      default: usage();
+    }
+  }
+
+  if (!addressFile.empty()) {
+    if (!readAddressFile(addressFile, wait, host, port, token)) {
+      cerr << "greasy-worker: could not read the master address from " << addressFile << endl;
+      return 1;
+    }
+  } else if (optind < argc) {
+    string address = argv[optind];
+    size_t colon = address.rfind(':');
+    if (colon == string::npos) usage();
+    host = address.substr(0, colon);
+    port = address.substr(colon + 1);
+  } else {
+    usage();
+  }
+
+  // By default, one slot for each cpu this process may run on
+  if (slots < 1) {
+    slots = 1;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) slots = CPU_COUNT(&cpus);
+  }
+  if (slots > TCP_MAX_SLOTS) {
+    cerr << "greasy-worker: at most " << TCP_MAX_SLOTS << " slots are allowed" << endl;
+    return 1;
+  }
+
+  fd = connectMaster(host, port, wait);
+  if (fd < 0) {
+    cerr << "greasy-worker: could not connect to " << host << ":" << port << endl;
+    return 1;
+  }
+
+  gethostname(hostname, sizeof(hostname));
+  if (!sendLine(fd, "HELLO " + toString(TCP_PROTOCOL_VERSION) + " " + toString(slots) + " " + token + " " + hostname)) {
+    cerr << "greasy-worker: could not say hello to " << host << ":" << port << endl;
+    return 1;
+  }
+
+  if (pipe(childPipe) != 0) return 1;
+  fcntl(childPipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(childPipe[1], F_SETFL, O_NONBLOCK);
+  fcntl(childPipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(childPipe[1], F_SETFD, FD_CLOEXEC);
+  signal(SIGCHLD, childHandler);
+  signal(SIGPIPE, SIG_IGN);
+
+  while (!done) {
+
+    struct pollfd fds[2];
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = childPipe[0];
+    fds[1].events = POLLIN;
+
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    // Tasks received or ended are noticed now
+    woken = now();
+
+    if (fds[1].revents) {
+      char drain[64];
+      int status;
+      pid_t pid;
+      taskUsage usage;
+      while (read(childPipe[0], drain, sizeof(drain)) > 0);
+      while ((pid = waitTask(-1, WNOHANG, &status, &usage)) > 0) {
+        it = running.find(pid);
+        if (it == running.end()) continue;
+        int retcode = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        sendLine(fd, "DONE " + toString(it->second.taskId) + " " + toString(retcode) + " "
+                 + toString((unsigned long) ((woken - it->second.start)*1e6)) + " " + toString(it->second.startDelay)
+                 + " " + toString((long long) ((now() - woken)*1e6)) + " " + usageFields(usage));
+        running.erase(it);
+      }
+    }
+
+    if (fds[0].revents) {
+      lines.clear();
+      if (!readLines(fd, input, lines, TCP_MAX_LINE)) {
+        cerr << "greasy-worker: lost the connection to the master" << endl;
+        break;
+      }
+      for (unsigned int i=0; i<lines.size(); i++) {
+        istringstream in(lines[i]);
+        string type, command;
+        int taskId;
+        in >> type;
+        if (type == "BYE") {
+          done = true;
+        } else if ((type == "TASK") && (in >> taskId)) {
+          getline(in >> ws, command);
+          pid_t pid = spawnTask(command);
+          if (pid > 0) {
+            running[pid].taskId = taskId;
+            running[pid].start = now();
+            running[pid].startDelay = (long long) ((running[pid].start - woken)*1e6);
+          } else {
+            taskUsage none;
+            clearUsage(none);
+            sendLine(fd, "DONE " + toString(taskId) + " -1 0 -1 -1 " + usageFields(none));
+          }
+        } else {
+          cerr << "greasy-worker: unexpected message from the master: " << lines[i] << endl;
+        }
+      }
+    }
+
+  }
+
+  // Nobody is waiting for the tasks still running
+  for (it=running.begin(); it!=running.end(); it++) kill(-it->first, SIGKILL);
+  close(fd);
+
+  return done ? 0 : 1;
+
+}
@@ -18,24 +18,60 @@
 */
 
 #include "mpiengine.h"
+#include "mpiworker.h"
 #include <csignal>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
+#include <climits>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <time.h>
 
 
-
-typedef struct {
-    int workerStatus;
-    int retcode;
-    unsigned long elapsed;
-    char hostname[MPI_MAX_PROCESSOR_NAME] ;
-} reportStruct;
-
+// Empty handler to wake up the master from its sleeps when a task finishes.
+static void childHandler(int sig) { }
 
 MPIEngine::MPIEngine ( const string& filename) : AbstractSchedulerEngine(filename){
 
   engineType="mpi";
   workerId = -1;
+  prefetchDepth = 0;
+  sentMessages = 0;
+  sentBytes = 0;
+  recvMessages = 0;
+  recvBytes = 0;
+  taskSlots = 1;
+  pollWait = false;
+  maxWaitSleep = 10000;
+  waitTime = 0;
+  waitCpu = 0;
+  delaySum = 0;
+  delayMax = 0;
+  waits = 0;
+  heartbeat = 0;
+  heartbeatRequested = false;
+  heartbeatTimeout = 0;
+  nextHeartbeatCheck = 0;
+  nlost = 0;
+  waveSize = 0;
+  firstWave = false;
+  selfScheduling = false;
+  chunkSize = 1;
+  mpiWorker = NULL;
+  nextTask = 0;
+  finishedTasks = 0;
+  retryWorker = -1;
+  nodeComm = MPI_COMM_NULL;
+  masterComm = MPI_COMM_WORLD;
+  hierarchical = false;
+  subMaster = false;
+  parentComm = MPI_COMM_NULL;
+  setupComm = MPI_COMM_WORLD;
+  spawnSize = 0;
+  spawnGroupsLeft = 1;
+  spawnThreshold = 4;
 
 }
 
@@ -51,44 +87,360 @@ bool MPIEngine::isWorker() {
 
 }
 
+bool MPIEngine::isSubMaster() {
+
+  return subMaster;
+
+}
+
 void MPIEngine::init() {
 
   //Dummy arguments for MPI::Init
   int argc=0;
   char **argv=NULL;
   int size = MPI_MAX_PROCESSOR_NAME;
-  char workerHost[MPI_MAX_PROCESSOR_NAME];
+  int defaultSlots;
+  int nodeRank, nodeSize, nodeLeader;
+  helloStruct hello;
+  vector<helloStruct> hellos;
 
-  log->record(GreasyLog::devel, "MPIEngine::init", "Entering...");
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::init", "Entering...");
 
   MPI_Init(&argc, &argv);
   MPI_Comm_rank(MPI_COMM_WORLD, &workerId);
   MPI_Comm_size(MPI_COMM_WORLD, &nworkers);
 
+  // Ranks spawned by the master to grow the pool of workers talk to it through
+  // a communicator merged with it, and get their worker ids from it.
+  MPI_Comm_get_parent(&parentComm);
+  if (parentComm != MPI_COMM_NULL) {
+    int first;
+    MPI_Intercomm_merge(parentComm, 1, &masterComm);
+    MPI_Bcast(&first, 1, MPI_INT, 0, masterComm);
+    workerId += first;
+    setupComm = masterComm;
+  }
+
+  //Get the name of the node of this rank
+  MPI_Get_processor_name(hostname,&size);
+
   // We don't count the master
   nworkers--;
 
-  // Only the master has to perform the initialization of tasks.
-  if (isMaster()) {
-//  	log->record(GreasyLog::info, "Running with " +toString(nworkers) + " workers");
-    AbstractSchedulerEngine::init();
-		MPIEngine::executionSummary();
-  } else {
+  // Find the ranks sharing the node. The one with the lowest rank leads it.
+  MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &nodeComm);
+  MPI_Comm_rank(nodeComm, &nodeRank);
+  MPI_Comm_size(nodeComm, &nodeSize);
+  MPI_Allreduce(&workerId, &nodeLeader, 1, MPI_INT, MPI_MIN, nodeComm);
+
+  defaultSlots = getDefaultTaskSlots();
+
+  // In hierarchical mode, the workers of every node but the one of the master
+  // talk to a sub-master in their node instead of the master.
+  hierarchical = (config->getValue("MPIHierarchical") == "yes");
+  if (hierarchical && (parentComm == MPI_COMM_NULL) && (nodeLeader != 0) && (nodeSize > 1)) {
+    if (workerId == nodeLeader) subMaster = true;
+    else masterComm = nodeComm;
+  }
+
+  // Setup the heartbeats, which both the master and the workers need to know
+  if (config->keyExists("MPIHeartbeat")) fromString(heartbeat, config->getValue("MPIHeartbeat"));
+  if (heartbeat < 0) heartbeat = 0;
+  heartbeatTimeout = 3*heartbeat;
+  if (config->keyExists("MPIHeartbeatTimeout")) fromString(heartbeatTimeout, config->getValue("MPIHeartbeatTimeout"));
+  if (heartbeatTimeout < heartbeat) heartbeatTimeout = heartbeat;
+  // Heartbeats cannot go through node sub-masters. The master refuses to
+  // run with both, and meanwhile no rank sends them.
+  heartbeatRequested = (heartbeat > 0);
+  if (hierarchical) heartbeat = 0;
+
+  if (isWorker()) {
 
     // Disable signal handling for workers.
     // We only want to have the master in charge of the restarts and messages.
     signal(SIGTERM, SIG_DFL);
     signal(SIGINT, SIG_DFL);
 
-    //Get the name of the node of this worker
-    int size = MPI_MAX_PROCESSOR_NAME;
-    MPI_Get_processor_name(hostname,&size);
+    // Setup the number of tasks to run at the same time
+    if (config->getValue("MPIWorkerSlots") == "auto") taskSlots = defaultSlots;
+    else if (config->keyExists("MPIWorkerSlots")) fromString(taskSlots, config->getValue("MPIWorkerSlots"));
+    if (taskSlots < 1) taskSlots = 1;
 
+  }
+
+  // The master only schedules, unless it is asked to run tasks in slots of its own
+  if (isMaster()) {
+    taskSlots = 0;
+    if (config->getValue("MPIMasterSlots") == "auto") taskSlots = defaultSlots;
+    else if (config->keyExists("MPIMasterSlots")) fromString(taskSlots, config->getValue("MPIMasterSlots"));
+    if (taskSlots < 0) taskSlots = 0;
+  }
+
+  // A node sub-master offers the slots of all the workers of its node
+  if (hierarchical) {
+    localCapacity.resize(nodeSize);
+    MPI_Gather(&taskSlots, 1, MPI_INT, &localCapacity[0], 1, MPI_INT, 0, nodeComm);
+    if (subMaster) {
+      localCapacity[0] = 0;
+      taskSlots = 0;
+      for (int rank=1; rank<nodeSize; rank++) taskSlots += localCapacity[rank];
+    }
+  }
+
+  // Workers tell the master their protocol version, slots and hostname
+  // only once, so that they don't need to travel with every report.
+  memset(&hello, 0, sizeof(helloStruct));
+  hello.version = MPI_PROTOCOL_VERSION;
+  hello.slots = taskSlots;
+  hello.leader = (masterComm == nodeComm) ? nodeLeader : 0;
+  snprintf(hello.hostname, sizeof(hello.hostname), "%s", hostname);
+  if (isMaster()) hellos.resize(nworkers+1);
+  MPI_Gather(&hello, sizeof(helloStruct), MPI_BYTE, isMaster() ? &hellos[0] : NULL, sizeof(helloStruct), MPI_BYTE, 0, setupComm);
+
+  // Only the master has to perform the initialization of tasks.
+  if (isMaster()) {
+//  	LOG_RECORD(log, GreasyLog::info, "Running with " +toString(nworkers) + " workers");
+    workerHosts.resize(nworkers+1);
+    workerCapacity.resize(nworkers+1);
+    workerLeader.resize(nworkers+1);
+    workerComms.assign(nworkers+1, MPI_COMM_WORLD);
+    workerRanks.resize(nworkers+1);
+    for (int worker=0; worker<=nworkers; worker++) {
+      workerRanks[worker] = worker;
+      workerHosts[worker] = string(hellos[worker].hostname);
+      workerLeader[worker] = hellos[worker].leader;
+      // Workers behind a node sub-master get their tasks through it
+      workerCapacity[worker] = (workerLeader[worker] == 0) ? hellos[worker].slots : 0;
+    }
+
+    // Setup how to wait for the workers. Blocking in MPI usually keeps a cpu busy,
+    // while polling sleeps between checks, up to the latency given.
+    if (config->keyExists("MPIWaitMode")) {
+      if (config->getValue("MPIWaitMode") == "poll") pollWait = true;
+      else if (config->getValue("MPIWaitMode") != "block")
+        LOG_RECORD(log, GreasyLog::warning, "Unknown MPIWaitMode " + config->getValue("MPIWaitMode") + ". Using block");
+    }
+    if (config->keyExists("MPIWaitLatency")) {
+      fromString(maxWaitSleep, config->getValue("MPIWaitLatency"));
+      maxWaitSleep = max(1, maxWaitSleep)*1000;
+    }
+    if (pollWait) LOG_RECORD(log, GreasyLog::debug, "Master polls for workers with a latency up to " + toString(maxWaitSleep/1000) + " ms");
+
+    // Each worker has a slot for every task it runs plus the ones queued in advance
+    if (config->keyExists("MPIPrefetchDepth")) fromString(prefetchDepth, config->getValue("MPIPrefetchDepth"));
+    if (prefetchDepth < 0) prefetchDepth = 0;
+    AbstractSchedulerEngine::init();
+    if (prefetchDepth > 0)
+      LOG_RECORD(log, GreasyLog::info, "Workers will queue up to " + toString(prefetchDepth) + " tasks in advance");
+    if (getConcurrency() - workerCapacity[0] != nworkers)
+      LOG_RECORD(log, GreasyLog::info, "Workers offer " + toString(getConcurrency() - workerCapacity[0]) + " task slots");
+
+    // The slots of the master go last, so that tasks are given to the workers first
+    for (int slot=0; slot<workerCapacity[0]; slot++) {
+      freeWorkers.push(0);
+      nslots++;
+    }
+    if (workerCapacity[0] > 0)
+      LOG_RECORD(log, GreasyLog::info, "Master runs up to " + toString(workerCapacity[0]) + " tasks at the same time");
+
+    // Workers that miss their heartbeats are given up instead of waiting forever.
+    // Errors talking to them must not abort the whole run.
+    lastSeen.assign(nworkers+1, MPI_Wtime());
+    lostWorkers.assign(nworkers+1, false);
+    if (heartbeat > 0) {
+      MPI_Comm_set_errhandler(MPI_COMM_WORLD, MPI_ERRORS_RETURN);
+      LOG_RECORD(log, GreasyLog::info, "Workers send heartbeats every " + toString(heartbeat) + " s, and are given up after "
+                  + toString(heartbeatTimeout) + " s without news");
+    }
+
+    for (int worker=1; worker<=nworkers; worker++) {
+      if (workerLeader[worker] != 0)
+        LOG_RECORD(log, GreasyLog::debug, "Worker " + toString(worker) + " on node " + workerHosts[worker]
+                    + " gets its tasks through node sub-master " + toString(workerLeader[worker]));
+      else if ((worker < nworkers) && (workerLeader[worker+1] == worker))
+        LOG_RECORD(log, GreasyLog::debug, "Node sub-master " + toString(worker) + " on node " + workerHosts[worker]
+                    + " schedules up to " + toString(workerCapacity[worker]) + " tasks at the same time");
+      else
+        LOG_RECORD(log, GreasyLog::debug, "Worker " + toString(worker) + " on node " + workerHosts[worker]
+                    + " runs up to " + toString(workerCapacity[worker]) + " tasks at the same time");
+      if (hellos[worker].version != MPI_PROTOCOL_VERSION) {
+        LOG_RECORD(log, GreasyLog::error, "Worker " + toString(worker) + " on node " + workerHosts[worker]
+                    + " uses a different protocol version (" + toString(hellos[worker].version) + ")");
+        ready = false;
+      }
+    }
+
+    // Groups of workers may be spawned while many tasks are waiting for a slot
+    if (config->keyExists("MPISpawnWorkers")) fromString(spawnSize, config->getValue("MPISpawnWorkers"));
+    if (config->keyExists("MPISpawnGroups")) fromString(spawnGroupsLeft, config->getValue("MPISpawnGroups"));
+    if (config->keyExists("MPISpawnThreshold")) fromString(spawnThreshold, config->getValue("MPISpawnThreshold"));
+    if (config->keyExists("MPISpawnHosts")) spawnHosts = config->getValue("MPISpawnHosts");
+
+    // Options that cannot work together stop the run, instead of silently
+    // leaving one of them out
+    if (hierarchical && heartbeatRequested) {
+      LOG_RECORD(log, GreasyLog::error, "MPIHeartbeat cannot be used with MPIHierarchical");
+      ready = false;
+    }
+    if ((config->getValue("MPISelfScheduling") == "yes")
+        && (heartbeatRequested || (workerCapacity[0] > 0) || hierarchical || (spawnSize > 0))) {
+      LOG_RECORD(log, GreasyLog::error, "MPISelfScheduling cannot be used with MPIHeartbeat, MPIMasterSlots, "
+                  "MPIHierarchical or MPISpawnWorkers");
+      ready = false;
+    }
+
+    // Without dependencies, the workers can take the tasks themselves
+    if (ready && (config->getValue("MPISelfScheduling") == "yes")) {
+      selfScheduling = true;
+      for (set<int>::iterator it=validTasks.begin(); it!=validTasks.end(); it++) {
+        if (taskMap[*it]->hasDependencies()) selfScheduling = false;
+      }
+      if (!selfScheduling) LOG_RECORD(log, GreasyLog::warning, "Self scheduling is not possible with dependencies. Using the master");
+    }
+
+    if (ready && (spawnSize > 0) && (spawnGroupsLeft > 0))
+      LOG_RECORD(log, GreasyLog::info, "Up to " + toString(spawnGroupsLeft) + " groups of " + toString(spawnSize)
+                  + " workers will be spawned when more than " + toString(spawnThreshold) + " tasks per slot are waiting");
+
+		MPIEngine::executionSummary();
+  } else {
     //Worker at this point is ready.
     ready = true;
+    mpiWorker = new MPIWorker(workerId, hostname, masterComm, taskSlots, heartbeat);
   }
 
-  log->record(GreasyLog::devel, "MPIEngine::init", "Exiting...");
+  broadcastTaskTable(setupComm);
+
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::init", "Exiting...");
+
+}
+
+void MPIEngine::broadcastTaskTable(MPI_Comm comm) {
+
+  int sizes[3] = {0, 0, 0};
+  int id, length;
+  string command;
+  vector<char> table;
+  set<int>::iterator it;
+
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::broadcastTaskTable", "Entering...");
+
+  // The table is a sequence of task id, command length and command.
+  // Tasks completed in a previous run are left out.
+  if (isMaster()) {
+    for (it=validTasks.begin(); it!=validTasks.end(); it++) {
+      id = *it;
+      if (taskMap[id]->getTaskState() == GreasyTask::completed) continue;
+      command = getTaskCommand(taskMap[id]);
+      length = command.size();
+      table.insert(table.end(), (char*)&id, (char*)&id + sizeof(int));
+      table.insert(table.end(), (char*)&length, (char*)&length + sizeof(int));
+      table.insert(table.end(), command.begin(), command.end());
+    }
+    sizes[0] = table.size();
+    // Node sub-masters do not take part in the first wave, so they get
+    // all their tasks the usual way. Neither do spawned workers, which
+    // join when the run is already going.
+    if (!selfScheduling && !hierarchical && (comm == MPI_COMM_WORLD)) {
+      for (int worker=1; worker<=nworkers; worker++) sizes[1] = max(sizes[1], getWorkerSlots(worker));
+    }
+    sizes[2] = selfScheduling;
+  }
+
+  MPI_Bcast(sizes, 3, MPI_INT, 0, comm);
+  table.resize(sizes[0]);
+  if (sizes[0] > 0) MPI_Bcast(&table[0], sizes[0], MPI_BYTE, 0, comm);
+
+  if (isMaster() && (comm != MPI_COMM_WORLD)) {
+    sentBytes += sizes[0];
+    LOG_RECORD(log, GreasyLog::devel, "MPIEngine::broadcastTaskTable", "Exiting...");
+    return;
+  }
+  waveSize = sizes[1];
+  selfScheduling = sizes[2];
+
+  if (isMaster()) {
+    LOG_RECORD(log, GreasyLog::debug, "Sent the commands of " + toString(validTasks.size()) + " tasks ("
+                + toString(sizes[0]) + " bytes) to all workers");
+    sentBytes += sizes[0];
+    // The first allocations are held until the scheduler waits for the first time
+    firstWave = (waveSize > 0);
+    firstWaveTasks.assign((nworkers+1)*waveSize, -1);
+    firstWaveCount.assign(nworkers+1, 0);
+  } else {
+    for (int pos=0; pos<sizes[0]; pos+=2*sizeof(int)+length) {
+      memcpy(&id, &table[pos], sizeof(int));
+      memcpy(&length, &table[pos+sizeof(int)], sizeof(int));
+      mpiWorker->addTask(id, string(&table[pos+2*sizeof(int)], length));
+    }
+  }
+
+  // The master exposes the index of the next task, and the workers take
+  // the tasks in the order of the table.
+  if (selfScheduling) {
+    if (config->keyExists("MPIChunkSize")) fromString(chunkSize, config->getValue("MPIChunkSize"));
+    if (chunkSize < 1) chunkSize = 1;
+    MPI_Win_create(&nextTask, isMaster() ? sizeof(int) : 0, sizeof(int), MPI_INFO_NULL, MPI_COMM_WORLD, &taskWindow);
+    if (isMaster()) LOG_RECORD(log, GreasyLog::info, "Workers take the tasks themselves, " + toString(chunkSize) + " at a time");
+  }
+
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::broadcastTaskTable", "Exiting...");
+
+}
+
+void MPIEngine::scatterFirstWave() {
+
+  if (!firstWave) return;
+  firstWave = false;
+
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::scatterFirstWave", "Entering...");
+
+  if (waveSize > 0) {
+    MPI_Scatter(&firstWaveTasks[0], waveSize, MPI_INT, MPI_IN_PLACE, waveSize, MPI_INT, 0, MPI_COMM_WORLD);
+    sentMessages += nworkers;
+    sentBytes += nworkers*waveSize*sizeof(int);
+  }
+  firstWaveTasks.clear();
+
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::scatterFirstWave", "Exiting...");
+
+}
+
+string MPIEngine::getTaskCommand(GreasyTask* task) {
+
+  if (task->hasWorkDir()) return "cd " + task->getWorkDir() + " && " + task->getCommand();
+  return task->getCommand();
+
+}
+
+int MPIEngine::getWorkerSlots(int worker) {
+
+  // Workers behind a node sub-master are not scheduled by the master
+  if (workerCapacity[worker] == 0) return 0;
+  return workerCapacity[worker] + prefetchDepth;
+
+}
+
+int MPIEngine::getConcurrency() {
+
+  int slots = 0;
+  for (int worker=0; worker<(int) workerCapacity.size(); worker++) slots += workerCapacity[worker];
+  return slots;
+
+}
+
+int MPIEngine::getDefaultTaskSlots() {
+
+  int nodeRanks = 1;
+  int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  cpu_set_t mask;
+
+  // Respect the cpus the launcher gave us, if any
+  if (sched_getaffinity(0, sizeof(cpu_set_t), &mask) == 0) cpus = CPU_COUNT(&mask);
+
+  MPI_Comm_size(nodeComm, &nodeRanks);
+
+  return max(1, cpus/nodeRanks);
 
 }
 
@@ -98,25 +450,61 @@ void MPIEngine::finalize() {
     // At this point all tasks have finished and all nodes are free
     // Let's fire the workers!
     fireWorkers();
+    if (selfScheduling) {
+      int claimed;
+      MPI_Win_lock(MPI_LOCK_SHARED, 0, 0, taskWindow);
+      MPI_Get(&claimed, 1, MPI_INT, 0, 0, 1, MPI_INT, taskWindow);
+      MPI_Win_unlock(0, taskWindow);
+      LOG_RECORD(log, GreasyLog::debug, "Workers claimed tasks up to index " + toString(claimed));
+    }
+    LOG_RECORD(log, GreasyLog::info, "Master sent " + toString(sentMessages) + " messages (" + toString(sentBytes)
+                + " bytes) and received " + toString(recvMessages) + " messages (" + toString(recvBytes) + " bytes)");
+    if (waits > 0) {
+      string cost = "Master waited " + toString(waitTime) + " s for workers using " + toString(waitCpu) + " s of cpu ("
+                    + toString(waitTime > 0 ? (int)(100*waitCpu/waitTime) : 0) + "%) in " + (pollWait ? "poll" : "block") + " mode";
+      if (pollWait) cost += ". Detection delay up to " + toString(delayMax*1000) + " ms (" + toString(delaySum*1000/waits) + " ms on average)";
+      LOG_RECORD(log, GreasyLog::info, cost);
+    }
     // The master has to do some cleanup.
     AbstractSchedulerEngine::finalize();
+
+    // Lost workers would never join the finalization, so end them all
+    if (nlost > 0) {
+      LOG_RECORD(log, GreasyLog::warning, toString(nlost) + " workers were lost. Aborting the remaining ranks");
+      // The restart is already written, so the signals sent by the launcher must not write it again
+      signal(SIGTERM, SIG_DFL);
+      signal(SIGINT, SIG_DFL);
+      // The abort kills this process too, before the log writer gets to run
+      log->flush();
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
   }
 
+  delete mpiWorker;
+  mpiWorker = NULL;
+  if (selfScheduling) MPI_Win_free(&taskWindow);
+  MPI_Comm_free(&nodeComm);
+  if (parentComm != MPI_COMM_NULL) {
+    MPI_Comm_free(&masterComm);
+    MPI_Comm_disconnect(&parentComm);
+  }
   MPI_Finalize();
 
 }
 
 void MPIEngine::run() {
 
-  log->record(GreasyLog::devel, "MPIEngine::run", "Entering...");
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::run", "Entering...");
 
   if (isReady()) {
     if (isMaster()) runMaster();
-    else if (isWorker()) runWorker();
-    else log->record(GreasyLog::error,  "Could not run MPI engine");
+    else if (isSubMaster()) mpiWorker->runSubMaster(nodeComm, localCapacity);
+    else if (isWorker() && selfScheduling) mpiWorker->runSelfScheduled(taskWindow, chunkSize);
+    else if (isWorker()) mpiWorker->runWorker(waveSize);
+    else LOG_RECORD(log, GreasyLog::error,  "Could not run MPI engine");
   }
 
-  log->record(GreasyLog::devel, "MPIEngine::run", "Exiting...");
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::run", "Exiting...");
 
 }
 
@@ -127,11 +515,50 @@ void MPIEngine::run() {
 
 void MPIEngine::runMaster() {
 
-  log->record(GreasyLog::devel, "MPIEngine::runMaster", "Entering...");
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::runMaster", "Entering...");
+
+  if (taskSlots > 0) signal(SIGCHLD, childHandler);
+
+  if (selfScheduling) runSelfScheduler();
+  else runScheduler();
 
-  runScheduler();
+  signal(SIGCHLD, SIG_DFL);
 
-  log->record(GreasyLog::devel, "MPIEngine::runMaster", "Exiting...");
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::runMaster", "Exiting...");
+
+}
+
+void MPIEngine::runSelfScheduler() {
+
+  set<int>::iterator it;
+
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::runSelfScheduler", "Entering...");
+
+  if (nworkers == 0) {
+    LOG_RECORD(log, GreasyLog::error, "No workers found. Rerun greasy with more resources");
+    return;
+  }
+
+  globalTimer.start();
+  lockState();
+
+  // All the tasks are taken by the workers as soon as they can, but the
+  // ones completed in a previous run
+  for (it=validTasks.begin(); it!=validTasks.end(); it++) {
+    if (taskMap[*it]->getTaskState() == GreasyTask::completed) finishedTasks++;
+    else taskMap[*it]->setTaskState(GreasyTask::running);
+  }
+
+  while (finishedTasks < validTasks.size()) {
+    GreasyTrace::getInstance()->beginWait();
+    waitForAnyWorker();
+    GreasyTrace::getInstance()->endWait();
+  }
+
+  unlockState();
+  globalTimer.stop();
+
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::runSelfScheduler", "Exiting...");
 
 }
 
@@ -143,84 +570,584 @@ void MPIEngine::writeRestartFile() {
 
 void MPIEngine::allocate(GreasyTask* task) {
 
-  int worker, cmdSize;
+  int worker;
 
-  log->record(GreasyLog::devel, "MPIEngine::allocate", "Entering...");
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::allocate", "Entering...");
 
-  worker = freeWorkers.front();
-  freeWorkers.pop();
+  // When self scheduling, only retries are allocated, to the worker that reported the failure
+  if (selfScheduling) {
+    worker = retryWorker;
+  } else {
+    worker = freeWorkers.front();
+    freeWorkers.pop();
+  }
 
-  log->record(GreasyLog::info,  "Allocating task " + toString(task->getTaskNum()) + " located in line "+ toString(task->getTaskId()) + " to Worker " + toString(worker));
+  LOG_RECORDF(log, GreasyLog::info, "", "Allocating task %d located in line %d to Worker %d", task->getTaskNum(), task->getTaskId(), worker);
 
-  taskAssignation[worker] = task->getTaskId();
   task->setTaskState(GreasyTask::running);
+  task->setWorker(worker);
+  task->setHostname(workerHosts[worker]);
+  notifyTaskEvent(GreasyEvents::dispatched, task);
+
+  LOG_RECORD(log, GreasyLog::debug,  "Task " + toString(task->getTaskNum()) + " located in line "+ toString(task->getTaskId()) + " to Worker " + toString(worker) + " wants to execute " + getTaskCommand(task));
+
+  if (worker == 0) {
+    // The master runs the task itself in one of its own slots
+    pid_t pid = MPIWorker::spawnTask(getTaskCommand(task));
+    if (pid > 0) {
+      localTasks[pid].first = task->getTaskId();
+      localTasks[pid].second.reset();
+      localTasks[pid].second.start();
+      notifyTaskEvent(GreasyEvents::started, task);
+    } else {
+      LOG_RECORD(log, GreasyLog::error,  "Could not execute a new process");
+      task->setTaskState(GreasyTask::failed);
+      task->setReturnCode(-1);
+      freeWorkers.push(worker);
+      notifyTaskEvent(GreasyEvents::finished, task);
+      updateDependencies(task);
+    }
+    LOG_RECORD(log, GreasyLog::devel, "MPIEngine::allocate", "Exiting...");
+    return;
+  }
 
-  if(task->hasWorkDir()) {
-    string command = "cd " + task->getWorkDir() + " && " + task->getCommand();
-    task->setCommand(command);
+  // Workers run their tasks in the same order they receive them
+  workerQueues[worker].push_back(task->getTaskId());
+
+  // The first tasks of every worker go together in a single scatter
+  if (firstWave) {
+    firstWaveTasks[worker*waveSize + firstWaveCount[worker]++] = task->getTaskId();
+    LOG_RECORD(log, GreasyLog::devel, "MPIEngine::allocate", "Exiting...");
+    return;
   }
-  log->record(GreasyLog::debug,  "Task " + toString(task->getTaskNum()) + " located in line "+ toString(task->getTaskId()) + " to Worker " + toString(worker) + " wants to execute " + task->getCommand());
 
-  // Send the command size and the actual command
-  cmdSize = task->getCommand().size()+1;
-  MPI_Send(&cmdSize, 1, MPI_INT, worker, 0, MPI_COMM_WORLD);
-  MPI_Send((void*) task->getCommand().c_str(), cmdSize, MPI_BYTE, worker, 0, MPI_COMM_WORLD);
+  // The tasks given to the same worker before the master waits again
+  // travel together in a single message
+  outgoingTasks[worker].push_back(task->getTaskId());
+
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::allocate", "Exiting...");
+
+}
 
-  log->record(GreasyLog::devel, "MPIEngine::allocate", "Exiting...");
+void MPIEngine::sendTasks() {
+
+  msgHeader header;
+  map<int, vector<int> >::iterator it;
+
+  header.version = MPI_PROTOCOL_VERSION;
+  header.type = taskMessage;
+
+  releaseSends(false);
+
+  // Workers already know the commands, so only the task ids are sent, without
+  // waiting for the worker, which may still be busy with previous tasks.
+  for (it=outgoingTasks.begin(); it!=outgoingTasks.end(); it++) {
+    for (unsigned int first=0; first<it->second.size(); first+=USHRT_MAX) {
+      header.count = min((unsigned int)it->second.size() - first, (unsigned int)USHRT_MAX);
+      header.taskId = it->second[first];
+      pendingSends.push_back(pendingSend());
+      pendingSend& send = pendingSends.back();
+      send.worker = it->first;
+      send.buffer.resize(sizeof(msgHeader) + header.count*sizeof(int));
+      memcpy(&send.buffer[0], &header, sizeof(msgHeader));
+      memcpy(&send.buffer[sizeof(msgHeader)], &it->second[first], header.count*sizeof(int));
+      MPI_Isend(&send.buffer[0], send.buffer.size(), MPI_BYTE, workerRanks[it->first], 0, workerComms[it->first], &send.request);
+      sentMessages++;
+      sentBytes += send.buffer.size();
+    }
+  }
+  outgoingTasks.clear();
 
 }
 
 void MPIEngine::waitForAnyWorker() {
 
-  int retcode;
-  int worker;
+  int worker, msgSize;
   GreasyTask* task = NULL;
   MPI_Status status;
-  reportStruct report;
+  msgHeader header;
+  reportEntry report;
+  vector<char> message;
+  deque<int>::iterator it;
+
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::waitForAnyWorker", "Entering...");
+
+  LOG_RECORD(log, GreasyLog::debug,  "Waiting for any task to complete...");
+  scatterFirstWave();
+  sendTasks();
+
+  // Instead of waiting, grow when too many tasks are waiting for a slot
+  if (needMoreWorkers()) {
+    growWorkers();
+    LOG_RECORD(log, GreasyLog::devel, "MPIEngine::waitForAnyWorker", "Exiting...");
+    return;
+  }
+
+  worker = probeAnyWorker(&status);
+  if (worker < 0) {
+    collectLocalTasks();
+    LOG_RECORD(log, GreasyLog::devel, "MPIEngine::waitForAnyWorker", "Exiting...");
+    return;
+  }
+  MPI_Get_count(&status, MPI_BYTE, &msgSize);
+  message.resize(msgSize);
+  MPI_Recv(&message[0], msgSize, MPI_BYTE, workerRanks[worker], 0, workerComms[worker], &status);
+  recvMessages++;
+  recvBytes += msgSize;
+  lastSeen[worker] = MPI_Wtime();
+
+  // The tasks of a lost worker already run elsewhere
+  if (lostWorkers[worker]) {
+    LOG_RECORD(log, GreasyLog::warning, "Ignoring message from lost worker " + toString(worker));
+    return;
+  }
+
+  memcpy(&header, &message[0], sizeof(msgHeader));
+  if ((header.type == heartbeatMessage)&&(msgSize == sizeof(msgHeader))) {
+    LOG_RECORD(log, GreasyLog::devel, "MPIEngine::waitForAnyWorker", "Heartbeat from worker " + toString(worker));
+    return;
+  }
+  if ((header.type != reportMessage)||(msgSize != (int) (sizeof(msgHeader) + header.count*sizeof(reportEntry)))) {
+    LOG_RECORD(log, GreasyLog::error, "Unexpected message from worker " + toString(worker));
+    return;
+  }
+
+  // A single message may carry the reports of several tasks finished close together
+  for (int i=0; i<header.count; i++) {
+    memcpy(&report, &message[sizeof(msgHeader) + i*sizeof(reportEntry)], sizeof(reportEntry));
+
+    // Only the tasks the worker still owes are accepted. Any other report
+    // would finish twice a task that was given up and runs elsewhere.
+    it = find(workerQueues[worker].begin(), workerQueues[worker].end(), report.taskId);
+    if ((taskMap.find(report.taskId) == taskMap.end()) || (!selfScheduling && (it == workerQueues[worker].end()))) {
+      LOG_RECORD(log, GreasyLog::warning, "Ignoring report of task in line " + toString(report.taskId) + " from worker "
+                  + toString(worker) + ", which was not running it");
+      continue;
+    }
+    if (it != workerQueues[worker].end()) workerQueues[worker].erase(it);
+    task = taskMap[report.taskId];
+
+    // Push worker to the free workers queue again
+    if (!selfScheduling) freeWorkers.push(worker);
+
+    // Update task info with the report
+    task->setElapsedTime(report.elapsed);
+    task->setReturnCode(report.retcode);
+    task->setUsage(report.usage);
+    task->setDelays(report.startDelay, report.noticeDelay);
+    task->setHostname(workerHosts[worker]);
+    task->setWorker(worker);
+
+    retryWorker = worker;
+    taskEpilogue(task);
+    if ((task->getTaskState() == GreasyTask::completed)||(task->getTaskState() == GreasyTask::failed)) finishedTasks++;
+  }
+
+  // Spawned workers are not kept once there is nothing left for them
+  if (!spawnGroups.empty() && taskQueue.empty()) retireIdleGroups();
+
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::waitForAnyWorker", "Exiting...");
+
+}
+
+int MPIEngine::probeAnyWorker(MPI_Status *status) {
+
+  int worker = -1;
+  int sleep = 0;
+  double start = MPI_Wtime();
+  struct timespec cpuStart, cpuEnd;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpuStart);
+
+  // The state of the tasks is left alone while sleeping, for interruptions
+  if (!pollWait && localTasks.empty() && (heartbeat == 0) && spawnGroups.empty()) {
+    unlockState();
+    MPI_Probe(MPI_ANY_SOURCE, 0, MPI_COMM_WORLD, status);
+    lockState();
+    worker = status->MPI_SOURCE;
+  } else {
+    // Sleep between checks, longer the more we wait, so that long tasks
+    // cost almost no cpu while short ones are still noticed quickly.
+    // The tasks of the master interrupt the sleep when they finish.
+    // Deadlines are only checked with no message pending, so that a busy
+    // master does not give up workers whose heartbeats are just queued.
+    // Spawned workers are on communicators of their own, so they can only
+    // be polled.
+    worker = iprobeWorkers(status);
+    while ((worker < 0) && !localTaskFinished() && !checkHeartbeats()) {
+      sleep = (sleep == 0) ? 50 : min(2*sleep, maxWaitSleep);
+      unlockState();
+      usleep(sleep);
+      lockState();
+      worker = iprobeWorkers(status);
+    }
+  }
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpuEnd);
+  waits++;
+  waitTime += MPI_Wtime() - start;
+  waitCpu += (cpuEnd.tv_sec - cpuStart.tv_sec) + (cpuEnd.tv_nsec - cpuStart.tv_nsec)/1e9;
+  delaySum += sleep/1e6;
+  delayMax = max(delayMax, sleep/1e6);
+
+  return worker;
+
+}
+
+int MPIEngine::iprobeWorkers(MPI_Status *status) {
+
+  int arrived = 0;
+  list<spawnGroup>::iterator it;
+
+  MPI_Iprobe(MPI_ANY_SOURCE, 0, MPI_COMM_WORLD, &arrived, status);
+  if (arrived) return status->MPI_SOURCE;
+
+  for (it=spawnGroups.begin(); it!=spawnGroups.end(); it++) {
+    MPI_Iprobe(MPI_ANY_SOURCE, 0, it->comm, &arrived, status);
+    if (arrived) return it->first + status->MPI_SOURCE - 1;
+  }
+
+  return -1;
+
+}
+
+bool MPIEngine::localTaskFinished() {
+
+  siginfo_t info;
+
+  if (localTasks.empty()) return false;
+
+  info.si_pid = 0;
+  return ((waitid(P_ALL, 0, &info, WEXITED|WNOHANG|WNOWAIT) == 0) && (info.si_pid != 0));
+
+}
+
+void MPIEngine::collectLocalTasks() {
+
+  int retcode;
+  pid_t pid;
+  taskUsage usage;
+  GreasyTask* task = NULL;
+
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::collectLocalTasks", "Entering...");
+
+  while ((pid = waitTask(-1, WNOHANG, &retcode, &usage)) > 0) {
+    if (localTasks.find(pid) == localTasks.end()) continue;
+
+    // Update task info as a worker report would do
+    task = taskMap[localTasks[pid].first];
+    localTasks[pid].second.stop();
+    task->setElapsedTime(localTasks[pid].second.usecsElapsed());
+    task->setReturnCode(retcode);
+    task->setHostname(workerHosts[0]);
+    task->setUsage(usage);
+    task->setDelays(-1, -1);
+    localTasks.erase(pid);
+
+    freeWorkers.push(0);
+    taskEpilogue(task);
+  }
+
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::collectLocalTasks", "Exiting...");
+
+}
+
+bool MPIEngine::checkHeartbeats() {
+
+  bool lost = false;
+  double now;
+
+  if (heartbeat == 0) return false;
+
+  now = MPI_Wtime();
+  if (now < nextHeartbeatCheck) return false;
+  nextHeartbeatCheck = now + heartbeat/4;
+
+  for (int worker=1; worker<(int) lastSeen.size(); worker++) {
+    if (!lostWorkers[worker] && (now - lastSeen[worker] > heartbeatTimeout)) {
+      loseWorker(worker);
+      lost = true;
+    }
+  }
+
+  return lost;
+
+}
+
+void MPIEngine::loseWorker(int worker) {
+
+  int maxRetries = 0;
+  GreasyTask* task = NULL;
+  queue<int> alive;
+  deque<int>::iterator it;
+
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::loseWorker", "Entering...");
+
+  LOG_RECORD(log, GreasyLog::error, "Worker " + toString(worker) + " on node " + workerHosts[worker] + " sent nothing for "
+              + toString(heartbeatTimeout) + " s. Giving it up");
+  lostWorkers[worker] = true;
+  nlost++;
 
-  log->record(GreasyLog::devel, "MPIEngine::waitForAnyWorker", "Entering...");
+  // Its slots will never be free again
+  while (!freeWorkers.empty()) {
+    if (freeWorkers.front() != worker) alive.push(freeWorkers.front());
+    freeWorkers.pop();
+  }
+  freeWorkers.swap(alive);
+  nslots -= getWorkerSlots(worker);
+
+  // Run its tasks elsewhere. A task lost too many times may be the one
+  // killing the workers, so it fails instead.
+  if (config->keyExists("MaxRetries")) fromString(maxRetries, config->getValue("MaxRetries"));
+  for (it=workerQueues[worker].begin(); it!=workerQueues[worker].end(); it++) {
+    task = taskMap[*it];
+    task->setHostname(workerHosts[worker]);
+    if (task->getRetries() < max(1, maxRetries)) {
+      LOG_RECORD(log, GreasyLog::warning, "Task " + toString(task->getTaskNum()) + " located in line " + toString(task->getTaskId())
+                  + " was lost with worker " + toString(worker) + ". Queueing it again");
+      task->addRetryAttempt();
+      task->setTaskState(GreasyTask::waiting);
+      taskQueue.push(task);
+      notifyTaskEvent(GreasyEvents::retried, task);
+      notifyTaskEvent(GreasyEvents::queued, task);
+    } else {
+      LOG_RECORD(log, GreasyLog::error, "Task " + toString(task->getTaskNum()) + " located in line " + toString(task->getTaskId())
+                  + " was lost with worker " + toString(worker) + " too many times");
+      task->setReturnCode(-1);
+      task->setTaskState(GreasyTask::failed);
+      notifyTaskEvent(GreasyEvents::finished, task);
+      updateDependencies(task);
+    }
+  }
+  workerQueues[worker].clear();
+  outgoingTasks.erase(worker);
+
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::loseWorker", "Exiting...");
+
+}
+
+bool MPIEngine::needMoreWorkers() {
+
+  return ((spawnSize > 0) && (spawnGroupsLeft > 0) && (nslots > 0) && !firstWave
+          && (taskQueue.size() > spawnThreshold*nslots));
+
+}
+
+void MPIEngine::growWorkers() {
+
+  int err, worker;
+  char exe[PATH_MAX];
+  char cwd[PATH_MAX];
+  char* args[2];
+  ssize_t length;
+  MPI_Info info;
+  spawnGroup group;
+  helloStruct hello;
+  vector<helloStruct> hellos(spawnSize+1);
+  vector<int> errcodes(spawnSize);
+  bool more = true;
+
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::growWorkers", "Entering...");
+
+  spawnGroupsLeft--;
+
+  // The new workers run this same binary, which finds out it was spawned
+  length = readlink("/proc/self/exe", exe, sizeof(exe)-1);
+  if (length <= 0) {
+    LOG_RECORD(log, GreasyLog::error, "Could not find the greasy binary to spawn more workers");
+    spawnGroupsLeft = 0;
+    return;
+  }
+  exe[length] = '\0';
+  args[0] = (char*)taskFile.c_str();
+  args[1] = NULL;
+
+  MPI_Info_create(&info);
+  if (getcwd(cwd, sizeof(cwd))) MPI_Info_set(info, (char*)"wdir", cwd);
+  if (!spawnHosts.empty()) MPI_Info_set(info, (char*)"host", (char*)spawnHosts.c_str());
+
+  LOG_RECORD(log, GreasyLog::info, toString(taskQueue.size()) + " tasks waiting for " + toString(nslots)
+              + " slots. Spawning " + toString(spawnSize) + " more workers");
+
+  // A failed spawn must not abort the run, which goes on with the workers it has
+  MPI_Comm_set_errhandler(MPI_COMM_SELF, MPI_ERRORS_RETURN);
+  err = MPI_Comm_spawn(exe, args, spawnSize, info, 0, MPI_COMM_SELF, &group.inter, &errcodes[0]);
+  MPI_Info_free(&info);
+  if (err != MPI_SUCCESS) {
+    LOG_RECORD(log, GreasyLog::error, "Could not spawn more workers (error " + toString(err) + "). Not trying again");
+    spawnGroupsLeft = 0;
+    LOG_RECORD(log, GreasyLog::devel, "MPIEngine::growWorkers", "Exiting...");
+    return;
+  }
+
+  // Same handshake as the workers started with the run, on a communicator of their own
+  MPI_Intercomm_merge(group.inter, 0, &group.comm);
+  group.first = workerHosts.size();
+  group.size = spawnSize;
+  MPI_Bcast(&group.first, 1, MPI_INT, 0, group.comm);
+  memset(&hello, 0, sizeof(helloStruct));
+  MPI_Gather(&hello, sizeof(helloStruct), MPI_BYTE, &hellos[0], sizeof(helloStruct), MPI_BYTE, 0, group.comm);
+  broadcastTaskTable(group.comm);
+  if (heartbeat > 0) MPI_Comm_set_errhandler(group.comm, MPI_ERRORS_RETURN);
+
+  for (int rank=1; rank<=group.size; rank++) {
+    worker = group.first + rank - 1;
+    workerHosts.push_back(string(hellos[rank].hostname));
+    workerCapacity.push_back(hellos[rank].slots);
+    workerLeader.push_back(0);
+    workerComms.push_back(group.comm);
+    workerRanks.push_back(rank);
+    lastSeen.push_back(MPI_Wtime());
+    lostWorkers.push_back(false);
+    LOG_RECORD(log, GreasyLog::debug, "Worker " + toString(worker) + " on node " + workerHosts[worker]
+                + " runs up to " + toString(workerCapacity[worker]) + " tasks at the same time");
+    if (hellos[rank].version != MPI_PROTOCOL_VERSION)
+      LOG_RECORD(log, GreasyLog::error, "Worker " + toString(worker) + " on node " + workerHosts[worker]
+                  + " uses a different protocol version (" + toString(hellos[rank].version) + ")");
+  }
+
+  // Slots are interleaved as the ones of the first workers
+  for (int slot=0; more; slot++) {
+    more = false;
+    for (worker=group.first; worker<group.first+group.size; worker++) {
+      if (slot < getWorkerSlots(worker)) {
+        freeWorkers.push(worker);
+        nslots++;
+        more = true;
+      }
+    }
+  }
+  spawnGroups.push_back(group);
+
+  LOG_RECORD(log, GreasyLog::info, "Workers " + toString(group.first) + " to " + toString(group.first+group.size-1)
+              + " joined the run. There are " + toString(nslots) + " slots now");
+
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::growWorkers", "Exiting...");
+
+}
+
+void MPIEngine::retireIdleGroups() {
+
+  bool idle;
+  list<spawnGroup>::iterator it = spawnGroups.begin();
+
+  while (it != spawnGroups.end()) {
+    idle = true;
+    for (int worker=it->first; worker<it->first+it->size; worker++) {
+      if (!workerQueues[worker].empty()) idle = false;
+    }
+    if (idle) {
+      retireGroup(*it);
+      it = spawnGroups.erase(it);
+    } else {
+      it++;
+    }
+  }
+
+}
+
+void MPIEngine::retireGroup(spawnGroup& group) {
 
-  log->record(GreasyLog::debug,  "Waiting for any task to complete...");
-  MPI_Recv(&report, sizeof(reportStruct), MPI_CHAR, MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+  msgHeader header;
+  queue<int> remaining;
+  bool lost = false;
 
-  retcode = report.retcode;
-  worker = status.MPI_SOURCE;
-  task = taskMap[taskAssignation[worker]];
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::retireGroup", "Entering...");
 
-  // Push worker to the free workers queue again
-  freeWorkers.push(worker);
+  header.version = MPI_PROTOCOL_VERSION;
+  header.type = fireMessage;
+  header.count = 0;
+  header.taskId = -1;
 
-  // Update task info with the report
-  task->setElapsedTime(report.elapsed);
-  task->setReturnCode(report.retcode);
-  task->setHostname(string(report.hostname));
+  for (int worker=group.first; worker<group.first+group.size; worker++) {
+    if (lostWorkers[worker]) {
+      lost = true;
+      continue;
+    }
+    MPI_Send(&header, sizeof(msgHeader), MPI_BYTE, workerRanks[worker], 0, group.comm);
+    sentMessages++;
+    sentBytes += sizeof(msgHeader);
+    // Nothing is expected from them anymore, as from a lost worker
+    lostWorkers[worker] = true;
+    nslots -= getWorkerSlots(worker);
+  }
+
+  // Their slots will never be free again
+  while (!freeWorkers.empty()) {
+    if ((freeWorkers.front() < group.first)||(freeWorkers.front() >= group.first+group.size)) remaining.push(freeWorkers.front());
+    freeWorkers.pop();
+  }
+  freeWorkers.swap(remaining);
+
+  // Disconnecting waits for the workers, which lost ones would never do
+  MPI_Comm_free(&group.comm);
+  if (lost) MPI_Comm_free(&group.inter);
+  else MPI_Comm_disconnect(&group.inter);
 
-  taskEpilogue(task);
+  LOG_RECORD(log, GreasyLog::info, "Workers " + toString(group.first) + " to " + toString(group.first+group.size-1)
+              + " left the run. There are " + toString(nslots) + " slots now");
 
-  log->record(GreasyLog::devel, "MPIEngine::waitForAnyWorker", "Exiting...");
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::retireGroup", "Exiting...");
+
+}
+
+void MPIEngine::releaseSends(bool wait) {
+
+  int done;
+  list<pendingSend>::iterator it = pendingSends.begin();
+
+  while (it != pendingSends.end()) {
+    // Sends to lost workers may never complete
+    if (wait && !lostWorkers[it->worker]) {
+      MPI_Wait(&it->request, MPI_STATUS_IGNORE);
+      done = 1;
+    } else {
+      MPI_Test(&it->request, &done, MPI_STATUS_IGNORE);
+    }
+    if (done) it = pendingSends.erase(it);
+    else it++;
+  }
 
 }
 
 void MPIEngine::fireWorkers() {
 
-  int fired = -1;
-  int worker;
+  msgHeader header;
+
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::fireWorkers", "Entering...");
 
-  log->record(GreasyLog::devel, "MPIEngine::fireWorkers", "Entering...");
+  // Make sure all the tasks are delivered before the fire signal
+  scatterFirstWave();
+  sendTasks();
+  releaseSends(true);
 
-  log->record(GreasyLog::debug,  "Sending fire comand to all workers...");
+  header.version = MPI_PROTOCOL_VERSION;
+  header.type = fireMessage;
+  header.count = 0;
+  header.taskId = -1;
+
+  LOG_RECORD(log, GreasyLog::debug,  "Sending fire comand to all workers...");
   for(int worker=1;worker<=nworkers;worker++) {
-    MPI_Send(&fired, 1, MPI_INT, worker, 0, MPI_COMM_WORLD);
+    // Workers behind a node sub-master are fired by it
+    if (lostWorkers[worker]||(workerLeader[worker] != 0)) continue;
+    MPI_Send(&header, sizeof(msgHeader), MPI_BYTE, worker, 0, MPI_COMM_WORLD);
+    sentMessages++;
+    sentBytes += sizeof(msgHeader);
   }
 
-  log->record(GreasyLog::devel, "MPIEngine::fireWorkers", "Exiting...");
+  while (!spawnGroups.empty()) {
+    retireGroup(spawnGroups.front());
+    spawnGroups.pop_front();
+  }
+
+  LOG_RECORD(log, GreasyLog::devel, "MPIEngine::fireWorkers", "Exiting...");
 
 }
 
 void MPIEngine::dumpTasks() {
 
   if (isMaster()) {
-    log->record(GreasyLog::devel, dumpTaskMap());
+    LOG_RECORD(log, GreasyLog::devel, dumpTaskMap());
   }
 
 }
@@ -228,10 +1155,10 @@ void MPIEngine::dumpTasks() {
 void MPIEngine::executionSummary() {
 
   char *pwd=NULL;
-	char *job_id;
+	char *job_id=NULL;
 	char *n_nodes=NULL;
 	pwd=get_current_dir_name();
-	log->record(GreasyLog::info, "Current Working Dir " + toString(pwd));
+	LOG_RECORD(log, GreasyLog::info, "Current Working Dir " + toString(pwd));
 
 #if defined(LSF)
 	char command_nodes[250];
@@ -242,7 +1169,7 @@ void MPIEngine::executionSummary() {
 	while (fgets(buf, 10, fp)) {
 		strcpy(n_nodes,buf);
 	}
-	if(n_nodes) log->record(GreasyLog::info, "Run on " + toString(n_nodes)+ "nodes");
+	if(n_nodes) LOG_RECORD(log, GreasyLog::info, "Run on " + toString(n_nodes)+ "nodes");
   job_id=getenv(JOBID);
 
 #elif defined(PBS)
@@ -254,115 +1181,19 @@ void MPIEngine::executionSummary() {
 	while (fgets(buf, 10, fp)) {
 	    strcpy(n_nodes,buf);
 	}
-	if(n_nodes) log->record(GreasyLog::info, "Run on " + toString(n_nodes)+ "nodes");
+	if(n_nodes) LOG_RECORD(log, GreasyLog::info, "Run on " + toString(n_nodes)+ "nodes");
 	job_id=getenv(JOBID);
 
 
 #elif defined(SLURM)
 	n_nodes=getenv("SLURM_JOB_NUM_NODES");
 	strcat(n_nodes," ");
-	if(n_nodes) log->record(GreasyLog::info, "Run on " + toString(n_nodes)+ "nodes");
+	if(n_nodes) LOG_RECORD(log, GreasyLog::info, "Run on " + toString(n_nodes)+ "nodes");
   	job_id=getenv(JOBID);
 #endif
 
-  //log->record(GreasyLog::info, toString(command_nodes));
-	if(job_id) log->record(GreasyLog::info, "Job ID " + toString(job_id));
-
-
-}
-
-/*
- * Worker Methods
- *
- */
-
-void MPIEngine::runWorker() {
-
-  int cmdSize = 0;
-  char *cmd = NULL;
-  MPI_Status status;
-  int retcode = -1;
-  int err;
-  reportStruct report;
-  GreasyTimer timer;
-
-  // Worker code
-  if (!isWorker()) return;
-
-  log->record(GreasyLog::devel, "MPIEngine::runWorker("+toString(workerId)+")", "Entering...");
-
-  // Main worker loop
-  while(1) {
-    report.workerStatus = 1;
-    report.retcode = -1;
-    report.elapsed = 0;
-    strcpy(report.hostname,hostname);
-    // Receive command size, including '\0'
-    // Probe for an incoming message from master
-    MPI_Probe(0, 0, MPI_COMM_WORLD, &status);
-    // When probe returns, the status object has the size and other
-    // attributes of the incoming message. Get the message size
-    MPI_Get_count(&status, MPI_BYTE, &cmdSize);
-    if (cmdSize == 4) { // Reived size of command or fired signal (-1)
-        err = MPI_Recv(&cmdSize, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, &status);
-        if (err != MPI_SUCCESS ) {
-          log->record(GreasyLog::error, "WORKER("+toString(workerId)+")", "Error receiving command size: "+toString(err));
-          report.workerStatus = 0;
-          MPI_Send(&report, sizeof(report), MPI_CHAR, 0, 0, MPI_COMM_WORLD);
-          continue;
-        }
-
-        // A negative size means the worker is fired
-        if (cmdSize < 0) {
-          log->record(GreasyLog::debug, toString(workerId), "Received fired signal!");
-          break;
-        }
-    } else {
-
-        // Allocate the memory for the command
-        cmd = (char*) malloc(cmdSize*sizeof(char));
-        if(!cmd) {
-          log->record(GreasyLog::error, "WORKER("+toString(workerId)+")", "Could not allocate memory");
-          report.workerStatus = 0;
-          MPI_Send(&report, sizeof(report), MPI_CHAR, 0, 0, MPI_COMM_WORLD);
-          break;
-        }
-
-        // Receive the command
-        err = MPI_Recv((void *)cmd, cmdSize, MPI_BYTE, 0, 0, MPI_COMM_WORLD, &status);
-        if (err != MPI_SUCCESS) {
-          log->record(GreasyLog::error, "WORKER("+toString(workerId)+")", "Error receiving command: "+toString(err));
-          report.workerStatus = 0;
-          MPI_Send(&report, sizeof(report), MPI_CHAR, 0, 0, MPI_COMM_WORLD);
-          continue;
-        }
-
-        log->record(GreasyLog::debug, toString(workerId), "Running task " + toString(cmd));
-
-        int size = MPI_MAX_PROCESSOR_NAME;
-        char workerHost[MPI_MAX_PROCESSOR_NAME];
-        MPI_Get_processor_name(workerHost,&size);
-
-        log->record(GreasyLog::info, "Worker " +toString(workerId) + " on node " +  toString(workerHost));
-
-        // Execute the command
-        timer.reset();
-        timer.start();
-        retcode = system(cmd);
-        timer.stop();
-
-        report.retcode = retcode;
-        report.elapsed = timer.secsElapsed();
-
-        // Report to the master the end of the task
-        log->record(GreasyLog::debug, toString(workerId), "Task finished with retcode (" + toString(retcode) + "). Elapsed: " + GreasyTimer::secsToTime(report.elapsed));
-        MPI_Send(&report, sizeof(report), MPI_CHAR, 0, 0, MPI_COMM_WORLD);
-
-        if (cmd) free(cmd);
-    }
-  }
-
+  //LOG_RECORD(log, GreasyLog::info, toString(command_nodes));
+	if(job_id) LOG_RECORD(log, GreasyLog::info, "Job ID " + toString(job_id));
 
-  log->record(GreasyLog::devel, "MPIEngine::runWorker("+toString(workerId)+")", "Exiting...");
 
 }
@@ -31,10 +31,74 @@
 
 #include "mpi.h"
 #include <string>
+#include <sys/types.h>
 #include <queue>
+#include <deque>
+#include <list>
+#include <vector>
 
 #include "abstractschedulerengine.h"
 
+class MPIWorker;
+
+// Version of the messages exchanged by the master and the workers.
+// It must be increased whenever the layout of any of them changes.
+#define MPI_PROTOCOL_VERSION 7
+
+/**
+ * Header of every message exchanged between the master and the workers.
+ * A report message is followed by count reportEntry records, and a task
+ * message by count task ids, or none if count is 0 and taskId is the only
+ * task. Workers get all the commands at startup.
+ */
+typedef struct {
+    unsigned char version; /**< Protocol version of the sender. */
+    unsigned char type; /**< Type of the message, from MPIEngine::MessageTypes. */
+    unsigned short count; /**< Number of reports following a report message. */
+    int taskId; /**< Task to run in a task message. */
+} msgHeader;
+
+/**
+ * Record sent by a worker for each task it finishes.
+ */
+typedef struct {
+    int taskId; /**< Task that finished. */
+    int retcode; /**< Return code of the command. */
+    unsigned long long elapsed; /**< Microseconds elapsed running the command. */
+    taskUsage usage; /**< Resources used by the command, cleared if it did not run. */
+    long long startDelay; /**< Microseconds from the task reaching the worker to its start, or -1 if it did not run. */
+    long long noticeDelay; /**< Microseconds from the end of the task to sending the report, or -1 if it did not run. */
+} reportEntry;
+
+/**
+ * Message every rank sends to the master once at startup.
+ */
+typedef struct {
+    int version; /**< Protocol version of the rank. */
+    int slots; /**< Number of tasks the rank can run at the same time. For a node sub-master, the ones of its node. */
+    int leader; /**< Rank of the node sub-master the rank talks to, or 0 if it talks to the master. */
+    char hostname[MPI_MAX_PROCESSOR_NAME]; /**< Node where the rank runs. */
+} helloStruct;
+
+/**
+ * Buffer of a message sent to a worker with a nonblocking call. It must be
+ * kept alive until the send completes.
+ */
+typedef struct {
+    vector<char> buffer;
+    MPI_Request request;
+    int worker;
+} pendingSend;
+
+/**
+ * Group of workers spawned by the master during the run.
+ */
+typedef struct {
+    MPI_Comm inter; /**< Intercommunicator returned by the spawn. */
+    MPI_Comm comm; /**< Communicator merged with the master, which is rank 0 in it. */
+    int first; /**< Worker id of rank 1 in comm. The rest follow. */
+    int size; /**< Number of workers in the group. */
+} spawnGroup;
 
 /**
   * This engine inherits AbstractSchedulerEngine, and implements an MPI scheduler for Greasy.
@@ -78,8 +142,18 @@ public:
    */
   virtual void dumpTasks();
 
+  /**
+   * Types of the messages exchanged by the master and the workers.
+   */
+  enum MessageTypes {
+    taskMessage = 1, /**< Master asks a worker to run a task. */
+    fireMessage, /**< Master tells a worker to finish. */
+    reportMessage, /**< Worker reports one or more finished tasks. */
+    heartbeatMessage /**< Worker tells the master it is still alive. */
+  };
+
 protected:
-  
+
   /**
    * Check if the engine is in Master mode.
    * @return true if engine is the master, false otherwise.
@@ -92,12 +166,25 @@ protected:
    */
   bool isWorker();
 
+  /**
+   * Check if the engine is a node sub-master, which schedules the tasks
+   * of its node on behalf of the master.
+   * @return true if engine is a node sub-master, false otherwise.
+   */
+  bool isSubMaster();
+
   // Master Methods
   /**
    * Main master method.
    * All the scheduling of tasks is done here.
    */
   void runMaster();
+
+  /**
+   * Master loop when workers schedule themselves: it only collects the
+   * reports until all the tasks have finished.
+   */
+  void runSelfScheduler();
   
   /**
    * Allocate a task in a free worker, sending the command to it.
@@ -111,23 +198,187 @@ protected:
    */
   virtual void waitForAnyWorker();
   
+  /**
+   * Get the number of tasks that can be assigned to a worker at the same time:
+   * the slots it announced at startup plus the prefetch depth.
+   * @param worker The worker id.
+   * @return The number of slots of the worker.
+   */
+  virtual int getWorkerSlots(int worker);
+
+  /**
+   * Get the number of tasks all the workers can run at the same time.
+   * @return The sum of the slots announced by the workers.
+   */
+  virtual int getConcurrency();
+
   /**
    * Send the end signal to the workers. This method should be called
    * when all tasks have been completed and we want to finalize workers.
    */
   void fireWorkers();
   void executionSummary();
+
+  /**
+   * Wait for a message from any worker, following the wait mode configured.
+   * It also accounts for the time and cpu spent waiting. When the master runs
+   * tasks itself, it also returns as soon as any of them finishes.
+   * @param status The status of the message found.
+   * @return The worker that sent the message, or -1 if a task of the master finished.
+   */
+  int probeAnyWorker(MPI_Status *status);
+
+  /**
+   * Check without blocking if a message arrived from any worker, including
+   * the spawned ones.
+   * @param status The status of the message found.
+   * @return The worker that sent the message, or -1 if there is none.
+   */
+  int iprobeWorkers(MPI_Status *status);
+
+  /**
+   * Check if the ready tasks are so many for the slots available that
+   * a new group of workers should be spawned.
+   * @return true if a group should be spawned.
+   */
+  bool needMoreWorkers();
+
+  /**
+   * Spawn a new group of workers and add their slots to the free ones.
+   */
+  void growWorkers();
+
+  /**
+   * Fire the spawned groups whose workers are all idle, once no task is
+   * waiting to run, and give their slots back.
+   */
+  void retireIdleGroups();
+
+  /**
+   * Fire the workers of a spawned group and disconnect from it.
+   * @param group The group.
+   */
+  void retireGroup(spawnGroup& group);
+
+  /**
+   * Check, without collecting it, if any task run by the master has finished.
+   * @return true if there is a finished task to collect.
+   */
+  bool localTaskFinished();
+
+  /**
+   * Collect the tasks run by the master that have finished and run their epilogue.
+   */
+  void collectLocalTasks();
+
+  /**
+   * Check the heartbeat deadlines of the workers and give up the ones
+   * that missed them.
+   * @return true if any worker was lost.
+   */
+  bool checkHeartbeats();
+
+  /**
+   * Give up a worker that stopped sending heartbeats: its slots are dropped
+   * and its tasks are queued again to run elsewhere.
+   * @param worker The worker id.
+   */
+  void loseWorker(int worker);
+
+  /**
+   * Send the commands of all the valid tasks to every worker, so that only
+   * task ids travel afterwards. It is collective, so all ranks call it.
+   * @param comm The communicator of the workers, where the master is rank 0.
+   */
+  void broadcastTaskTable(MPI_Comm comm);
+
+  /**
+   * Send the tasks allocated so far in a single scatter, if they were not sent yet.
+   * Workers receive it at the start of MPIWorker::runWorker().
+   */
+  void scatterFirstWave();
+
+  /**
+   * Get the command to run for a task, including the change to its working directory.
+   * @param task The task.
+   * @return The command for the shell.
+   */
+  string getTaskCommand(GreasyTask* task);
+
+  /**
+   * Send the tasks allocated since the last wait, one message for each worker.
+   */
+  void sendTasks();
+
+  /**
+   * Check the nonblocking sends to the workers and release the buffers
+   * of the ones already completed.
+   * @param wait If true, block until all the sends have completed.
+   */
+  void releaseSends(bool wait);
   
-  // Worker Methods
   /**
-   * Main Worker method.
-   * It waits for a message from the master with the command
-   * to execute, until the end signal is received.
+   * Get the default number of slots of this worker: the cpus it can use divided
+   * among the ranks sharing its node. nodeComm must be set.
+   * @return The number of slots.
    */
-  void runWorker();
+  int getDefaultTaskSlots();
   
   int workerId; /**<  Id of the worker. Master is 0. */
   char hostname[MPI_MAX_PROCESSOR_NAME]; ///< Cstring to hold the worker hostname.
+  int prefetchDepth; /**< Number of tasks queued in advance on each worker. */
+  map<int, deque<int> > workerQueues; ///< Tasks assigned to each worker, in the order they will run.
+  map<int, vector<int> > outgoingTasks; ///< Tasks allocated to each worker and not sent yet.
+  list<pendingSend> pendingSends; ///< Nonblocking sends to the workers still in progress.
+  vector<string> workerHosts; ///< Hostname of each rank, exchanged once at startup.
+  vector<int> workerCapacity; ///< Number of tasks each rank runs at the same time.
+  int taskSlots; ///< Number of tasks this worker runs at the same time. On the master, the tasks it runs itself.
+  map<pid_t, pair<int,GreasyTimer> > localTasks; ///< Task id and timer of the tasks run by the master, by pid.
+  unsigned long sentMessages; ///< Number of messages sent by the master.
+  unsigned long sentBytes; ///< Number of bytes sent by the master.
+  unsigned long recvMessages; ///< Number of messages received by the master.
+  unsigned long recvBytes; ///< Number of bytes received by the master.
+  bool pollWait; ///< Flag to know if the master polls for messages instead of blocking in MPI.
+  int maxWaitSleep; ///< Maximum microseconds the master sleeps between polls.
+  double waitTime; ///< Seconds the master spent waiting for workers.
+  double waitCpu; ///< Seconds of cpu the master spent waiting for workers.
+  double delaySum; ///< Sum of the last sleep before each message was found, in seconds.
+  double delayMax; ///< Maximum sleep before a message was found, in seconds.
+  unsigned long waits; ///< Number of waits for workers.
+
+  double heartbeat; ///< Seconds between heartbeats of the workers. 0 disables them.
+  bool heartbeatRequested; ///< Whether heartbeats were configured, even if they cannot be used.
+  double heartbeatTimeout; ///< Seconds without news from a worker before it is given up. There is no grace period: a worker only stalled may still run the tasks queued again elsewhere, and its later reports are ignored.
+  double nextHeartbeatCheck; ///< Time when the master checks the heartbeat deadlines again.
+  vector<double> lastSeen; ///< Time of the last message received from each worker.
+  vector<bool> lostWorkers; ///< Flag for each worker given up by the master.
+  int nlost; ///< Number of workers given up by the master.
+  int waveSize; ///< Maximum number of tasks any worker gets in the first wave.
+  bool firstWave; ///< Flag to know if the master still holds the first wave of tasks.
+  vector<int> firstWaveTasks; ///< Task ids of the first wave, waveSize for each rank, -1 if unused.
+  vector<int> firstWaveCount; ///< Number of tasks in the first wave of each rank.
+  bool selfScheduling; ///< Flag to know if workers take the tasks themselves from a shared counter.
+  int chunkSize; ///< Number of tasks claimed at once when self scheduling.
+  int nextTask; ///< Index of the next task to claim, exposed by the master.
+  MPI_Win taskWindow; ///< Window exposing nextTask to the workers.
+  unsigned int finishedTasks; ///< Number of tasks finished, counted by the master.
+  int retryWorker; ///< Worker whose report is being processed, which gets the retries when self scheduling.
+  MPI_Comm nodeComm; ///< Communicator of the ranks sharing the node of this rank.
+  MPI_Comm masterComm; ///< Communicator used to talk to the master of this worker, which is rank 0 in it.
+  bool hierarchical; ///< Flag to know if nodes have a sub-master between the master and their workers.
+  bool subMaster; ///< Flag to know if this rank is the sub-master of its node.
+  vector<int> localCapacity; ///< Number of tasks each rank of the node runs, known by the node sub-master.
+  vector<int> workerLeader; ///< Node sub-master of each rank, or 0 if it talks to the master.
+  vector<MPI_Comm> workerComms; ///< Communicator to talk to each worker.
+  vector<int> workerRanks; ///< Rank of each worker in its communicator.
+  MPI_Comm parentComm; ///< Intercommunicator with the master of a spawned worker, MPI_COMM_NULL otherwise.
+  MPI_Comm setupComm; ///< Communicator shared with the master at startup.
+  list<spawnGroup> spawnGroups; ///< Groups of workers spawned and not retired yet.
+  int spawnSize; ///< Number of workers in each group spawned. 0 disables spawning.
+  int spawnGroupsLeft; ///< Number of groups that can still be spawned.
+  double spawnThreshold; ///< Ready tasks for each slot that make the master spawn a group.
+  string spawnHosts; ///< Hosts where the groups are spawned, if given.
+  MPIWorker* mpiWorker; ///< Side of the engine run by the workers and the node sub-masters. NULL on the master.
 
 };
 
@@ -0,0 +1,493 @@
+/*
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ *
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#include "mpiworker.h"
+#include <csignal>
+#include <cstring>
+#include <algorithm>
+#include <climits>
+#include <queue>
+#include <unistd.h>
+#include <sys/wait.h>
+
+
+// Empty handler to wake up the worker from its sleeps when a task finishes.
+static void childHandler(int sig) { }
+
+MPIWorker::MPIWorker(int id, const string& host, MPI_Comm comm, int slots, double heartbeatInterval) {
+
+  GreasyConfig* config = GreasyConfig::getInstance();
+
+  log = GreasyLog::getInstance();
+  workerId = id;
+  hostname = host;
+  masterComm = comm;
+  taskSlots = slots;
+  heartbeat = heartbeatInterval;
+  lastSendTime = 0;
+  fired = false;
+  idle = 0;
+  taskWindow = MPI_WIN_NULL;
+  chunkSize = 1;
+  firstReportTime = 0;
+  reportBatch = 16;
+  reportDelay = 0;
+
+  // Setup the batching of reports
+  if (config->keyExists("MPIReportBatch")) fromString(reportBatch, config->getValue("MPIReportBatch"));
+  if (config->keyExists("MPIReportDelay")) fromString(reportDelay, config->getValue("MPIReportDelay"));
+  if (reportBatch < 1) reportBatch = 1;
+  if (reportBatch > USHRT_MAX) reportBatch = USHRT_MAX;
+
+}
+
+void MPIWorker::addTask(int taskId, const string& command) {
+
+  taskCommands[taskId] = command;
+  taskOrder.push_back(taskId);
+
+}
+
+void MPIWorker::runWorker(int waveSize) {
+
+  bool progress;
+
+  LOG_RECORD(log, GreasyLog::devel, "MPIWorker::runWorker("+toString(workerId)+")", "Entering...");
+
+  signal(SIGCHLD, childHandler);
+
+  // The first tasks arrive all together
+  if (waveSize > 0) {
+    vector<int> wave(waveSize);
+    MPI_Scatter(NULL, waveSize, MPI_INT, &wave[0], waveSize, MPI_INT, 0, MPI_COMM_WORLD);
+    for (int i=0; (i<waveSize) && (wave[i]>=0); i++) localQueue.push_back(wave[i]);
+  }
+
+  while (isBusy()) {
+    progress = receiveTasks();
+    progress |= startTasks();
+    progress |= collectTasks(!progress);
+    endIteration(progress);
+  }
+
+  sendReports();
+
+  signal(SIGCHLD, SIG_DFL);
+
+  LOG_RECORD(log, GreasyLog::devel, "MPIWorker::runWorker("+toString(workerId)+")", "Exiting...");
+
+}
+
+void MPIWorker::runSelfScheduled(MPI_Win window, int chunk) {
+
+  bool exhausted = false;
+  bool progress;
+
+  LOG_RECORD(log, GreasyLog::devel, "MPIWorker::runSelfScheduled("+toString(workerId)+")", "Entering...");
+
+  signal(SIGCHLD, childHandler);
+
+  taskWindow = window;
+  chunkSize = chunk;
+  MPI_Win_lock_all(0, taskWindow);
+
+  while (isBusy()) {
+    progress = false;
+    // Take more tasks while there are free slots. The master only sends the retries.
+    while (!exhausted && ((int) (localQueue.size() + children.size()) < taskSlots)) {
+      exhausted = !claimTasks();
+      progress = true;
+    }
+    progress |= receiveTasks();
+    progress |= startTasks();
+    progress |= collectTasks(!progress);
+    endIteration(progress);
+  }
+
+  sendReports();
+
+  MPI_Win_unlock_all(taskWindow);
+
+  signal(SIGCHLD, SIG_DFL);
+
+  LOG_RECORD(log, GreasyLog::devel, "MPIWorker::runSelfScheduled("+toString(workerId)+")", "Exiting...");
+
+}
+
+void MPIWorker::runSubMaster(MPI_Comm nodeComm, const vector<int>& localCapacity) {
+
+  int msgSize, pending, rank, nodeSize;
+  int busy = 0;
+  bool progress, more;
+  MPI_Status status;
+  vector<char> message;
+  msgHeader header;
+  reportEntry report;
+  deque<int> tasks;
+  queue<int> freeSlots;
+
+  LOG_RECORD(log, GreasyLog::devel, "MPIWorker::runSubMaster("+toString(workerId)+")", "Entering...");
+
+  // Slots of the workers of the node, interleaved so that tasks are spread among them
+  MPI_Comm_size(nodeComm, &nodeSize);
+  more = true;
+  for (int slot=0; more; slot++) {
+    more = false;
+    for (rank=1; rank<nodeSize; rank++) {
+      if (slot < localCapacity[rank]) {
+        freeSlots.push(rank);
+        more = true;
+      }
+    }
+  }
+
+  while (!fired || !tasks.empty() || (busy > 0)) {
+
+    progress = false;
+
+    // Tasks and the end signal from the master
+    MPI_Iprobe(0, 0, masterComm, &pending, &status);
+    while (pending && !fired) {
+      progress = true;
+      MPI_Get_count(&status, MPI_BYTE, &msgSize);
+      message.resize(msgSize);
+      MPI_Recv(&message[0], msgSize, MPI_BYTE, 0, 0, masterComm, &status);
+      memcpy(&header, &message[0], sizeof(msgHeader));
+      if (header.type == MPIEngine::fireMessage) fired = true;
+      else if (header.type == MPIEngine::taskMessage) readTaskIds(message, tasks);
+      else LOG_RECORD(log, GreasyLog::error, "SUBMASTER("+toString(workerId)+")", "Unexpected message of type " + toString((int)header.type));
+      MPI_Iprobe(0, 0, masterComm, &pending, &status);
+    }
+
+    // Reports from the workers of the node, which free their slots
+    MPI_Iprobe(MPI_ANY_SOURCE, 0, nodeComm, &pending, &status);
+    while (pending) {
+      progress = true;
+      rank = status.MPI_SOURCE;
+      MPI_Get_count(&status, MPI_BYTE, &msgSize);
+      message.resize(msgSize);
+      MPI_Recv(&message[0], msgSize, MPI_BYTE, rank, 0, nodeComm, &status);
+      memcpy(&header, &message[0], sizeof(msgHeader));
+      if ((header.type == MPIEngine::reportMessage)&&(msgSize == (int) (sizeof(msgHeader) + header.count*sizeof(reportEntry)))) {
+        for (int i=0; i<header.count; i++) {
+          memcpy(&report, &message[sizeof(msgHeader) + i*sizeof(reportEntry)], sizeof(reportEntry));
+          // The time held here is added to the one measured by the worker
+          queueReport(report, (report.noticeDelay < 0) ? -1 : (long long) GreasyTimer::usecsNow() - report.noticeDelay);
+          freeSlots.push(rank);
+          busy--;
+        }
+      } else {
+        LOG_RECORD(log, GreasyLog::error, "SUBMASTER("+toString(workerId)+")", "Unexpected message from worker " + toString(rank));
+      }
+      MPI_Iprobe(MPI_ANY_SOURCE, 0, nodeComm, &pending, &status);
+    }
+
+    // Hand the tasks to the workers with free slots
+    while (!tasks.empty() && !freeSlots.empty()) {
+      progress = true;
+      header.version = MPI_PROTOCOL_VERSION;
+      header.type = MPIEngine::taskMessage;
+      header.count = 0;
+      header.taskId = tasks.front();
+      MPI_Send(&header, sizeof(msgHeader), MPI_BYTE, freeSlots.front(), 0, nodeComm);
+      tasks.pop_front();
+      freeSlots.pop();
+      busy++;
+    }
+
+    // Forward the reports all together, batched as the workers do
+    if (!pendingReports.empty() && (!progress||(pendingReports.size() >= reportBatch)||((MPI_Wtime()-firstReportTime)*1000 >= reportDelay))) {
+      sendReports();
+    }
+
+    // Nothing happened: wait a bit before polling again
+    if (progress) {
+      idle = 0;
+    } else {
+      idle = (idle == 0) ? 100 : min(2*idle, 10000);
+      usleep(idle);
+    }
+  }
+
+  sendReports();
+
+  header.version = MPI_PROTOCOL_VERSION;
+  header.type = MPIEngine::fireMessage;
+  header.count = 0;
+  header.taskId = -1;
+  for (rank=1; rank<nodeSize; rank++) MPI_Send(&header, sizeof(msgHeader), MPI_BYTE, rank, 0, nodeComm);
+
+  LOG_RECORD(log, GreasyLog::devel, "MPIWorker::runSubMaster("+toString(workerId)+")", "Exiting...");
+
+}
+
+bool MPIWorker::isBusy() {
+
+  return (!fired || !localQueue.empty() || !children.empty());
+
+}
+
+bool MPIWorker::receiveTasks() {
+
+  int msgSize = 0;
+  int err;
+  int pending;
+  bool progress = false;
+  MPI_Status status;
+  vector<char> message;
+  msgHeader header;
+
+  while (!fired) {
+    // The master has to know about finished tasks before we wait for more.
+    if (localQueue.empty() && children.empty()) sendReports();
+    // With heartbeats we cannot block, since they have to keep going.
+    if (localQueue.empty() && children.empty() && (heartbeat == 0)) {
+      MPI_Probe(0, 0, masterComm, &status);
+    } else {
+      MPI_Iprobe(0, 0, masterComm, &pending, &status);
+      if (!pending) break;
+    }
+    progress = true;
+    // When probe returns, the status object has the size and other
+    // attributes of the incoming message. Get the message size
+    MPI_Get_count(&status, MPI_BYTE, &msgSize);
+    message.resize(msgSize);
+    err = MPI_Recv(&message[0], msgSize, MPI_BYTE, 0, 0, masterComm, &status);
+    if ((err != MPI_SUCCESS)||(msgSize < (int) sizeof(msgHeader))) {
+      LOG_RECORD(log, GreasyLog::error, "WORKER("+toString(workerId)+")", "Error receiving message: "+toString(err));
+      continue;
+    }
+
+    memcpy(&header, &message[0], sizeof(msgHeader));
+    if (header.type == MPIEngine::fireMessage) {
+      LOG_RECORD(log, GreasyLog::debug, toString(workerId), "Received fired signal!");
+      fired = true;
+    } else if (header.type == MPIEngine::taskMessage) {
+      readTaskIds(message, localQueue);
+    } else {
+      LOG_RECORD(log, GreasyLog::error, "WORKER("+toString(workerId)+")", "Unexpected message of type " + toString((int)header.type));
+    }
+  }
+
+  // Tasks that just arrived start waiting now
+  arrivals.resize(localQueue.size(), GreasyTimer::usecsNow());
+
+  return progress;
+
+}
+
+bool MPIWorker::startTasks() {
+
+  bool progress = false;
+  pid_t pid;
+  map<int,string>::iterator command;
+  reportEntry report;
+
+  while (((int) children.size() < taskSlots) && !localQueue.empty()) {
+    progress = true;
+    command = taskCommands.find(localQueue.front());
+    pid = -1;
+    if (command != taskCommands.end()) {
+      LOG_RECORD(log, GreasyLog::debug, toString(workerId), "Running task " + command->second);
+      LOG_RECORD(log, GreasyLog::info, "Worker " +toString(workerId) + " on node " + hostname);
+      pid = spawnTask(command->second);
+    } else {
+      LOG_RECORD(log, GreasyLog::error, "WORKER("+toString(workerId)+")", "Unknown task " + toString(localQueue.front()));
+    }
+    if (pid > 0) {
+      children[pid].taskId = localQueue.front();
+      children[pid].startDelay = (long long) GreasyTimer::usecsNow() - arrivals.front();
+      children[pid].timer.start();
+    } else {
+      if (command != taskCommands.end()) LOG_RECORD(log, GreasyLog::error, "WORKER("+toString(workerId)+")", "Could not execute a new process");
+      report.taskId = localQueue.front();
+      report.retcode = -1;
+      report.elapsed = 0;
+      clearUsage(report.usage);
+      report.startDelay = -1;
+      queueReport(report, -1);
+    }
+    localQueue.pop_front();
+    arrivals.pop_front();
+  }
+
+  return progress;
+
+}
+
+bool MPIWorker::collectTasks(bool wait) {
+
+  int retcode = -1;
+  bool progress = false;
+  pid_t pid;
+  reportEntry report;
+
+  if (children.empty()) return false;
+
+  // If all the slots are busy there is nothing else to do, so just wait for any of them.
+  if (wait && ((int) children.size() >= taskSlots) && (heartbeat == 0)) {
+    sendReports();
+    pid = waitTask(-1, 0, &retcode, &report.usage);
+  } else {
+    pid = waitTask(-1, WNOHANG, &retcode, &report.usage);
+  }
+  while (pid > 0) {
+    progress = true;
+    if (children.find(pid) != children.end()) {
+      children[pid].timer.stop();
+      report.taskId = children[pid].taskId;
+      report.retcode = retcode;
+      report.elapsed = children[pid].timer.usecsElapsed();
+      report.startDelay = children[pid].startDelay;
+      children.erase(pid);
+
+      LOG_RECORD(log, GreasyLog::debug, toString(workerId), "Task finished with retcode (" + toString(retcode) + "). Elapsed: " + GreasyTimer::usecsToTime(report.elapsed));
+      queueReport(report, GreasyTimer::usecsNow());
+    }
+    pid = waitTask(-1, WNOHANG, &retcode, &report.usage);
+  }
+
+  return progress;
+
+}
+
+void MPIWorker::endIteration(bool progress) {
+
+  // Report to the master the end of the tasks. While there are more tasks
+  // to run, the reports may be held for a while to batch them with others.
+  if (!pendingReports.empty() && ((pendingReports.size() >= reportBatch)||((MPI_Wtime()-firstReportTime)*1000 >= reportDelay))) {
+    sendReports();
+  }
+
+  // Let the master know we are alive while there is nothing to report
+  if (!fired) sendHeartbeat();
+
+  // Nothing happened: wait a bit before polling again. The sleep gets
+  // longer while idle, and it is interrupted when a task finishes.
+  if (progress) {
+    idle = 0;
+  } else if (!fired || !children.empty()) {
+    idle = (idle == 0) ? 100 : min(2*idle, 10000);
+    usleep(idle);
+  }
+
+}
+
+void MPIWorker::readTaskIds(const vector<char>& message, deque<int>& queue) {
+
+  msgHeader header;
+  int id;
+
+  memcpy(&header, &message[0], sizeof(msgHeader));
+  if (header.count == 0) queue.push_back(header.taskId);
+  for (int i=0; (i<header.count) && (sizeof(msgHeader) + (i+1)*sizeof(int) <= message.size()); i++) {
+    memcpy(&id, &message[sizeof(msgHeader) + i*sizeof(int)], sizeof(int));
+    queue.push_back(id);
+  }
+
+}
+
+bool MPIWorker::claimTasks() {
+
+  int first;
+
+  MPI_Fetch_and_op(&chunkSize, &first, MPI_INT, 0, 0, MPI_SUM, taskWindow);
+  MPI_Win_flush(0, taskWindow);
+
+  for (int i=first; (i<first+chunkSize) && (i<(int) taskOrder.size()); i++) localQueue.push_back(taskOrder[i]);
+  LOG_RECORD(log, GreasyLog::devel, "MPIWorker::claimTasks("+toString(workerId)+")", "Claimed tasks from index " + toString(first));
+
+  return (first < (int) taskOrder.size());
+
+}
+
+pid_t MPIWorker::spawnTask(const string& command) {
+
+  pid_t pid = fork();
+
+  if (pid == 0) {
+    // Child: run the command through the shell, as system() would do.
+    // Only the master is in charge of the restarts and messages.
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    execl("/bin/sh", "sh", "-c", command.c_str(), (char*) NULL);
+    _exit(127);
+  }
+
+  return pid;
+
+}
+
+void MPIWorker::queueReport(const reportEntry& report, long long ended) {
+
+  if (pendingReports.empty()) firstReportTime = MPI_Wtime();
+  pendingReports.push_back(report);
+  pendingEnds.push_back(ended);
+
+}
+
+void MPIWorker::sendReports() {
+
+  msgHeader header;
+  vector<char> message;
+  long long now = GreasyTimer::usecsNow();
+
+  if (pendingReports.empty()) return;
+
+  // The delay of each report lasts until it is sent
+  for (size_t i=0; i<pendingReports.size(); i++) {
+    pendingReports[i].noticeDelay = (pendingEnds[i] < 0) ? -1 : now - pendingEnds[i];
+  }
+
+  header.version = MPI_PROTOCOL_VERSION;
+  header.type = MPIEngine::reportMessage;
+  header.taskId = -1;
+
+  // Never more than reportBatch reports in a message, so that the count fits
+  for (unsigned int first=0; first<pendingReports.size(); first+=reportBatch) {
+    header.count = min((unsigned int)pendingReports.size() - first, reportBatch);
+    message.resize(sizeof(msgHeader) + header.count*sizeof(reportEntry));
+    memcpy(&message[0], &header, sizeof(msgHeader));
+    memcpy(&message[sizeof(msgHeader)], &pendingReports[first], header.count*sizeof(reportEntry));
+
+    LOG_RECORD(log, GreasyLog::devel, "MPIWorker::sendReports("+toString(workerId)+")", "Sending " + toString(header.count) + " reports");
+    MPI_Send(&message[0], message.size(), MPI_BYTE, 0, 0, masterComm);
+  }
+  pendingReports.clear();
+  pendingEnds.clear();
+  lastSendTime = MPI_Wtime();
+
+}
+
+void MPIWorker::sendHeartbeat() {
+
+  msgHeader header;
+
+  if ((heartbeat == 0)||(MPI_Wtime() - lastSendTime < heartbeat)) return;
+
+  header.version = MPI_PROTOCOL_VERSION;
+  header.type = MPIEngine::heartbeatMessage;
+  header.count = 0;
+  header.taskId = -1;
+
+  MPI_Send(&header, sizeof(msgHeader), MPI_BYTE, 0, 0, masterComm);
+  lastSendTime = MPI_Wtime();
+
+}
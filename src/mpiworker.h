@@ -0,0 +1,190 @@
+/*
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ *
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#ifndef MPIWORKER_H
+#define MPIWORKER_H
+
+#include <string>
+#include <sys/types.h>
+#include <deque>
+#include <map>
+#include <vector>
+
+#include "mpiengine.h"
+
+/**
+ * Task run by a worker, until it ends.
+ */
+typedef struct {
+    int taskId; /**< Task being run. */
+    long long startDelay; /**< Microseconds the task waited on the worker before starting. */
+    GreasyTimer timer; /**< Time elapsed running the command. */
+} workerChild;
+
+/**
+  * Side of the MPI engine that runs on the ranks other than the master. It
+  * holds the commands of the tasks and runs one of the loops of the engine:
+  * the worker that gets its tasks from the master, the worker that takes
+  * them itself from the counter of the master, or the node sub-master.
+  */
+class MPIWorker
+{
+
+public:
+
+  /**
+   * Constructor of the side of a rank that talks to a master.
+   * @param id The worker id of the rank.
+   * @param host The node where the rank runs.
+   * @param comm The communicator of the master, which is rank 0 in it.
+   * @param slots The number of tasks the rank runs at the same time.
+   * @param heartbeatInterval Seconds between heartbeats. 0 disables them.
+   */
+  MPIWorker(int id, const string& host, MPI_Comm comm, int slots, double heartbeatInterval);
+
+  /**
+   * Add a task to the ones the worker may be asked to run.
+   * @param taskId The task id.
+   * @param command The command for the shell.
+   */
+  void addTask(int taskId, const string& command);
+
+  /**
+   * Main worker loop when the master schedules the tasks.
+   * It runs the tasks sent by the master until the end signal is received.
+   * @param waveSize Number of tasks scattered by the master at startup, or 0.
+   */
+  void runWorker(int waveSize);
+
+  /**
+   * Main worker loop when the workers schedule themselves.
+   * It takes the tasks from the counter of the master, in the order they
+   * were added, and also runs the retries the master sends, until the end
+   * signal is received.
+   * @param window Window exposing the counter of the master.
+   * @param chunk Number of tasks taken at once.
+   */
+  void runSelfScheduled(MPI_Win window, int chunk);
+
+  /**
+   * Main node sub-master loop.
+   * It hands the tasks sent by the master to the workers of its node, and
+   * forwards their reports to the master, until the end signal is received.
+   * @param nodeComm The communicator of the node, where the sub-master is rank 0.
+   * @param localCapacity Number of tasks each rank of the node runs.
+   */
+  void runSubMaster(MPI_Comm nodeComm, const vector<int>& localCapacity);
+
+  /**
+   * Start the command of a task in a child process. The master also uses it
+   * to run tasks in its own slots.
+   * @param command The command to run.
+   * @return The pid of the child, or -1 if it could not be created.
+   */
+  static pid_t spawnTask(const string& command);
+
+protected:
+
+  /**
+   * Check if the loop of a worker has to go on.
+   * @return true until the end signal is received and all the tasks have finished.
+   */
+  bool isBusy();
+
+  /**
+   * Get the commands sent by the master. Only block if there is nothing
+   * queued or running, otherwise just take the ones that already arrived.
+   * @return true if any message was received.
+   */
+  bool receiveTasks();
+
+  /**
+   * Start queued tasks while there are free slots.
+   * @return true if any task was started or reported as failed.
+   */
+  bool startTasks();
+
+  /**
+   * Collect the tasks finished.
+   * @param wait If true and all the slots are busy, block until any task finishes.
+   * @return true if any task finished.
+   */
+  bool collectTasks(bool wait);
+
+  /**
+   * Send the reports due and the heartbeat, and sleep if nothing happened.
+   * @param progress Whether anything happened in this iteration of the loop.
+   */
+  void endIteration(bool progress);
+
+  /**
+   * Claim the next tasks from the counter exposed by the master.
+   * @return false if there were no tasks left to claim.
+   */
+  bool claimTasks();
+
+  /**
+   * Add the task ids carried by a task message to a queue.
+   * @param message The message received.
+   * @param queue The queue where the ids are added.
+   */
+  void readTaskIds(const vector<char>& message, deque<int>& queue);
+
+  /**
+   * Hold the report of a finished task until it is sent to the master.
+   * @param report The report.
+   * @param ended Time the task ended, on the monotonic clock, or -1 if it did not run.
+   */
+  void queueReport(const reportEntry& report, long long ended);
+
+  /**
+   * Send all the pending reports of finished tasks to the master in a single message.
+   */
+  void sendReports();
+
+  /**
+   * Send a heartbeat to the master if nothing was sent during the last interval.
+   */
+  void sendHeartbeat();
+
+  GreasyLog* log; ///< Log of the run.
+  int workerId; ///< Id of the worker.
+  string hostname; ///< Node where the worker runs.
+  MPI_Comm masterComm; ///< Communicator used to talk to the master, which is rank 0 in it.
+  int taskSlots; ///< Number of tasks the worker runs at the same time.
+  double heartbeat; ///< Seconds between heartbeats. 0 disables them.
+  double lastSendTime; ///< Time of the last message sent to the master.
+  bool fired; ///< Flag to know if the end signal was received.
+  int idle; ///< Microseconds slept in the last iteration without progress.
+  map<int,string> taskCommands; ///< Command of each task, replicated from the master.
+  vector<int> taskOrder; ///< Task ids in the order they are claimed.
+  MPI_Win taskWindow; ///< Window exposing the counter of the master when self scheduling.
+  int chunkSize; ///< Number of tasks claimed at once when self scheduling.
+  deque<int> localQueue; ///< Tasks waiting for a free slot.
+  deque<long long> arrivals; ///< Time each queued task arrived, on the monotonic clock.
+  map<pid_t, workerChild> children; ///< Tasks running, by pid.
+  vector<reportEntry> pendingReports; ///< Reports not sent to the master yet.
+  vector<long long> pendingEnds; ///< Time each pending report's task ended, on the monotonic clock, or -1.
+  double firstReportTime; ///< Time when the oldest pending report was produced.
+  unsigned int reportBatch; ///< Maximum number of reports sent in a single message.
+  int reportDelay; ///< Maximum milliseconds a report can be held to batch it with others.
+
+};
+
+#endif // MPIWORKER_H
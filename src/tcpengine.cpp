@@ -0,0 +1,479 @@
+/* 
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ * 
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ * 
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#include "tcpengine.h"
+#include "greasytcp.h"
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifndef HOST_NAME_MAX
+#include <limits>
+#define HOST_NAME_MAX sysconf (_SC_HOST_NAME_MAX)
+#endif
+
+TcpEngine::TcpEngine ( const string& filename) : AbstractSchedulerEngine(filename){
+
+  engineType="tcp";
+  listenFd = -1;
+  port = 0;
+  nextAgent = 1;
+  readyAgents = 0;
+  maxSlots = 0;
+  workerTimeout = 600;
+  helloTimeout = 10;
+
+}
+
+void TcpEngine::init() {
+
+  struct sockaddr_in address;
+  socklen_t length = sizeof(address);
+  int yes = 1;
+
+  LOG_RECORD(log, GreasyLog::devel, "TcpEngine::init", "Entering...");
+
+  // Here the workers are the agents required to start, not the ones that may join later
+  nworkers = 1;
+  if (config->keyExists("TcpMinWorkers")) fromString(nworkers, config->getValue("TcpMinWorkers"));
+  if (config->keyExists("TcpPort")) fromString(port, config->getValue("TcpPort"));
+  if (config->keyExists("TcpWorkerTimeout")) fromString(workerTimeout, config->getValue("TcpWorkerTimeout"));
+  if (config->keyExists("TcpHelloTimeout")) fromString(helloTimeout, config->getValue("TcpHelloTimeout"));
+  if (helloTimeout < 1) helloTimeout = 1;
+
+  AbstractSchedulerEngine::init();
+
+  if (config->keyExists("TcpToken")) {
+    token = config->getValue("TcpToken");
+  } else {
+    // A random token keeps other users of the nodes from joining the run
+    unsigned char bytes[8];
+    ifstream random("/dev/urandom", ios::binary);
+    random.read((char*)bytes, sizeof(bytes));
+    for (unsigned int i=0; i<sizeof(bytes); i++) {
+      char hex[3];
+      snprintf(hex, sizeof(hex), "%02x", bytes[i]);
+      token += hex;
+    }
+  }
+
+  if (config->keyExists("TcpAddressFile")) {
+    addressFile = config->getValue("TcpAddressFile");
+  } else {
+    addressFile = restartFile.substr(0, restartFile.rfind(".rst")) + ".addr";
+  }
+
+  if (!isReady()) {
+    LOG_RECORD(log, GreasyLog::devel, "TcpEngine::init", "Exiting...");
+    return;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port);
+
+  listenFd = socket(AF_INET, SOCK_STREAM, 0);
+  if ((listenFd < 0)
+      || (setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0)
+      || (bind(listenFd, (struct sockaddr*)&address, sizeof(address)) < 0)
+      || (listen(listenFd, SOMAXCONN) < 0)
+      || (getsockname(listenFd, (struct sockaddr*)&address, &length) < 0)) {
+    LOG_RECORD(log, GreasyLog::error, "Could not listen on port " + toString(port) + ": " + strerror(errno));
+    ready = false;
+  } else {
+    port = ntohs(address.sin_port);
+    fcntl(listenFd, F_SETFD, FD_CLOEXEC);
+    if (writeAddressFile()) {
+      LOG_RECORD(log, GreasyLog::info, "Waiting for greasy-worker agents on port " + toString(port)
+                  + ". Address written to " + addressFile);
+    } else {
+      ready = false;
+    }
+  }
+
+  LOG_RECORD(log, GreasyLog::devel, "TcpEngine::init", "Exiting...");
+
+}
+
+bool TcpEngine::writeAddressFile() {
+
+  char hostname[HOST_NAME_MAX];
+  string tmpFile = addressFile + ".tmp";
+
+  gethostname(hostname, sizeof(hostname));
+
+  // Only the owner may read the token. The rename makes the file appear complete
+  // to agents polling for it.
+  int fd = open(tmpFile.c_str(), O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+  if (fd < 0) {
+    LOG_RECORD(log, GreasyLog::error, "Could not create address file " + addressFile);
+    return false;
+  }
+  string contents = string(hostname) + " " + toString(port) + " " + token + "\n";
+  bool written = (write(fd, contents.c_str(), contents.size()) == (ssize_t)contents.size());
+  close(fd);
+  if (!written || (rename(tmpFile.c_str(), addressFile.c_str()) != 0)) {
+    LOG_RECORD(log, GreasyLog::error, "Could not write address file " + addressFile);
+    unlink(tmpFile.c_str());
+    return false;
+  }
+  return true;
+
+}
+
+void TcpEngine::run() {
+
+  LOG_RECORD(log, GreasyLog::devel, "TcpEngine::run", "Entering...");
+
+  if (isReady()) {
+    // Start once the agents required have joined. Others may join later.
+    lockState();
+    while ((readyAgents < nworkers)) {
+      GreasyTrace::getInstance()->beginWait();
+      waitForAnyWorker();
+      GreasyTrace::getInstance()->endWait();
+      if (nslots == 0) break;
+    }
+    unlockState();
+    LOG_RECORD(log, GreasyLog::info, "Starting with " + toString(readyAgents) + " agents and " + toString(nslots) + " slots");
+    runScheduler();
+  }
+
+  LOG_RECORD(log, GreasyLog::devel, "TcpEngine::run", "Exiting...");
+
+}
+
+void TcpEngine::finalize() {
+
+  map<int, tcpAgent>::iterator it;
+
+  LOG_RECORD(log, GreasyLog::devel, "TcpEngine::finalize", "Entering...");
+
+  for (it=agents.begin(); it!=agents.end(); it++) {
+    if (it->second.ready) sendLine(it->second.fd, "BYE");
+    close(it->second.fd);
+  }
+  agents.clear();
+
+  if (listenFd >= 0) {
+    close(listenFd);
+    unlink(addressFile.c_str());
+  }
+
+  LOG_RECORD(log, GreasyLog::info, toString(nextAgent - 1) + " agents connected along the run, with up to "
+              + toString(maxSlots) + " slots at the same time");
+
+  AbstractSchedulerEngine::finalize();
+
+  LOG_RECORD(log, GreasyLog::devel, "TcpEngine::finalize", "Exiting...");
+
+}
+
+int TcpEngine::getWorkerSlots(int worker) {
+
+  return 0;
+
+}
+
+int TcpEngine::getConcurrency() {
+
+  return maxSlots;
+
+}
+
+void TcpEngine::allocate(GreasyTask* task) {
+
+  int worker;
+  string command;
+
+  LOG_RECORD(log, GreasyLog::devel, "TcpEngine::allocate", "Entering...");
+
+  worker = freeWorkers.front();
+  freeWorkers.pop();
+
+  LOG_RECORDF(log, GreasyLog::info, "", "Allocating task %d located in line %d to Worker %d", task->getTaskNum(), task->getTaskId(), worker);
+
+  command = task->getCommand();
+  if (task->hasWorkDir()) command = "cd " + task->getWorkDir() + " && " + command;
+
+  LOG_RECORD(log, GreasyLog::debug,  "Task " + toString(task->getTaskNum()) + " located in line "+ toString(task->getTaskId()) + " to Worker " + toString(worker) + " wants to execute " + command);
+
+  task->setTaskState(GreasyTask::running);
+  task->setWorker(worker);
+  task->setHostname(agents[worker].hostname);
+  agents[worker].tasks.push_back(task->getTaskId());
+  notifyTaskEvent(GreasyEvents::dispatched, task);
+
+  // If the agent is gone, its socket will report it and the task will be queued again
+  if (!sendLine(agents[worker].fd, "TASK " + toString(task->getTaskId()) + " " + command)) {
+    LOG_RECORD(log, GreasyLog::warning, "Could not send task " + toString(task->getTaskId()) + " to Worker " + toString(worker));
+  }
+
+  LOG_RECORD(log, GreasyLog::devel, "TcpEngine::allocate", "Exiting...");
+
+}
+
+void TcpEngine::waitForAnyWorker() {
+
+  vector<struct pollfd> fds;
+  vector<int> ids;
+  vector<string> lines;
+  map<int, tcpAgent>::iterator it;
+  struct pollfd pfd;
+  bool changed = false;
+  int timeout, n;
+  time_t now, deadline;
+  time_t idleSince = time(NULL);
+
+  LOG_RECORD(log, GreasyLog::devel, "TcpEngine::waitForAnyWorker", "Entering...");
+
+  while (!changed || (nslots == 0)) {
+
+    fds.clear();
+    ids.clear();
+    pfd.fd = listenFd;
+    pfd.events = POLLIN;
+    fds.push_back(pfd);
+    ids.push_back(0);
+    for (it=agents.begin(); it!=agents.end(); it++) {
+      pfd.fd = it->second.fd;
+      fds.push_back(pfd);
+      ids.push_back(it->first);
+    }
+
+    // Without slots there is nothing to wait for but new agents, and not forever
+    now = time(NULL);
+    deadline = 0;
+    if (nslots == 0) {
+      if (changed) idleSince = now;
+      changed = false;
+      deadline = idleSince + workerTimeout;
+    }
+    // Neither for connections that did not say hello yet
+    for (it=agents.begin(); it!=agents.end(); it++) {
+      if (!it->second.ready && ((deadline == 0) || (it->second.connected + helloTimeout < deadline)))
+        deadline = it->second.connected + helloTimeout;
+    }
+    timeout = (deadline == 0) ? -1 : max(0, (int)(deadline - now))*1000;
+
+    unlockState();
+    n = poll(&fds[0], fds.size(), timeout);
+    lockState();
+    if ((n < 0)&&(errno == EINTR)) continue;
+    if (n < 0) {
+      LOG_RECORD(log, GreasyLog::error, string("Could not wait for agents: ") + strerror(errno));
+      break;
+    }
+
+    for (unsigned int i=1; i<fds.size(); i++) {
+      if (fds[i].revents == 0) continue;
+      lines.clear();
+      bool alive = readLines(fds[i].fd, agents[ids[i]].input, lines,
+                             agents[ids[i]].ready ? TCP_MAX_LINE : TCP_MAX_HELLO_LINE);
+      for (unsigned int j=0; j<lines.size() && alive; j++) {
+        if (processLine(ids[i], lines[j])) changed = true;
+        alive = (agents.count(ids[i]) > 0);
+      }
+      if (!alive) {
+        if (agents.count(ids[i]) > 0) loseAgent(ids[i]);
+        changed = true;
+      }
+    }
+
+    if (fds[0].revents & POLLIN) acceptAgent();
+
+    // Connections that did not say hello in time are closed
+    now = time(NULL);
+    for (it=agents.begin(); it!=agents.end(); ) {
+      if (!it->second.ready && (now >= it->second.connected + helloTimeout)) {
+        LOG_RECORD(log, GreasyLog::warning, "Closing connection from " + it->second.hostname + ": no hello after "
+                    + toString(helloTimeout) + " s");
+        close(it->second.fd);
+        agents.erase(it++);
+      } else {
+        it++;
+      }
+    }
+
+    if ((nslots == 0) && !changed && (now >= idleSince + workerTimeout)) {
+      LOG_RECORD(log, GreasyLog::error, "No agents connected for " + toString(workerTimeout) + " s");
+      break;
+    }
+
+  }
+
+  LOG_RECORD(log, GreasyLog::devel, "TcpEngine::waitForAnyWorker", "Exiting...");
+
+}
+
+void TcpEngine::acceptAgent() {
+
+  struct sockaddr_in address;
+  socklen_t length = sizeof(address);
+  tcpAgent agent;
+
+  int fd = accept(listenFd, (struct sockaddr*)&address, &length);
+  if (fd < 0) return;
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  agent.fd = fd;
+  agent.ready = false;
+  agent.connected = time(NULL);
+  agent.slots = 0;
+  agent.hostname = inet_ntoa(address.sin_addr);
+  agents[nextAgent++] = agent;
+
+  LOG_RECORD(log, GreasyLog::debug, "New connection from " + agent.hostname);
+
+}
+
+bool TcpEngine::processLine(int worker, const string& line) {
+
+  istringstream in(line);
+  string type, hostname, peerToken;
+  int version = 0, slots = 0, taskId = -1, retcode = -1;
+  unsigned long elapsed = 0;
+  long long startDelay = -1, noticeDelay = -1;
+  taskUsage usage;
+  GreasyTask* task = NULL;
+  deque<int>::iterator it;
+  tcpAgent& agent = agents[worker];
+
+  in >> type;
+
+  if (!agent.ready) {
+    in >> version >> slots >> peerToken >> hostname;
+    if ((type != "HELLO") || (version != TCP_PROTOCOL_VERSION) || (peerToken != token)
+        || (slots < 1) || (slots > TCP_MAX_SLOTS)) {
+      LOG_RECORD(log, GreasyLog::error, "Rejecting connection from " + agent.hostname + ": wrong version, token or slots");
+      close(agent.fd);
+      agents.erase(worker);
+      return false;
+    }
+    agent.ready = true;
+    agent.slots = slots;
+    agent.hostname = hostname;
+    for (int slot=0; slot<slots; slot++) freeWorkers.push(worker);
+    nslots += slots;
+    maxSlots = max(maxSlots, nslots);
+    readyAgents++;
+    LOG_RECORD(log, GreasyLog::info, "Worker " + toString(worker) + " joined from node " + hostname + " with "
+                + toString(slots) + " slots");
+    return true;
+  }
+
+  if (type != "DONE") {
+    LOG_RECORD(log, GreasyLog::error, "Unexpected message from worker " + toString(worker) + ": " + line);
+    return false;
+  }
+
+  in >> taskId >> retcode >> elapsed >> startDelay >> noticeDelay;
+  in >> usage.utime >> usage.stime >> usage.maxrss >> usage.nvcsw >> usage.nivcsw
+     >> usage.readBytes >> usage.writtenBytes;
+  it = find(agent.tasks.begin(), agent.tasks.end(), taskId);
+  if (in.fail() || (it == agent.tasks.end())) {
+    LOG_RECORD(log, GreasyLog::error, "Unexpected report from worker " + toString(worker) + ": " + line);
+    return false;
+  }
+  agent.tasks.erase(it);
+  task = taskMap[taskId];
+
+  // Push worker to the free workers queue again
+  freeWorkers.push(worker);
+
+  // Update task info with the report
+  task->setElapsedTime(elapsed);
+  task->setReturnCode(retcode);
+  task->setHostname(agent.hostname);
+  task->setUsage(usage);
+  task->setDelays(startDelay, noticeDelay);
+
+  taskEpilogue(task);
+  return true;
+
+}
+
+void TcpEngine::loseAgent(int worker) {
+
+  int maxRetries = 0;
+  GreasyTask* task = NULL;
+  queue<int> alive;
+  deque<int>::iterator it;
+  tcpAgent& agent = agents[worker];
+
+  LOG_RECORD(log, GreasyLog::devel, "TcpEngine::loseAgent", "Entering...");
+
+  close(agent.fd);
+  if (!agent.ready) {
+    agents.erase(worker);
+    LOG_RECORD(log, GreasyLog::devel, "TcpEngine::loseAgent", "Exiting...");
+    return;
+  }
+
+  LOG_RECORD(log, GreasyLog::warning, "Worker " + toString(worker) + " on node " + agent.hostname + " disconnected");
+
+  // Its slots will never be free again
+  while (!freeWorkers.empty()) {
+    if (freeWorkers.front() != worker) alive.push(freeWorkers.front());
+    freeWorkers.pop();
+  }
+  freeWorkers.swap(alive);
+  nslots -= agent.slots;
+  readyAgents--;
+
+  // Run its tasks elsewhere. A task lost too many times may be the one
+  // killing the agents, so it fails instead.
+  if (config->keyExists("MaxRetries")) fromString(maxRetries, config->getValue("MaxRetries"));
+  for (it=agent.tasks.begin(); it!=agent.tasks.end(); it++) {
+    task = taskMap[*it];
+    task->setHostname(agent.hostname);
+    if (task->getRetries() < max(1, maxRetries)) {
+      LOG_RECORD(log, GreasyLog::warning, "Task " + toString(task->getTaskNum()) + " located in line " + toString(task->getTaskId())
+                  + " was lost with worker " + toString(worker) + ". Queueing it again");
+      task->addRetryAttempt();
+      task->setTaskState(GreasyTask::waiting);
+      taskQueue.push(task);
+      notifyTaskEvent(GreasyEvents::retried, task);
+      notifyTaskEvent(GreasyEvents::queued, task);
+    } else {
+      LOG_RECORD(log, GreasyLog::error, "Task " + toString(task->getTaskNum()) + " located in line " + toString(task->getTaskId())
+                  + " was lost with worker " + toString(worker) + " too many times");
+      task->setReturnCode(-1);
+      task->setTaskState(GreasyTask::failed);
+      notifyTaskEvent(GreasyEvents::finished, task);
+      updateDependencies(task);
+    }
+  }
+  agents.erase(worker);
+
+  LOG_RECORD(log, GreasyLog::devel, "TcpEngine::loseAgent", "Exiting...");
+
+}
@@ -0,0 +1,140 @@
+/* 
+ * This file is part of GREASY software package
+ * Copyright (C) by the BSC-Support Team, see www.bsc.es
+ * 
+ * GREASY is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ * 
+ * GREASY is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with GREASY. If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#ifndef TCPENGINE_H
+#define TCPENGINE_H
+
+#include <string>
+#include <deque>
+#include <map>
+#include <ctime>
+
+#include "abstractschedulerengine.h"
+
+/**
+ * A greasy-worker agent connected to the tcp engine.
+ */
+typedef struct {
+    int fd; /**< Socket of the connection. */
+    bool ready; /**< Flag to know if the agent already said hello. */
+    time_t connected; /**< Time when the connection was accepted. */
+    int slots; /**< Number of tasks the agent runs at the same time. */
+    string hostname; /**< Node where the agent runs. */
+    string input; /**< Data received that does not complete a line yet. */
+    deque<int> tasks; /**< Tasks running in the agent. */
+} tcpAgent;
+
+/**
+  * This engine inherits AbstractSchedulerEngine, and implements an elastic scheduler
+  * for Greasy where greasy-worker agents connect to the master through TCP, at any
+  * time during the run, and pull the tasks to execute.
+  */
+class TcpEngine : public AbstractSchedulerEngine
+{
+
+public:
+
+  /**
+   * Constructor that adds the filename to process.
+   * @param filename path to the task file.
+   */
+  TcpEngine (const string& filename );
+
+  /**
+   * Perform the initialization of the engine and start listening for agents.
+   */
+  virtual void init();
+
+  /**
+   * Execute the engine, once the agents required have connected.
+   */
+  virtual void run();
+
+  /**
+   * Finalization of the engine. Agents still connected are told to finish.
+   */
+  virtual void finalize();
+
+protected:
+
+  /**
+   * Allocate a task in a free slot of an agent, sending the command to it.
+   * @param task A pointer to a GreasyTask object to allocate.
+   */
+  virtual void allocate(GreasyTask* task);
+
+  /**
+   * Wait for any agent to complete a task, to join or to leave. While no
+   * agents are connected, it keeps waiting up to the timeout configured.
+   */
+  virtual void waitForAnyWorker();
+
+  /**
+   * Agents bring their own slots when they join, so there are none at startup.
+   * @param worker The worker id.
+   * @return 0.
+   */
+  virtual int getWorkerSlots(int worker);
+
+  /**
+   * Get the number of tasks the agents could run at the same time.
+   * @return The maximum number of slots connected along the run.
+   */
+  virtual int getConcurrency();
+
+  /**
+   * Accept a new connection, which becomes an agent once it says hello.
+   */
+  void acceptAgent();
+
+  /**
+   * Process a line received from an agent.
+   * @param worker The agent id.
+   * @param line The line received.
+   * @return true if the state of the scheduler changed.
+   */
+  bool processLine(int worker, const string& line);
+
+  /**
+   * Forget an agent that disconnected: its slots are dropped and its tasks
+   * are queued again to run elsewhere.
+   * @param worker The agent id.
+   */
+  void loseAgent(int worker);
+
+  /**
+   * Write the address and token agents need to connect.
+   * @return true if the file was written.
+   */
+  bool writeAddressFile();
+
+  int listenFd; ///< Socket where agents connect.
+  int port; ///< Port where agents connect.
+  string token; ///< Secret agents must present to join.
+  string addressFile; ///< File where the address and token for the agents are written.
+  map<int, tcpAgent> agents; ///< Agents connected, by id.
+  int nextAgent; ///< Id for the next agent connected.
+  int readyAgents; ///< Number of agents that said hello and are still connected.
+  int maxSlots; ///< Maximum number of slots connected at the same time.
+  int workerTimeout; ///< Seconds to wait while no agents are connected.
+  int helloTimeout; ///< Seconds a new connection has to say hello.
+
+};
+
+#endif // TCPENGINE_H
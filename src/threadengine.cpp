@@ -28,18 +28,18 @@ ThreadEngine::ThreadEngine ( const string& filename) : AbstractEngine(filename){
 }
 
 void ThreadEngine::run(){
-	log->record(GreasyLog::devel, "ThreadEngine::run", "Entering...");
+	LOG_RECORD(log, GreasyLog::devel, "ThreadEngine::run", "Entering...");
 	if (isReady()) runScheduler();
-	log->record(GreasyLog::devel, "ThreadEngine::run", "Exiting...");
+	LOG_RECORD(log, GreasyLog::devel, "ThreadEngine::run", "Exiting...");
 }
 
 void ThreadEngine::init() {
 
-  log->record(GreasyLog::devel, "ThreadEngine::init", "Entering...");
+  LOG_RECORD(log, GreasyLog::devel, "ThreadEngine::init", "Entering...");
 
   AbstractEngine::init();
 
-  log->record(GreasyLog::devel, "ThreadEngine::init", "Exiting...");
+  LOG_RECORD(log, GreasyLog::devel, "ThreadEngine::init", "Exiting...");
 
 }
 
@@ -62,49 +62,56 @@ void ThreadEngine::dumpTasks(){
 void ThreadEngine::getDefaultNWorkers() {
 
     nworkers = tbb::task_scheduler_init::default_num_threads();
-    log->record(GreasyLog::debug, "ThreadEngine::getDefaultNWorkers", "Default nworkers: " + toString(nworkers));
+    LOG_RECORD(log, GreasyLog::debug, "ThreadEngine::getDefaultNWorkers", "Default nworkers: " + toString(nworkers));
 
 }
 
 void ThreadEngine::runScheduler(){
 
-  log->record(GreasyLog::devel, "ThreadEngine::runScheduler", "Entering...");
+  LOG_RECORD(log, GreasyLog::devel, "ThreadEngine::runScheduler", "Entering...");
 
   // Dummy check: let's see if there is any worker...
   if (nworkers==0) {
-    log->record(GreasyLog::error, "No workers found. Rerun greasy with more resources");
+    LOG_RECORD(log, GreasyLog::error, "No workers found. Rerun greasy with more resources");
     return;
   }
 
   // initialize the task scheduler
   tbb::task_scheduler_init init(nworkers) ;
 
-  log->record(GreasyLog::debug, "ThreadEngine::runScheduler", "Starting to launch tasks...");
+  LOG_RECORD(log, GreasyLog::debug, "ThreadEngine::runScheduler", "Starting to launch tasks...");
 
   set<int>::iterator it;
   GreasyTask* gtask  = NULL;
   vector<GreasyTask*> runnableTasks;
 
+  lockState();
   for ( it=validTasks.begin(); it!=validTasks.end(); it++ ) {
       gtask = taskMap[*it];
-      GreasyLog::getInstance()->record(GreasyLog::debug, "ThreadEngine::runScheduler", "Task "+ toString(gtask->getTaskId())+" state is '"+ gtask->printTaskState() +"'");
+      LOG_RECORD(GreasyLog::getInstance(), GreasyLog::debug, "ThreadEngine::runScheduler", "Task "+ toString(gtask->getTaskId())+" state is '"+ gtask->printTaskState() +"'");
+      // Arm the lock-free counter used to release the task once all its parents complete
+      gtask->resetPendingParents();
       if ( gtask->isWaiting() ){
-          GreasyLog::getInstance()->record(GreasyLog::debug, "ThreadEngine::runScheduler", "Scheduling task "+ toString(gtask->getTaskId()) );
+          LOG_RECORD(GreasyLog::getInstance(), GreasyLog::debug, "ThreadEngine::runScheduler", "Scheduling task "+ toString(gtask->getTaskId()) );
           runnableTasks.push_back(gtask);
+          notifyTaskEvent(GreasyEvents::queued, gtask);
       }
   }
 
+  unlockState();
+
   // start counter
   globalTimer.start();
 
-  tbb::parallel_do (runnableTasks.begin(), runnableTasks.end(),GreasyTBBTaskEngine(&taskMap,&validTasks,&revDepMap) );
+  // Each thread takes the state of the tasks only while it records the results of one
+  tbb::parallel_do (runnableTasks.begin(), runnableTasks.end(),GreasyTBBTaskEngine(&taskMap,&validTasks,&revDepMap,&stateLock) );
 
   // end counter
   globalTimer.stop();
 
-  log->record(GreasyLog::debug, "ThreadEngine::runScheduler", "All tasks lauched");
+  LOG_RECORD(log, GreasyLog::debug, "ThreadEngine::runScheduler", "All tasks lauched");
 
-  log->record(GreasyLog::devel, "ThreadEngine::runScheduler", "Exiting...");
+  LOG_RECORD(log, GreasyLog::devel, "ThreadEngine::runScheduler", "Exiting...");
 }
 
 /*************************************************************************************/
@@ -115,41 +122,57 @@ void ThreadEngine::runScheduler(){
 /***   GreasyTBBTaskEngine
 /***********************************/
 
-GreasyTBBTaskEngine::GreasyTBBTaskEngine(map<int,GreasyTask*> * taskMap_, set<int>* validTasks_ ,map<int,list<int> >*revDepMap_ )
-    : taskMap(taskMap_), validTasks(validTasks_),revDepMap(revDepMap_)
+GreasyTBBTaskEngine::GreasyTBBTaskEngine(map<int,GreasyTask*> * taskMap_, set<int>* validTasks_ ,map<int,list<int> >*revDepMap_, pthread_rwlock_t* stateLock_ )
+    : taskMap(taskMap_), validTasks(validTasks_),revDepMap(revDepMap_),stateLock(stateLock_)
 {;}
 
 
 void GreasyTBBTaskEngine::operator()( argument_type item, tbb::parallel_do_feeder<argument_type>& feed_it) const
 {
-    GreasyLog::getInstance()->record(GreasyLog::devel, "GreasyTBBTaskEngine::()", "Entering...");
+    LOG_RECORD(GreasyLog::getInstance(), GreasyLog::devel, "GreasyTBBTaskEngine::()", "Entering...");
 
-    string command = "cd " + item->getWorkDir() + " && " + item->getCommand() + item->getCommand();
+    string command = item->getCommand();
+    if (item->hasWorkDir()) command = "cd " + item->getWorkDir() + " && " + command;
 
-    GreasyLog::getInstance()->record(GreasyLog::debug, "GreasyTBBTaskEngine::()", "Executing command: " + command);
+    LOG_RECORD(GreasyLog::getInstance(), GreasyLog::debug, "GreasyTBBTaskEngine::()", "Executing command: " + command);
 
     item->setTaskState(GreasyTask::running);
+    notifyTaskEvent(GreasyEvents::dispatched, item);
 
     GreasyTimer timer;
     timer.reset();
     timer.start();
-    int retcode = system(command.c_str());
+    notifyTaskEvent(GreasyEvents::started, item);
+    // Run the command as system() would, but waiting for that very child to
+    // get the resources it used
+    int retcode = -1;
+    taskUsage usage;
+    clearUsage(usage);
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl("/bin/sh", "sh", "-c", command.c_str(), (char*) NULL);
+        _exit(127);
+    }
+    if ((pid < 0) || (waitTask(pid, 0, &retcode, &usage) < 0)) retcode = -1;
     timer.stop();
 
+    pthread_rwlock_rdlock(stateLock);
     item->setReturnCode(retcode);
-    item->setElapsedTime( timer.secsElapsed() );
+    item->setElapsedTime( timer.usecsElapsed() );
+    item->setUsage(usage);
 
     // task is finished here ...
     if (!taskEpilogue(item, feed_it) )
     {
         // task ended Ok ...
-        GreasyLog::getInstance()->record(GreasyLog::devel, "GreasyTBBTaskEngine::()", "Task "+  toString(item->getTaskId()) +" ended Ok"  );
+        LOG_RECORD(GreasyLog::getInstance(), GreasyLog::devel, "GreasyTBBTaskEngine::()", "Task "+  toString(item->getTaskId()) +" ended Ok"  );
     }else{
         // task failed ...
-        GreasyLog::getInstance()->record(GreasyLog::devel, "GreasyTBBTaskEngine::()", "Task "+  toString(item->getTaskId()) +" failed"  );
+        LOG_RECORD(GreasyLog::getInstance(), GreasyLog::devel, "GreasyTBBTaskEngine::()", "Task "+  toString(item->getTaskId()) +" failed"  );
     }
+    pthread_rwlock_unlock(stateLock);
 
-    GreasyLog::getInstance()->record(GreasyLog::devel, "GreasyTBBTaskEngine::()", "Exiting...");
+    LOG_RECORD(GreasyLog::getInstance(), GreasyLog::devel, "GreasyTBBTaskEngine::()", "Exiting...");
 }
 
 
@@ -159,20 +182,24 @@ bool GreasyTBBTaskEngine::taskEpilogue(argument_type gtask, tbb::parallel_do_fee
     int maxRetries=0;
     bool retval = false;
 
-    GreasyLog::getInstance()->record(GreasyLog::devel, "GreasyTBBTaskEngine::taskEpilogue", "Entering...");
+    LOG_RECORD(GreasyLog::getInstance(), GreasyLog::devel, "GreasyTBBTaskEngine::taskEpilogue", "Entering...");
 
     if ( GreasyConfig::getInstance()->keyExists("MaxRetries")) fromString(maxRetries, GreasyConfig::getInstance()->getValue("MaxRetries"));
 
+    notifyTaskEvent(GreasyEvents::finished, gtask);
+
     if (gtask->getReturnCode() != 0) {
-      GreasyLog::getInstance()->record(GreasyLog::error,  "Task " + toString(gtask->getTaskId()) + " failed with exit code " + toString(gtask->getReturnCode()) +". Elapsed: " + GreasyTimer::secsToTime(gtask->getElapsedTime()));
+      LOG_RECORDF(GreasyLog::getInstance(), GreasyLog::error, "", "Task %d failed with exit code %d. Elapsed: %s", gtask->getTaskId(), gtask->getReturnCode(), GreasyTimer::usecsToTime(gtask->getElapsedTime()).c_str());
 
       // Task failed, let's retry if we need to
       if ((maxRetries > 0) && (gtask->getRetries() < maxRetries)) {
-        GreasyLog::getInstance()->record(GreasyLog::warning,  "Retry "+ toString(gtask->getRetries()) + "/" + toString(maxRetries) + " of task " + toString(gtask->getTaskId()));
+        LOG_RECORDF(GreasyLog::getInstance(), GreasyLog::warning, "", "Retry %d/%d of task %d", gtask->getRetries(), maxRetries, gtask->getTaskId());
         gtask->addRetryAttempt();
+        notifyTaskEvent(GreasyEvents::retried, gtask);
+        notifyTaskEvent(GreasyEvents::queued, gtask);
 
         // allocate task again...
-        GreasyLog::getInstance()->record(GreasyLog::debug,  "Allocating again task " + toString(gtask->getTaskId()) + " retry attempt: " + toString(gtask->getRetries()) );
+        LOG_RECORD(GreasyLog::getInstance(), GreasyLog::debug,  "Allocating again task " + toString(gtask->getTaskId()) + " retry attempt: " + toString(gtask->getRetries()) );
         feed_it.add(gtask);
         retval= true;
 
@@ -181,14 +208,14 @@ bool GreasyTBBTaskEngine::taskEpilogue(argument_type gtask, tbb::parallel_do_fee
         updateDependencies(gtask,feed_it);
       }
     } else {
-      GreasyLog::getInstance()->record(GreasyLog::info,  "Task " + toString(gtask->getTaskId()) + " completed successfully. Elapsed: " +  GreasyTimer::secsToTime(gtask->getElapsedTime()));
+      LOG_RECORDF(GreasyLog::getInstance(), GreasyLog::info, "", "Task %d completed successfully. Elapsed: %s", gtask->getTaskId(), GreasyTimer::usecsToTime(gtask->getElapsedTime()).c_str());
       gtask->setTaskState(GreasyTask::completed);
 
       updateDependencies(gtask, feed_it);
 
     }
 
-    GreasyLog::getInstance()->record(GreasyLog::devel, "GreasyTBBTaskEngine::taskEpilogue", "Exiting...");
+    LOG_RECORD(GreasyLog::getInstance(), GreasyLog::devel, "GreasyTBBTaskEngine::taskEpilogue", "Exiting...");
 
     return retval;
 }
@@ -198,52 +225,60 @@ void GreasyTBBTaskEngine::updateDependencies(argument_type child, tbb::parallel_
 
     int taskId, state;
     list<int>::iterator it;
+    map<int,list<int> >::iterator dependants;
     GreasyLog* log =  GreasyLog::getInstance();
 
-    log->record(GreasyLog::devel, "GreasyTBBTaskEngine::updateDependencies", "Entering...");
+    LOG_RECORD(log, GreasyLog::devel, "GreasyTBBTaskEngine::updateDependencies", "Entering...");
 
     taskId = child->getTaskId();
     state  = child->getTaskState();
 
-    log->record(GreasyLog::devel, "GreasyTBBTaskEngine::updateDependencies", "Inspecting reverse deps for task " + toString(taskId));
+    // Every task reaching a final state comes through here
+    GreasyJournal::getInstance()->record(child);
 
-    if ( revDepMap->find(taskId) == revDepMap->end() ){
-        log->record(GreasyLog::devel, "GreasyTBBTaskEngine::updateDependencies", "The task "+ toString(taskId) + " does not have any other dependendant task. No update done.");
-        log->record(GreasyLog::devel, "GreasyTBBTaskEngine::updateDependencies", "Exiting...");
+    LOG_RECORD(log, GreasyLog::devel, "GreasyTBBTaskEngine::updateDependencies", "Inspecting reverse deps for task " + toString(taskId));
+
+    dependants = revDepMap->find(taskId);
+    if ( dependants == revDepMap->end() ){
+        LOG_RECORD(log, GreasyLog::devel, "GreasyTBBTaskEngine::updateDependencies", "The task "+ toString(taskId) + " does not have any other dependendant task. No update done.");
+        LOG_RECORD(log, GreasyLog::devel, "GreasyTBBTaskEngine::updateDependencies", "Exiting...");
         return;
     }
 
+    // Several threads may be releasing parents of the same dependant at once. Instead of
+    // touching the dependency list, each dependant keeps an atomic counter of pending
+    // parents, and state transitions are done with compare-and-set, so that a dependant
+    // is either fed or cancelled exactly once.
     GreasyTask* dependant;
-    for(it=(*revDepMap)[taskId].begin() ; it!=(*revDepMap)[taskId].end();it++ ) {
+    for(it=dependants->second.begin() ; it!=dependants->second.end();it++ ) {
 
-        // get the first dependant whose state is blocked
         dependant = (*taskMap)[*it];
-        log->record(GreasyLog::devel, "GreasyTBBTaskEngine::updateDependencies", "State of dependant task " + toString(dependant->getTaskId()) + " is " +  dependant->printTaskState() );
 
       if (state == GreasyTask::completed) {
-        log->record(GreasyLog::devel, "GreasyTBBTaskEngine::updateDependencies", "Remove dependency " + toString(taskId) + " from task " + toString(dependant->getTaskId()));
-        dependant->removeDependency(taskId);
-        if (!dependant->hasDependencies()) {
-            log->record(GreasyLog::devel, "GreasyTBBTaskEngine::updateDependencies", "Dependant task "+ toString(dependant->getTaskId()) + " new state is: '"+ dependant->printTaskState()+"'");
-
-            if (dependant->getTaskState() == GreasyTask::waiting ){
-                GreasyLog::getInstance()->record(GreasyLog::debug,  "Allocating task " + toString(dependant->getTaskId())) ;
+        LOG_RECORD(log, GreasyLog::devel, "GreasyTBBTaskEngine::updateDependencies", "Release dependency " + toString(taskId) + " from task " + toString(dependant->getTaskId()));
+        if (dependant->releaseParent() == 0) {
+            if (dependant->compareAndSetTaskState(GreasyTask::blocked, GreasyTask::waiting)) {
+                LOG_RECORD(GreasyLog::getInstance(), GreasyLog::debug,  "Allocating task " + toString(dependant->getTaskId())) ;
+                notifyTaskEvent(GreasyEvents::queued, dependant);
                 feed_it.add(dependant);
+            } else {
+                LOG_RECORD(log, GreasyLog::devel, "GreasyTBBTaskEngine::updateDependencies", "Dependant task "+ toString(dependant->getTaskId()) + " is '"+ dependant->printTaskState()+"', so it is not allocated");
             }
-
         } else {
-            log->record(GreasyLog::devel, "GreasyTBBTaskEngine::updateDependencies", "The task still has dependencies, so leave its state '" + dependant->printTaskState() +"'" );
+            LOG_RECORD(log, GreasyLog::devel, "GreasyTBBTaskEngine::updateDependencies", "The task still has dependencies, so leave its state '" + dependant->printTaskState() +"'" );
         }
       }
       else if ((state == GreasyTask::failed)||(state == GreasyTask::cancelled)) {
-        log->record(GreasyLog::warning,  "Cancelling task " + toString(dependant->getTaskId()) + " because of task " + toString(taskId) + " failure");
-        log->record(GreasyLog::devel, "GreasyTBBTaskEngine::updateDependencies", "Parent failed: cancelling task and removing it from blocked");
-        dependant->setTaskState(GreasyTask::cancelled);
-
-        updateDependencies(dependant,feed_it);
+        if (dependant->compareAndSetTaskState(GreasyTask::blocked, GreasyTask::cancelled)) {
+            notifyTaskEvent(GreasyEvents::cancelled, dependant, taskId);
+            LOG_RECORD(log, GreasyLog::warning,  "Cancelling task " + toString(dependant->getTaskId()) + " because of task " + toString(taskId) + " failure");
+            updateDependencies(dependant,feed_it);
+        } else {
+            LOG_RECORD(log, GreasyLog::devel, "GreasyTBBTaskEngine::updateDependencies", "Dependant task "+ toString(dependant->getTaskId()) + " was already released or cancelled");
+        }
       }
     }
 
-    log->record(GreasyLog::devel, "GreasyTBBTaskEngine::updateDependencies", "Exiting...");
+    LOG_RECORD(log, GreasyLog::devel, "GreasyTBBTaskEngine::updateDependencies", "Exiting...");
 
 }
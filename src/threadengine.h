@@ -107,7 +107,7 @@ class GreasyTBBTaskEngine {
         /**
           * Constructor
           **/
-        GreasyTBBTaskEngine(map<int,GreasyTask*> * taskMap_, set<int>* validTasks_ ,map<int,list<int> >*revDepMap_ );
+        GreasyTBBTaskEngine(map<int,GreasyTask*> * taskMap_, set<int>* validTasks_ ,map<int,list<int> >*revDepMap_, pthread_rwlock_t* stateLock_ );
 
         typedef GreasyTask* argument_type; // typedef for function object
 
@@ -122,6 +122,7 @@ class GreasyTBBTaskEngine {
         map<int,GreasyTask*> * taskMap;
         set<int>* validTasks;
         map<int,list<int> >*revDepMap;
+        pthread_rwlock_t* stateLock; // Taken while the results of a task are recorded
 
         bool taskEpilogue(argument_type gtask, tbb::parallel_do_feeder<argument_type>& feed_it ) const;
         void updateDependencies(argument_type child, tbb::parallel_do_feeder<argument_type>& feed_it) const;